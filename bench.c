@@ -0,0 +1,389 @@
+// microbenchmarks for the storage engine, written out as JSON.
+// build: make bench
+// usage: ./bench [--frames N] [--max-rows N] [--lookups N] [--file path] [--mmap] [--wal]
+//                [--compress] [--direct] [--threads N]
+//
+// for each table size from 1000 rows up to --max-rows, by tens: sequential
+// and random insert rate with split counts, point lookup latency
+// percentiles and full scan throughput, each with a warm and a cold cache.
+// cold means the table was reopened, so the buffer pool is empty, and the
+// file dropped from the OS page cache. --threads runs the concurrent
+// lookup/insert mix instead.
+#define DB_NO_MAIN
+#include "db.c"
+
+double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t nowNanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift, so runs are repeatable without depending on rand()
+uint64_t benchRandom(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+void shuffleKeys(uint32_t* keys, uint32_t count, uint64_t* state) {
+    for (uint32_t i = count - 1; i > 0; i--) {
+        uint32_t j = benchRandom(state) % (i + 1);
+        uint32_t tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+int compareLatencies(const void* a, const void* b) {
+    uint64_t left = *(const uint64_t*)a;
+    uint64_t right = *(const uint64_t*)b;
+    return (left > right) - (left < right);
+}
+
+// write the file out and ask the kernel to forget it. the next reads come
+// from the device, as far as an unprivileged process can arrange
+void dropFileCache(const char* filename) {
+    int fileDescriptor = open(filename, O_RDONLY);
+    if (fileDescriptor == -1) {
+        perror("Error opening db file to drop from cache\n");
+        exit(EXIT_FAILURE);
+    }
+    fdatasync(fileDescriptor);
+    posix_fadvise(fileDescriptor, 0, 0, POSIX_FADV_DONTNEED);
+    close(fileDescriptor);
+}
+
+void fillRow(Row* row, uint32_t key) {
+    row->id = key;
+    snprintf(row->username, sizeof(row->username), "user%u", key);
+    snprintf(row->email, sizeof(row->email), "user%u@example.com", key);
+}
+
+// insert keys into a fresh table in the given order and print how it went.
+// the table is returned open for the lookups and scans that follow
+Table* benchInsert(const char* name, const char* filename, DbOptions* options, uint32_t* keys, uint32_t numRows) {
+    unlink(filename);
+    Table* table = dbOpen(filename, options);
+
+    Statement statement;
+    statement.type = STATEMENT_INSERT;
+    double start = nowSeconds();
+    for (uint32_t i = 0; i < numRows; i++) {
+        fillRow(&(statement.rowToInsert), keys[i]);
+        if (executeInsert(&statement, table) != EXECUTE_SUCCESS) {
+            printf("Insert of %u failed.\n", keys[i]);
+            exit(EXIT_FAILURE);
+        }
+        dbCommit(table);
+    }
+    double seconds = nowSeconds() - start;
+
+    printf("      \"%s\": {\"seconds\": %.6f, \"ops_per_sec\": %.0f, \"ns_per_op\": %.1f, "
+        "\"leaf_splits\": %lu, \"internal_splits\": %lu, \"pages\": %u, \"depth\": %u},\n",
+        name, seconds, numRows / seconds, seconds * 1e9 / numRows,
+        table->stats.leafSplits, table->stats.internalSplits, table->pager->numPages, tableDepth(table));
+    return table;
+}
+
+// time each of numLookups point lookups of random existing keys
+void benchLookups(const char* name, Table* table, uint32_t numRows, uint32_t numLookups, uint64_t* state) {
+    uint64_t* latencies = malloc(sizeof(uint64_t) * numLookups);
+    PagerStats before = table->pager->stats;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < numLookups; i++) {
+        uint32_t key = benchRandom(state) % numRows + 1;
+        uint64_t start = nowNanoseconds();
+        Cursor cursor;
+        tableFind(table, key, &cursor);
+        bool found = (*leafNodeKey(cursor.leaf, cursor.cellNum) == key);
+        closeCursor(&cursor);
+        latencies[i] = nowNanoseconds() - start;
+        total += latencies[i];
+        if (!found) {
+            printf("Lookup of %u failed.\n", key);
+            exit(EXIT_FAILURE);
+        }
+    }
+    PagerStats after = table->pager->stats;
+
+    qsort(latencies, numLookups, sizeof(uint64_t), compareLatencies);
+    printf("      \"%s\": {\"lookups\": %u, \"mean_ns\": %.1f, \"p50_ns\": %lu, \"p90_ns\": %lu, "
+        "\"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu, \"misses_per_op\": %.3f},\n",
+        name, numLookups, (double)total / numLookups,
+        latencies[numLookups / 2], latencies[(uint64_t)numLookups * 90 / 100],
+        latencies[(uint64_t)numLookups * 99 / 100], latencies[(uint64_t)numLookups * 999 / 1000],
+        latencies[numLookups - 1], (double)(after.misses - before.misses) / numLookups);
+    free(latencies);
+}
+
+// walk every row in key order through a snapshot, as long selects do,
+// counting the bytes stored for each
+void benchScan(const char* name, Table* table, uint32_t numRows, bool last) {
+    uint64_t rows = 0;
+    uint64_t bytes = 0;
+    double start = nowSeconds();
+    Snapshot snapshot;
+    tableBeginSnapshot(table, &snapshot);
+    Cursor cursor;
+    snapshotSeek(table, &snapshot, 0, &cursor);
+    while (!(cursor.endOfTable)) {
+        bytes += rowValueSize(cursorValue(&cursor));
+        rows++;
+        cursorAdvance(&cursor);
+    }
+    closeCursor(&cursor);
+    tableEndSnapshot(table, &snapshot);
+    double seconds = nowSeconds() - start;
+
+    if (rows != numRows) {
+        printf("Scan found %lu rows, expected %u.\n", rows, numRows);
+        exit(EXIT_FAILURE);
+    }
+    printf("      \"%s\": {\"seconds\": %.6f, \"rows_per_sec\": %.0f, \"mb_per_sec\": %.1f}%s\n",
+        name, seconds, rows / seconds, bytes / seconds / (1024 * 1024), last ? "" : ",");
+}
+
+// a select on a column with no index, which filters every leaf a batch at
+// a time. one in nine or so emails starts with "user1"
+void benchFilter(const char* name, Table* table, uint32_t numRows, bool last) {
+    Statement statement;
+    statement.type = STATEMENT_SELECT;
+    statement.numAggregates = 0;
+    statement.minId = 0;
+    statement.maxId = UINT32_MAX;
+    statement.byColumn = true;
+    statement.column = INDEX_EMAIL;
+    statement.prefix = true;
+    strcpy(statement.value, "user1");
+    OutputBuffer* output = newOutputBuffer();
+
+    double start = nowSeconds();
+    executeSelect(&statement, table, output);
+    double seconds = nowSeconds() - start;
+    uint64_t matches = 0;
+    for (size_t i = 0; i < output->length; i++) {
+        matches += (output->data[i] == '\n');
+    }
+    closeOutputBuffer(output);
+    printf("      \"%s\": {\"seconds\": %.6f, \"rows_per_sec\": %.0f, \"matches\": %lu}%s\n",
+        name, seconds, numRows / seconds, matches, last ? "" : ",");
+}
+
+void benchSize(const char* filename, DbOptions* options, uint32_t numRows, uint32_t maxLookups, bool last) {
+    uint32_t* keys = malloc(sizeof(uint32_t) * numRows);
+    for (uint32_t i = 0; i < numRows; i++) {
+        keys[i] = i + 1;
+    }
+    uint64_t state = 0x9e3779b97f4a7c15ULL ^ numRows;
+    uint32_t numLookups = (numRows < maxLookups) ? numRows : maxLookups;
+
+    printf("    {\n      \"rows\": %u,\n", numRows);
+    Table* table = benchInsert("sequential_insert", filename, options, keys, numRows);
+    dbClose(table);
+
+    shuffleKeys(keys, numRows, &state);
+    table = benchInsert("random_insert", filename, options, keys, numRows);
+    free(keys);
+
+    // warm: the table as the inserts left it, pool and page cache full
+    benchLookups("warm_lookup", table, numRows, numLookups, &state);
+    benchScan("warm_scan", table, numRows, false);
+    benchFilter("warm_filter", table, numRows, false);
+
+    dbClose(table);
+    dropFileCache(filename);
+    table = dbOpen(filename, options);
+    benchLookups("cold_lookup", table, numRows, numLookups, &state);
+    dbClose(table);
+    dropFileCache(filename);
+    table = dbOpen(filename, options);
+    benchScan("cold_scan", table, numRows, true);
+    dbClose(table);
+    unlink(filename);
+
+    printf("    }%s\n", last ? "" : ",");
+    fflush(stdout);
+}
+
+// one worker of the concurrent benchmark: nine lookups of existing keys
+// for every insert of a key only this worker uses
+typedef struct {
+    Table* table;
+    uint32_t numRows;
+    uint32_t numOps;
+    uint32_t worker;
+    uint32_t numWorkers;
+} BenchWorker;
+
+void* benchWorkerMain(void* arg) {
+    BenchWorker* worker = arg;
+    uint64_t state = 0x2545f4914f6cdd1dULL * (worker->worker + 1);
+    uint32_t nextKey = worker->numRows + 1 + worker->worker;
+    Statement statement;
+    statement.type = STATEMENT_INSERT;
+
+    for (uint32_t i = 0; i < worker->numOps; i++) {
+        if (i % 10 == 9) {
+            fillRow(&(statement.rowToInsert), nextKey);
+            if (executeInsert(&statement, worker->table) != EXECUTE_SUCCESS) {
+                printf("Insert of %u failed.\n", nextKey);
+                exit(EXIT_FAILURE);
+            }
+            dbCommit(worker->table);
+            nextKey += worker->numWorkers;
+            continue;
+        }
+
+        uint32_t key = benchRandom(&state) % worker->numRows + 1;
+        pthread_rwlock_rdlock(&(worker->table->lock));
+        Cursor cursor;
+        tableFind(worker->table, key, &cursor);
+        if (*leafNodeKey(cursor.leaf, cursor.cellNum) != key) {
+            printf("Lookup of %u failed.\n", key);
+            exit(EXIT_FAILURE);
+        }
+        closeCursor(&cursor);
+        pthread_rwlock_unlock(&(worker->table->lock));
+    }
+    return NULL;
+}
+
+// load numRows keys, then run a 90/10 lookup/insert mix from 1, 2, 4...
+// up to maxThreads threads, each on a fresh copy of the same table
+void benchConcurrent(const char* filename, DbOptions* options, uint32_t numRows, uint32_t maxThreads) {
+    const uint32_t opsPerThread = 200000;
+
+    printf("  \"concurrent\": [\n");
+    double baseline = 0;
+    for (uint32_t numThreads = 1; numThreads <= maxThreads; numThreads *= 2) {
+        unlink(filename);
+        Table* table = dbOpen(filename, options);
+        Statement statement;
+        statement.type = STATEMENT_INSERT;
+        for (uint32_t key = 1; key <= numRows; key++) {
+            fillRow(&(statement.rowToInsert), key);
+            executeInsert(&statement, table);
+        }
+
+        pthread_t threads[numThreads];
+        BenchWorker workers[numThreads];
+        double start = nowSeconds();
+        for (uint32_t i = 0; i < numThreads; i++) {
+            workers[i] = (BenchWorker){table, numRows, opsPerThread, i, numThreads};
+            pthread_create(&(threads[i]), NULL, benchWorkerMain, &(workers[i]));
+        }
+        for (uint32_t i = 0; i < numThreads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        double seconds = nowSeconds() - start;
+
+        double opsPerSecond = (double)numThreads * opsPerThread / seconds;
+        if (numThreads == 1) {
+            baseline = opsPerSecond;
+        }
+        printf("    {\"threads\": %u, \"ops_per_sec\": %.0f, \"speedup\": %.2f}%s\n",
+            numThreads, opsPerSecond, opsPerSecond / baseline, numThreads * 2 <= maxThreads ? "," : "");
+        fflush(stdout);
+        dbClose(table);
+        unlink(filename);
+    }
+    printf("  ]\n");
+}
+
+int main(int argc, char* argv[]) {
+    DbOptions options;
+    defaultDbOptions(&options);
+    // measure the tree and pager alone unless asked to commit through the log
+    options.useWal = false;
+    uint32_t maxRows = 1000000;
+    uint32_t maxLookups = 100000;
+    const char* filename = "bench.db";
+    uint32_t maxThreads = 0;
+
+    static struct option longOptions[] = {
+        {"frames", required_argument, NULL, 'F'},
+        {"max-rows", required_argument, NULL, 'n'},
+        {"lookups", required_argument, NULL, 'l'},
+        {"file", required_argument, NULL, 'f'},
+        {"mmap", no_argument, NULL, 'm'},
+        {"wal", no_argument, NULL, 'w'},
+        {"compress", no_argument, NULL, 'c'},
+        {"direct", no_argument, NULL, 'd'},
+        {"threads", required_argument, NULL, 't'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case ('F'):
+                options.numFrames = strtoul(optarg, NULL, 10);
+                if (options.numFrames < PAGER_MIN_FRAMES) {
+                    printf("Buffer pool needs at least %d frames.\n", PAGER_MIN_FRAMES);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case ('n'):
+                maxRows = strtoul(optarg, NULL, 10);
+                break;
+            case ('l'):
+                maxLookups = strtoul(optarg, NULL, 10);
+                break;
+            case ('f'):
+                filename = optarg;
+                break;
+            case ('m'):
+                options.useMmap = true;
+                break;
+            case ('w'):
+                options.useWal = true;
+                break;
+            case ('c'):
+                options.useCompression = true;
+                break;
+            case ('d'):
+                options.useDirectIo = true;
+                break;
+            case ('t'):
+                maxThreads = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                printf("Usage: %s [--frames N] [--max-rows N] [--lookups N] [--file path] [--mmap] [--wal] "
+                    "[--compress] [--direct] [--threads N]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (maxRows < 1000 || maxLookups == 0) {
+        printf("Need at least 1000 rows and one lookup.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("{\n  \"page_size\": %u,\n  \"frames\": %u,\n  \"mmap\": %s,\n  \"wal\": %s,\n  \"compress\": %s,\n"
+        "  \"direct\": %s,\n",
+        PAGE_SIZE, options.numFrames, options.useMmap ? "true" : "false",
+        options.useWal ? "true" : "false", options.useCompression ? "true" : "false",
+        options.useDirectIo ? "true" : "false");
+
+    if (maxThreads > 0) {
+        // with --wal every insert commits, and commits serialize
+        benchConcurrent(filename, &options, maxRows, maxThreads);
+        printf("}\n");
+        return 0;
+    }
+
+    printf("  \"sizes\": [\n");
+    for (uint64_t numRows = 1000; numRows <= maxRows; numRows *= 10) {
+        benchSize(filename, &options, numRows, maxLookups, numRows * 10 > maxRows);
+    }
+    printf("  ]\n}\n");
+
+    return 0;
+}
@@ -8,610 +8,6242 @@ InputBuffer* newInputBuffer() {
     return inputBuffer;
 }
 
-Table* dbOpen(const char* filename) {
-    Pager* pager = pagerOpen(filename);
-
-    Table* table = (Table*) malloc(sizeof(Table));
-    table->pager = pager;
-    table->rootPageNum = 0;
+OutputBuffer* newOutputBuffer() {
+    OutputBuffer* output = malloc(sizeof(OutputBuffer));
+    output->capacity = 65536;
+    output->data = malloc(output->capacity);
+    output->length = 0;
+    output->format = ROW_FORMAT_TEXT;
+    output->fileDescriptor = -1;
+    output->client = false;
+    output->failed = false;
+    return output;
+}
 
-    if(pager->numPages == 0) {
-        // new db file. Initialize page 0 as leaf node.
-        void* rootNode = getPage(pager, 0);
-        initializeLeafNode(rootNode);
-        setNodeRoot(rootNode, true);
+void outputReserve(OutputBuffer* output, size_t length) {
+    if (output->length + length > output->capacity) {
+        while (output->length + length > output->capacity) {
+            output->capacity *= 2;
+        }
+        output->data = realloc(output->data, output->capacity);
     }
-
-    return table;
 }
 
-void dbClose(Table* table) {
-    Pager* pager = table->pager;
+void outputAppend(OutputBuffer* output, const char* data, size_t length) {
+    outputReserve(output, length);
+    memcpy(output->data + output->length, data, length);
+    output->length += length;
+}
 
-    for (uint32_t i = 0; i < pager->numPages; i++) {
-        if (pager->pages[i] == NULL) {
-            continue;
-        }
-        pagerFlush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] = NULL;
+void outputPrintf(OutputBuffer* output, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(output->data + output->length, output->capacity - output->length, format, args);
+    va_end(args);
+    if ((size_t)length >= output->capacity - output->length) {
+        // didn't fit; grow and format again
+        outputReserve(output, length + 1);
+        va_start(args, format);
+        vsnprintf(output->data + output->length, output->capacity - output->length, format, args);
+        va_end(args);
     }
+    output->length += length;
+}
 
-    if (close(pager->fileDescriptor) == -1) {
-        printf("Error closing db file.\n");
-        exit(EXIT_FAILURE);
+void outputFlush(OutputBuffer* output) {
+    if (output->fileDescriptor == STDOUT_FILENO) {
+        // anything printf'd to the same place goes first
+        fflush(stdout);
     }
-
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        void* page = pager->pages[i];
-        if (page) {
-            free(page);
-            pager->pages[i] = NULL;
+    size_t written = 0;
+    while (!output->failed && written < output->length) {
+        ssize_t bytesWritten = output->client
+            ? send(output->fileDescriptor, output->data + written, output->length - written, MSG_NOSIGNAL)
+            : write(output->fileDescriptor, output->data + written, output->length - written);
+        if (bytesWritten == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!output->client) {
+                perror("Error writing output\n");
+                exit(EXIT_FAILURE);
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // the client's socket is full; wait for it to read some
+                struct pollfd writable = {output->fileDescriptor, POLLOUT, 0};
+                int ready = poll(&writable, 1, OUTPUT_STALL_MS);
+                if (ready > 0 || (ready == -1 && errno == EINTR)) {
+                    continue;
+                }
+            }
+            output->failed = true;
+            break;
         }
+        written += bytesWritten;
     }
-    free(pager);
-    free(table);
+    output->length = 0;
 }
 
-Pager* pagerOpen(const char* filename) {
-    int fd = open(filename, O_RDWR | O_CREAT, 0200 | 0400);
+void closeOutputBuffer(OutputBuffer* output) {
+    free(output->data);
+    free(output);
+}
 
-    if (fd == -1) {
-        printf("Error opening file\n");
-        exit(EXIT_FAILURE);
+void* arenaAlloc(Arena* arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    ArenaBlock* block = arena->current;
+    if (block != NULL && block->used + size <= block->capacity) {
+        void* memory = block->data + block->used;
+        block->used += size;
+        return memory;
     }
 
-    off_t fileLength = lseek(fd, 0, SEEK_END);
-
-    Pager* pager = malloc(sizeof(Pager));
-    pager->fileDescriptor = fd;
-    pager->fileLength = fileLength;
-    pager->numPages = (fileLength / PAGE_SIZE);
-
-    if (fileLength % PAGE_SIZE != 0) {
-        printf("DB file is corrupt. It isn't a whole number of pages.\n");
-        exit(EXIT_FAILURE);
+    // move on to a block kept from an earlier statement if it is big
+    // enough, else put a fresh one in the chain right here
+    ArenaBlock* next = (block == NULL) ? arena->first : block->next;
+    if (next == NULL || next->capacity < size) {
+        size_t capacity = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock* fresh = malloc(sizeof(ArenaBlock) + capacity);
+        if (fresh == NULL) {
+            printf("Error allocating %zu bytes of statement memory.\n", size);
+            exit(EXIT_FAILURE);
+        }
+        fresh->capacity = capacity;
+        fresh->next = next;
+        if (block == NULL) {
+            arena->first = fresh;
+        } else {
+            block->next = fresh;
+        }
+        next = fresh;
     }
+    next->used = size;
+    arena->current = next;
+    return next->data;
+}
 
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        pager->pages[i] = NULL;
+ArenaMark arenaMark(Arena* arena) {
+    ArenaMark mark = {arena->current, 0};
+    if (arena->current != NULL) {
+        mark.used = arena->current->used;
     }
-
-    return pager;
+    return mark;
 }
 
-void* getPage(Pager* pager, uint32_t pageNum) {
-    if (pageNum > TABLE_MAX_PAGES) {
-        printf("Page number out of bounds. %d > %d\n", pageNum, TABLE_MAX_PAGES);
-        exit(EXIT_FAILURE);
+void arenaRelease(Arena* arena, ArenaMark mark) {
+    if (mark.block == NULL) {
+        arenaReset(arena);
+        return;
     }
+    arena->current = mark.block;
+    mark.block->used = mark.used;
+}
 
-    if (pager->pages[pageNum] == NULL) {
-        // cache miss. allocate memory, load from file
-        void* page = malloc(PAGE_SIZE);
-        uint32_t numPages = pager->fileLength / PAGE_SIZE;
+void arenaReset(Arena* arena) {
+    // the first allocation after this starts over at the head of the chain
+    arena->current = NULL;
+}
 
-        // handle partial page at end of file
-        if (pager->fileLength % PAGE_SIZE) {
-            numPages += 1;
-        }
+Arena* statementArena() {
+    static __thread Arena arena = {NULL, NULL};
+    return &arena;
+}
 
-        if (pageNum <= numPages) {
-            lseek(pager->fileDescriptor, pageNum * PAGE_SIZE, SEEK_SET);
-            ssize_t bytesRead = read(pager->fileDescriptor, page, PAGE_SIZE);
-            if (bytesRead == -1) {
-                perror("Error reading file\n");
-                exit(EXIT_FAILURE);
-            }
-        }
+void defaultDbOptions(DbOptions* options) {
+    options->numFrames = PAGER_DEFAULT_FRAMES;
+    options->useMmap = false;
+    options->useWal = true;
+    options->useCompression = false;
+    options->useDirectIo = false;
+    options->dirtyLimit = 0;
+}
 
-        pager->pages[pageNum] = page;
+Table* dbOpen(const char* filename, DbOptions* options) {
+    Pager* pager = pagerOpen(filename, options);
 
-        if (pageNum >= pager->numPages) {
-            pager->numPages = pageNum + 1;
-        }
+    Table* table = (Table*) malloc(sizeof(Table));
+    table->pager = pager;
+    table->filename = malloc(strlen(filename) + 1);
+    strcpy(table->filename, filename);
+    table->options = *options;
+    pthread_rwlock_init(&(table->lock), NULL);
+    for (uint32_t i = 0; i < INDEX_COUNT; i++) {
+        table->indexRoots[i] = 0;
+        pthread_rwlock_init(&(table->indexLocks[i]), NULL);
     }
+    table->appendHint = 0;
+    table->snapshots = NULL;
+    table->numSnapshots = 0;
+    table->snapshotCapacity = 0;
+    table->retired = NULL;
+    table->numRetired = 0;
+    table->retiredCapacity = 0;
+    memset(&(table->stats), 0, sizeof(table->stats));
+    memset(table->latencies, 0, sizeof(table->latencies));
 
-    return pager->pages[pageNum];
-}
-
-uint32_t getUnusedPageNum(Pager* pager) {
-    return pager->numPages;
-}
+    if(pager->numPages == 0) {
+        // new db file. page 0 is the header, page 1 an empty root leaf.
+        DbHeader* header = getPage(pager, DB_HEADER_PAGE);
+        memset(header, 0, PAGE_SIZE);
+        memcpy(header->magic, DB_HEADER_MAGIC, DB_HEADER_MAGIC_SIZE);
+        header->version = DB_FORMAT_VERSION;
+        table->rootPageNum = getUnusedPageNum(pager);
+        header->rootPageNum = table->rootPageNum;
 
-void pagerFlush(Pager* pager, uint32_t pageNum) {
-    if (pager->pages[pageNum] == NULL) {
-        printf("Error flushing null page\n");
-        exit(EXIT_FAILURE);
+        void* rootNode = getPage(pager, table->rootPageNum);
+        initializeLeafNode(rootNode);
+        setNodeRoot(rootNode, true);
+        markPageDirty(pager, table->rootPageNum);
+        unpinPage(pager, table->rootPageNum);
+        markPageDirty(pager, DB_HEADER_PAGE);
+        unpinPage(pager, DB_HEADER_PAGE);
+        dbCommit(table);
+        return table;
     }
 
-    off_t offset = lseek(pager->fileDescriptor, pageNum * PAGE_SIZE, SEEK_SET);
+    DbHeader* header = getPage(pager, DB_HEADER_PAGE);
+    uint32_t version = 1;
+    if (memcmp(header->magic, DB_HEADER_MAGIC, DB_HEADER_MAGIC_SIZE) == 0) {
+        version = header->version;
+    }
+    table->rootPageNum = header->rootPageNum;
+    unpinPage(pager, DB_HEADER_PAGE);
 
-    if (offset == -1) {
-        perror("Seeking\n");
+    if (version > DB_FORMAT_VERSION) {
+        printf("Db file format %d is newer than supported format %d.\n", version, DB_FORMAT_VERSION);
         exit(EXIT_FAILURE);
+    } else if (version < DB_FORMAT_VERSION) {
+        dbUpgrade(table, version);
     }
 
-    ssize_t bytesWritten = write(pager->fileDescriptor, pager->pages[pageNum], PAGE_SIZE);
+    dbReadHeader(table);
+    return table;
+}
 
-    if (bytesWritten == -1) {
-        perror("Error writing file\n");
-        exit(EXIT_FAILURE);
+void dbReadHeader(Table* table) {
+    Pager* pager = table->pager;
+    DbHeader* header = getPage(pager, DB_HEADER_PAGE);
+    table->rootPageNum = header->rootPageNum;
+    memcpy(table->indexRoots, header->indexRootPageNums, sizeof(table->indexRoots));
+    pager->freeListHead = header->freeListHead;
+    pager->freeListCount = header->freeListCount;
+    // the mapped file grows in large steps and only close trims it, so
+    // after a crash its length overstates the pages in use
+    if (pager->map != NULL && header->numPages != 0 && header->numPages < pager->numPages) {
+        pagerTrimMap(pager, header->numPages);
     }
+    unpinPage(pager, DB_HEADER_PAGE);
+    tableSetAppendHint(table, 0, 0);
 }
 
-Cursor* tableStart(Table* table) {
-    Cursor* cursor = tableFind(table, 0);
+void dbUpgrade(Table* table, uint32_t version) {
+    Pager* pager = table->pager;
 
-    void* node = getPage(table->pager, cursor->pageNum);
-    uint32_t numCells = *leafNodeNumCells(node);
-    cursor->endOfTable = (numCells == 0);
+    uint32_t rootPageNum;
+    if (version == 1) {
+        // the old root lives where the header goes, so move it out first
+        rootPageNum = getUnusedPageNum(pager);
+        void* oldRoot = getPage(pager, DB_HEADER_PAGE);
+        void* root = getPage(pager, rootPageNum);
+        memcpy(root, oldRoot, PAGE_SIZE);
+        markPageDirty(pager, rootPageNum);
+        unpinPage(pager, rootPageNum);
+        unpinPage(pager, DB_HEADER_PAGE);
+    } else {
+        DbHeader* header = getPage(pager, DB_HEADER_PAGE);
+        rootPageNum = header->rootPageNum;
+        unpinPage(pager, DB_HEADER_PAGE);
+    }
+
+    upgradeSubtree(pager, rootPageNum, version);
+
+    DbHeader* header = getPage(pager, DB_HEADER_PAGE);
+    memset(header, 0, PAGE_SIZE);
+    memcpy(header->magic, DB_HEADER_MAGIC, DB_HEADER_MAGIC_SIZE);
+    header->version = DB_FORMAT_VERSION;
+    header->rootPageNum = rootPageNum;
+    header->numPages = pager->numPages;
+    markPageDirty(pager, DB_HEADER_PAGE);
+    unpinPage(pager, DB_HEADER_PAGE);
 
-    return cursor;
+    table->rootPageNum = rootPageNum;
+    dbCommit(table);
 }
 
-Cursor* tableFind(Table* table, uint32_t key) {
-    uint32_t rootPageNum = table->rootPageNum;
-    void* rootNode = getPage(table->pager, rootPageNum);
+uint32_t upgradeSubtree(Pager* pager, uint32_t pageNum, uint32_t version) {
+    void* node = getPage(pager, pageNum);
+    uint32_t maxKey = 0;
 
-    if (getNodeType(rootNode) == NODE_LEAF) {
-        return leafNodeFind(table, rootPageNum, key);
+    if (getNodeType(node) == NODE_LEAF) {
+        upgradeLeaf(node, version);
+        if (*leafNodeNumCells(node) > 0) {
+            maxKey = getNodeMaxKey(node);
+        }
     } else {
-        return internalNodeFind(table, rootPageNum, key);
+        // separators written by older builds may be stale, so each one is
+        // recomputed from the max key of the child to its left
+        uint32_t numKeys = *internalNodeNumKeys(node);
+        for (uint32_t i = 0; i < numKeys; i++) {
+            *internalNodeKey(node, i) = upgradeSubtree(pager, *internalNodeChild(node, i), version);
+        }
+        maxKey = upgradeSubtree(pager, *internalNodeRightChild(node), version);
     }
+
+    markPageDirty(pager, pageNum);
+    unpinPage(pager, pageNum);
+    return maxKey;
 }
 
-Cursor* leafNodeFind(Table* table, uint32_t pageNum, uint32_t key) {
-    void* node = getPage(table->pager, pageNum);
-    uint32_t numCells = *leafNodeNumCells(node);
+void upgradeLeaf(void* node, uint32_t version) {
+    uint8_t old[PAGE_SIZE];
+    memcpy(old, node, PAGE_SIZE);
 
-    Cursor* cursor = malloc(sizeof(Cursor));
-    cursor->table = table;
-    cursor->pageNum = pageNum;
+    uint32_t numCells = *leafNodeNumCells(old);
+    bool isRoot = isNodeRoot(old);
+    initializeLeafNode(node);
+    setNodeRoot(node, isRoot);
+    *leafNodeNextLeaf(node) = *leafNodeNextLeaf(old);
 
-    // binary search
-    uint32_t l = 0;
-    uint32_t r = numCells;
-    while (l < r) {
-        uint32_t mid = (l + r) / 2;
-        uint32_t keyAtMid = *leafNodeKey(node, mid);
-        if (key == keyAtMid) {
-            cursor->cellNum = mid;
-            return cursor;
-        } else if (key < keyAtMid) {
-            r = mid;
+    // rows only shrink when they lose their padding, so they always fit
+    for (uint32_t i = 0; i < numCells; i++) {
+        uint32_t key;
+        void* fixedRow;
+        if (version == 1) {
+            void* cell = old + LEAF_NODE_V1_HEADER_SIZE + i * LEAF_NODE_V1_CELL_SIZE;
+            key = *(uint32_t*)cell;
+            fixedRow = cell + LEAF_NODE_KEY_SIZE;
         } else {
-            l = mid + 1;
+            uint32_t* keys = (void*)old + LEAF_NODE_V2_HEADER_SIZE;
+            uint16_t* slots = (void*)(keys + numCells);
+            key = keys[i];
+            fixedRow = old + slots[i];
         }
+        Row row;
+        deserializeFixedRow(fixedRow, &row);
+        serializeRow(&row, leafNodeAllocateCell(node, i, key, serializedRowSize(&row)));
     }
+}
 
-    cursor->cellNum = l;
-    return cursor;
+void dbClose(Table* table) {
+    dbClosePager(table);
+    pthread_rwlock_destroy(&(table->lock));
+    for (uint32_t i = 0; i < INDEX_COUNT; i++) {
+        pthread_rwlock_destroy(&(table->indexLocks[i]));
+    }
+    free(table->snapshots);
+    free(table->retired);
+    free(table->filename);
+    free(table);
 }
 
-Cursor* internalNodeFind(Table* table, uint32_t pageNum, uint32_t key) {
-    void* node =getPage(table->pager, pageNum);
-    uint32_t numKeys = *internalNodeNumKeys(node);
+void dbClosePager(Table* table) {
+    Pager* pager = table->pager;
 
-    // binary search to find index of child to search
-    uint32_t l = 0;
-    uint32_t r = numKeys;
+    bool logged = (pager->wal != NULL);
+    if (logged) {
+        // everything cached is already in the log; fold it into the file
+        dbCommit(table);
+        walCheckpoint(pager);
+        walClose(pager);
+    }
 
-    while (l < r) {
-        uint32_t mid = (l + r) / 2;
-        uint32_t keyToRight = *internalNodeKey(node, mid);
-        if (keyToRight >= key) {
-            r = mid;
-        } else {
-            l = mid + 1;
+    if (pager->flusherRunning) {
+        pagerStopFlusher(pager);
+    }
+
+    if (!logged && pager->numDirty > 0) {
+        // write only dirty pages, in file order, coalescing neighbours
+        PageRef* refs = malloc(sizeof(PageRef) * pager->numDirty);
+        uint32_t count = 0;
+        for (uint32_t i = 0; i < pager->numUsedFrames; i++) {
+            Frame* frame = &(pager->frames[i]);
+            if (frame->pageNum != FRAME_NONE && frame->dirty) {
+                refs[count].pageNum = frame->pageNum;
+                refs[count].page = frame->page;
+                count++;
+            }
         }
+        qsort(refs, count, sizeof(PageRef), comparePageRefs);
+        pager->stats.writeCalls += pagerWritePages(pager, refs, count);
+        pager->stats.pagesWritten += count;
+        free(refs);
     }
 
-    uint32_t childNum = *internalNodeChild(node, l);
-    void* child = getPage(table->pager, childNum);
-    switch (getNodeType(child)) {
-        case NODE_LEAF:
-            return leafNodeFind(table, childNum, key);
-        case NODE_INTERNAL:
-            return internalNodeFind(table, childNum, key);
+    if (!logged && pager->locations != NULL) {
+        pagerSaveLocations(pager);
+    }
+    if (pager->locations != NULL) {
+        for (uint32_t i = 0; i < EXTENT_CLASSES; i++) {
+            free(pager->freeExtents[i].offsets);
+            free(pager->pendingExtents[i].offsets);
+        }
+        free(pager->locations);
     }
-}
 
-NodeType getNodeType(void* node) {
-    uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
-    return (NodeType)value;
-}
+    for (uint32_t i = 0; i < pager->numFrames; i++) {
+        pthread_rwlock_destroy(&(pager->frames[i].latch));
+    }
+    munmap(pager->frameArena, pager->arenaLength);
 
-void setNodeType(void* node, NodeType type) {
-    uint8_t value = type;
-    *((uint8_t*)(node + NODE_TYPE_OFFSET)) = value;
+    if (pager->map != NULL) {
+        pagerSyncMap(pager);
+        munmap(pager->map, MMAP_RESERVE_SIZE);
+        // drop the unused tail left by growing in large steps
+        if (ftruncate(pager->fileDescriptor, (off_t)pager->numPages * PAGE_SIZE) == -1) {
+            perror("Error truncating file\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (close(pager->fileDescriptor) == -1) {
+        printf("Error closing db file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_destroy(&(pager->lock));
+    for (uint32_t i = 0; i < PAGER_BUCKET_LOCKS; i++) {
+        pthread_mutex_destroy(&(pager->bucketLocks[i]));
+    }
+    pthread_mutex_destroy(&(pager->freeListLock));
+    pthread_cond_destroy(&(pager->flushNeeded));
+    free(pager->frames);
+    free(pager->buckets);
+    free(pager->pageVersions);
+    free(pager);
+    table->pager = NULL;
 }
 
-void printPrompt() {
-    printf("db > ");
+void dbCommit(Table* table) {
+    Pager* pager = table->pager;
+    if (pager->wal == NULL) {
+        return;
+    }
+
+    // logging copies whole pages, so statements must be out of the pool.
+    // waiting for the sync doesn't need that, and other commits can join it
+    pthread_rwlock_wrlock(&(table->lock));
+    uint64_t lsn = walCommit(pager);
+    pthread_rwlock_unlock(&(table->lock));
+    walWaitDurable(pager, lsn);
+
+    // checkpoint cost is proportional to distinct logged pages, so those
+    // are held to the dirty limit as well as bounding the log length
+    Wal* wal = pager->wal;
+    pthread_rwlock_wrlock(&(table->lock));
+    if (wal->numFrames >= WAL_CHECKPOINT_FRAMES || wal->indexCount >= pager->dirtyLimit) {
+        walCheckpoint(pager);
+    }
+    pthread_rwlock_unlock(&(table->lock));
 }
 
-void readInput(InputBuffer* inputBuffer) {
-    size_t bytesRead = getline(&(inputBuffer->buffer), &(inputBuffer->bufferLen), stdin);
-    
-    if (bytesRead <= 0) {
-        printf("Error reading input\n");
+Pager* pagerOpen(const char* filename, DbOptions* options) {
+    int fd = open(filename, O_RDWR | O_CREAT, 0200 | 0400);
+
+    if (fd == -1) {
+        printf("Error opening file\n");
         exit(EXIT_FAILURE);
     }
-    
-    // remove trailing newline that came from calling getline()
-    inputBuffer->buffer[bytesRead - 1] = 0;
-    inputBuffer->inputLen = bytesRead - 1;
-}
 
-void closeInputBuffer(InputBuffer* inputBuffer) {
-    free(inputBuffer->buffer);
-    free(inputBuffer);
-}
+    off_t fileLength = lseek(fd, 0, SEEK_END);
 
-MetaCommandResult execMetaCommand(InputBuffer* inputBuffer, Table* table) {
-    if (strcmp(inputBuffer->buffer, ".exit") == 0) {
-        dbClose(table);
-        exit(EXIT_SUCCESS);
-    } else if (strcmp(inputBuffer->buffer, ".btree") == 0) {
-        printf("Tree:\n");
-        printTree(table->pager, 0, 0);
-        return META_COMMAND_SUCCESS;
-    } else {
-        return META_COMMAND_UNRECOGNIZED;
+    Pager* pager = malloc(sizeof(Pager));
+    pager->fileDescriptor = fd;
+    pager->fileLength = fileLength;
+    pager->numPages = (fileLength / PAGE_SIZE);
+
+    // an existing file's own header decides whether it is compressed
+    bool compressed = options->useCompression;
+    if (fileLength > 0) {
+        char magic[COMPRESSED_MAGIC_SIZE];
+        compressed = pread(fd, magic, COMPRESSED_MAGIC_SIZE, 0) == COMPRESSED_MAGIC_SIZE &&
+            memcmp(magic, COMPRESSED_MAGIC, COMPRESSED_MAGIC_SIZE) == 0;
     }
-}
 
-PrepareResult prepareStatement(InputBuffer* inputBuffer, Statement* statement) {
-    if (strncmp(inputBuffer->buffer, "insert", 6) == 0) {
-        statement->type = STATEMENT_INSERT;
-        int args = sscanf(
-            inputBuffer->buffer, "insert %d %s %s", &(statement->rowToInsert.id), statement->rowToInsert.username, statement->rowToInsert.email
-        );
-        if (args < 3) {
-            return PREPARE_SYNTAX_ERROR;
+    pager->locations = NULL;
+    if (compressed) {
+        if (options->useMmap) {
+            printf("Compressed files can't be memory mapped.\n");
+            exit(EXIT_FAILURE);
         }
-        return PREPARE_SUCCESS;
-    } else if (strncmp(inputBuffer->buffer, "select", 6) == 0) {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
-    } else {
-        return PREPARE_UNRECOGNIZED;
+        pagerOpenCompressed(pager, fileLength == 0);
+    } else if (fileLength % PAGE_SIZE != 0) {
+        printf("DB file is corrupt. It isn't a whole number of pages.\n");
+        exit(EXIT_FAILURE);
     }
-}
 
-PrepareResult prepareInsert(InputBuffer* inputBuffer, Statement* statement) {
-    statement->type = STATEMENT_INSERT;
-
-    char* keyword = strtok(inputBuffer->buffer, " ");
-    char* idString = strtok(NULL, " ");
-    char* username = strtok(NULL, " ");
-    char* email = strtok(NULL, " ");
+    // frames are page aligned and every transfer is whole pages at page
+    // offsets, which is all O_DIRECT asks. the checks above read the file
+    // unaligned, so it is switched on after them
+    pager->directIo = options->useDirectIo;
+    if (pager->directIo) {
+        if (options->useMmap || compressed) {
+            printf("Direct I/O needs uncompressed pages read through the buffer pool.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == -1) {
+            perror("Error enabling direct I/O\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    if (idString == NULL || username == NULL || email == NULL) {
-        return PREPARE_SYNTAX_ERROR;
+    // frames are filled lazily; the page table is a chained hash with
+    // at least two buckets per frame to keep chains short
+    pager->numFrames = options->numFrames;
+    pager->numUsedFrames = 0;
+    pager->frames = malloc(sizeof(Frame) * pager->numFrames);
+    pagerMapArena(pager);
+    for (uint32_t i = 0; i < pager->numFrames; i++) {
+        pager->frames[i].page = pager->frameArena + (size_t)i * PAGE_SIZE;
+        pthread_rwlock_init(&(pager->frames[i].latch), NULL);
     }
+    pager->numBuckets = 1;
+    while (pager->numBuckets < pager->numFrames * 2) {
+        pager->numBuckets <<= 1;
+    }
+    pager->buckets = malloc(sizeof(uint32_t) * pager->numBuckets);
+    for (uint32_t i = 0; i < pager->numBuckets; i++) {
+        pager->buckets[i] = FRAME_NONE;
+    }
+    pager->clockHand = 0;
+    memset(&(pager->stats), 0, sizeof(PagerStats));
 
-    int id = atoi(idString);
-    if (id < 0) {
-        return PREPARE_NEGATIVE_ID;
+    pager->numDirty = 0;
+    pager->dirtyLimit = options->dirtyLimit;
+    if (pager->dirtyLimit == 0) {
+        pager->dirtyLimit = pager->numFrames / 4;
     }
-    if (strlen(username) > COLUMN_USERNAME_SIZE) {
-        return PREPARE_STRING_TOO_LONG;
+    pthread_mutex_init(&(pager->lock), NULL);
+    for (uint32_t i = 0; i < PAGER_BUCKET_LOCKS; i++) {
+        pthread_mutex_init(&(pager->bucketLocks[i]), NULL);
     }
-    if (strlen(email) > COLUMN_EMAIL_SIZE) {
-        return PREPARE_STRING_TOO_LONG;
+    pthread_cond_init(&(pager->flushNeeded), NULL);
+    pager->flusherRunning = false;
+    pager->stopFlusher = false;
+    pager->freeListHead = 0;
+    pager->freeListCount = 0;
+    pthread_mutex_init(&(pager->freeListLock), NULL);
+    pager->pageVersions = NULL;
+    pager->versionCapacity = 0;
+    pager->writeVersion = 1;
+
+    pager->map = NULL;
+    if (options->useMmap) {
+        pagerMapFile(pager);
     }
 
-    statement->rowToInsert.id = id;
-    strcpy(statement->rowToInsert.username, username);
-    strcpy(statement->rowToInsert.email, email);
+    // the mapped file is written back by the kernel whenever it likes, which
+    // would break write-ahead ordering, so mmap mode runs without a log
+    pager->wal = NULL;
+    if (options->useWal && !options->useMmap) {
+        walOpen(pager, filename);
+    }
 
-    return PREPARE_SUCCESS;
+    // with a log, dirty pool pages are just the open statement's and the
+    // dirty limit bounds checkpoints instead; mapped pages are the kernel's.
+    // compressed writes move extents, so they stay on the owning thread
+    if (pager->wal == NULL && pager->map == NULL && pager->locations == NULL) {
+        if (pthread_create(&(pager->flusher), NULL, pagerFlusherMain, pager) != 0) {
+            printf("Error starting flusher thread\n");
+            exit(EXIT_FAILURE);
+        }
+        pager->flusherRunning = true;
+    }
+
+    return pager;
 }
 
-ExecuteResult executeStatement(Statement* statement, Table* table) {
-    switch (statement->type) {
-        case (STATEMENT_INSERT):
-            return executeInsert(statement, table);
-        case (STATEMENT_SELECT):
-            return executeSelect(statement, table);
+void pagerMapArena(Pager* pager) {
+    size_t length = (size_t)pager->numFrames * PAGE_SIZE;
+    void* arena = MAP_FAILED;
+    if (length >= ARENA_HUGE_PAGE_SIZE) {
+        size_t hugeLength = (length + ARENA_HUGE_PAGE_SIZE - 1) & ~(ARENA_HUGE_PAGE_SIZE - 1);
+        arena = mmap(NULL, hugeLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (arena != MAP_FAILED) {
+            length = hugeLength;
+        }
+    }
+    if (arena == MAP_FAILED) {
+        // no reserved huge pages, so let the kernel build them as it can
+        arena = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena == MAP_FAILED) {
+            perror("Error allocating buffer pool\n");
+            exit(EXIT_FAILURE);
+        }
+        madvise(arena, length, MADV_HUGEPAGE);
     }
+    pager->frameArena = arena;
+    pager->arenaLength = length;
 }
 
-ExecuteResult executeInsert(Statement* statement, Table* table) {
-    void* node = getPage(table->pager, table->rootPageNum);
-    uint32_t numCells = (*leafNodeNumCells(node));
-
-    Row* rowToInsert = &(statement->rowToInsert);
-    uint32_t keyToInsert = rowToInsert->id;
-    Cursor* cursor = tableFind(table, keyToInsert);
+int comparePageRefs(const void* a, const void* b) {
+    uint32_t left = ((const PageRef*)a)->pageNum;
+    uint32_t right = ((const PageRef*)b)->pageNum;
+    return (left > right) - (left < right);
+}
 
-    if (cursor->cellNum < numCells) {
-        uint32_t keyAtIndex = *leafNodeKey(node, cursor->cellNum);
-        if (keyAtIndex == keyToInsert) {
-            return EXECUTE_DUPLICATE_KEY;
-        }
+uint32_t pagerWritePages(Pager* pager, PageRef* refs, uint32_t count) {
+    if (pager->locations != NULL) {
+        return pagerWriteCompressed(pager, refs, count);
     }
 
-    leafNodeInsert(cursor, rowToInsert->id, rowToInsert);
+    struct iovec iov[PAGER_MAX_IOVECS];
+    uint32_t writeCalls = 0;
+    uint32_t i = 0;
+    while (i < count) {
+        uint32_t run = 0;
+        while (i + run < count && run < PAGER_MAX_IOVECS &&
+               refs[i + run].pageNum == refs[i].pageNum + run) {
+            iov[run].iov_base = refs[i + run].page;
+            iov[run].iov_len = PAGE_SIZE;
+            run++;
+        }
 
-    return EXECUTE_SUCCESS;
+        off_t offset = (off_t)refs[i].pageNum * PAGE_SIZE;
+        ssize_t bytesWritten = pwritev(pager->fileDescriptor, iov, run, offset);
+        if (bytesWritten != (ssize_t)(run * PAGE_SIZE)) {
+            perror("Error writing file\n");
+            exit(EXIT_FAILURE);
+        }
+        __atomic_fetch_add(&(pager->stats.bytesWritten), bytesWritten, __ATOMIC_RELAXED);
+        writeCalls++;
+        i += run;
+    }
+    return writeCalls;
 }
 
-ExecuteResult executeSelect(Statement* statement, Table* table) {
-    Cursor* cursor = tableStart(table);
+void pagerOpenCompressed(Pager* pager, bool create) {
+    CompressedHeader* header = &(pager->compressedHeader);
+    memset(pager->freeExtents, 0, sizeof(pager->freeExtents));
+    memset(pager->pendingExtents, 0, sizeof(pager->pendingExtents));
+    if (create) {
+        memset(header, 0, sizeof(CompressedHeader));
+        memcpy(header->magic, COMPRESSED_MAGIC, COMPRESSED_MAGIC_SIZE);
+        pager->locations = NULL;
+        pager->locationCapacity = 0;
+        pagerReserveLocations(pager, 1);
+        // extents start after the header block
+        pager->fileLength = COMPRESSED_HEADER_SIZE;
+        pagerSaveLocations(pager);
+        return;
+    }
 
-    Row row;
-    while (!(cursor->endOfTable)) {
-        deserializeRow(cursorValue(cursor), &row);
-        printRow(&row);
-        cursorAdvance(cursor);
+    if (pread(pager->fileDescriptor, header, sizeof(CompressedHeader), 0) != sizeof(CompressedHeader)) {
+        perror("Error reading compressed file header\n");
+        exit(EXIT_FAILURE);
     }
+    pager->numPages = header->numPages;
+    pager->locations = NULL;
+    pager->locationCapacity = 0;
+    pagerReserveLocations(pager, pager->numPages + 1);
 
-    free(cursor);
-    
-    return EXECUTE_SUCCESS;
+    size_t mapBytes = (size_t)pager->numPages * sizeof(PageLocation);
+    ssize_t bytesRead = pread(pager->fileDescriptor, pager->locations, mapBytes, header->mapOffset[header->activeMap]);
+    if (bytesRead != (ssize_t)mapBytes) {
+        printf("Compressed file is corrupt. Its page map is truncated.\n");
+        exit(EXIT_FAILURE);
+    }
+    pagerFindFreeExtents(pager);
 }
 
-void serializeRow(Row* source, void* destination) {
-    memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-    memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
-    memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
+int comparePageLocations(const void* a, const void* b) {
+    uint64_t left = ((const PageLocation*)a)->offset;
+    uint64_t right = ((const PageLocation*)b)->offset;
+    return (left > right) - (left < right);
 }
 
-void deserializeRow(void* source, Row* destination) {
+void pagerFindFreeExtents(Pager* pager) {
+    // everything live, header and both map regions included, in file order
+    CompressedHeader* header = &(pager->compressedHeader);
+    PageLocation* live = malloc(sizeof(PageLocation) * (pager->numPages + 3));
+    uint32_t numLive = 0;
+    for (uint32_t i = 0; i < pager->numPages; i++) {
+        if (pager->locations[i].capacity > 0) {
+            live[numLive++] = pager->locations[i];
+        }
+    }
+    live[numLive].offset = 0;
+    live[numLive++].capacity = COMPRESSED_HEADER_SIZE;
+    for (uint32_t i = 0; i < 2; i++) {
+        if (header->mapCapacity[i] > 0) {
+            live[numLive].offset = header->mapOffset[i];
+            live[numLive++].capacity = header->mapCapacity[i];
+        }
+    }
+    qsort(live, numLive, sizeof(PageLocation), comparePageLocations);
+
+    uint64_t end = 0;
+    for (uint32_t i = 0; i < numLive; i++) {
+        if (live[i].offset > end) {
+            pagerFreeExtent(pager, end, live[i].offset - end, false);
+        }
+        if (live[i].offset + live[i].capacity > end) {
+            end = live[i].offset + live[i].capacity;
+        }
+    }
+    // a crash can leave appended extents no map refers to. a file written
+    // before map regions were extended over their capacity can also end
+    // inside one, and new extents must start past it
+    if (pager->fileLength > end) {
+        pagerFreeExtent(pager, end, pager->fileLength - end, false);
+    } else {
+        pager->fileLength = end;
+    }
+    free(live);
+}
+
+void extentListPush(ExtentList* list, uint64_t offset) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity > 0 ? list->capacity * 2 : 64;
+        list->offsets = realloc(list->offsets, sizeof(uint64_t) * list->capacity);
+    }
+    list->offsets[list->count++] = offset;
+}
+
+void pagerFreeExtent(Pager* pager, uint64_t offset, uint64_t size, bool pending) {
+    ExtentList* lists = pending ? pager->pendingExtents : pager->freeExtents;
+    // large gaps are kept as page-sized pieces plus one smaller remainder
+    while (size >= EXTENT_GRANULE) {
+        uint64_t piece = size < PAGE_SIZE ? size / EXTENT_GRANULE * EXTENT_GRANULE : PAGE_SIZE;
+        extentListPush(&(lists[piece / EXTENT_GRANULE - 1]), offset);
+        offset += piece;
+        size -= piece;
+    }
+}
+
+uint64_t pagerAllocateExtent(Pager* pager, uint32_t capacity) {
+    // smallest free extent that fits, giving back what's left over
+    for (uint32_t sizeClass = capacity / EXTENT_GRANULE - 1; sizeClass < EXTENT_CLASSES; sizeClass++) {
+        ExtentList* list = &(pager->freeExtents[sizeClass]);
+        if (list->count > 0) {
+            uint64_t offset = list->offsets[--list->count];
+            uint32_t remainder = (sizeClass + 1) * EXTENT_GRANULE - capacity;
+            if (remainder > 0) {
+                pagerFreeExtent(pager, offset + capacity, remainder, false);
+            }
+            return offset;
+        }
+    }
+
+    uint64_t offset = pager->fileLength;
+    pager->fileLength += capacity;
+    return offset;
+}
+
+void pagerReserveLocations(Pager* pager, uint32_t count) {
+    if (count <= pager->locationCapacity) {
+        return;
+    }
+    uint32_t capacity = pager->locationCapacity > 0 ? pager->locationCapacity : 64;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    pager->locations = realloc(pager->locations, sizeof(PageLocation) * capacity);
+    memset(pager->locations + pager->locationCapacity, 0,
+        sizeof(PageLocation) * (capacity - pager->locationCapacity));
+    pager->locationCapacity = capacity;
+}
+
+void pagerReadCompressed(Pager* pager, uint32_t pageNum, void* page) {
+    if (pageNum >= pager->locationCapacity || pager->locations[pageNum].length == 0) {
+        memset(page, 0, PAGE_SIZE);
+        return;
+    }
+
+    PageLocation* location = &(pager->locations[pageNum]);
+    if (location->length == PAGE_SIZE) {
+        // didn't compress, stored as is
+        if (pread(pager->fileDescriptor, page, PAGE_SIZE, location->offset) != PAGE_SIZE) {
+            perror("Error reading file\n");
+            exit(EXIT_FAILURE);
+        }
+        __atomic_fetch_add(&(pager->stats.bytesRead), PAGE_SIZE, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint8_t buffer[PAGE_SIZE];
+    if (pread(pager->fileDescriptor, buffer, location->length, location->offset) != location->length) {
+        perror("Error reading file\n");
+        exit(EXIT_FAILURE);
+    }
+    __atomic_fetch_add(&(pager->stats.bytesRead), location->length, __ATOMIC_RELAXED);
+    if (!pageDecompress(buffer, location->length, page)) {
+        printf("Compressed page %d is corrupt.\n", pageNum);
+        exit(EXIT_FAILURE);
+    }
+}
+
+uint32_t pagerWriteCompressed(Pager* pager, PageRef* refs, uint32_t count) {
+    // extents are padded out to their capacity so that neighbouring ones,
+    // like pages appended in one batch, go out in a single pwritev
+    uint8_t* staging = malloc((size_t)count * PAGE_SIZE);
+    uint8_t compressed[PAGE_COMPRESS_BOUND];
+    struct iovec iov[PAGER_MAX_IOVECS];
+    uint32_t run = 0;
+    uint64_t runOffset = 0;
+    uint64_t runEnd = 0;
+    uint32_t writeCalls = 0;
+
+    for (uint32_t i = 0; i <= count; i++) {
+        PageLocation* location = NULL;
+        uint8_t* slot = staging + (size_t)i * PAGE_SIZE;
+        if (i < count) {
+            uint32_t length = pageCompress(refs[i].page, compressed);
+            const uint8_t* data = compressed;
+            if (length >= PAGE_SIZE) {
+                length = PAGE_SIZE;
+                data = refs[i].page;
+            }
+
+            pagerReserveLocations(pager, refs[i].pageNum + 1);
+            location = &(pager->locations[refs[i].pageNum]);
+            if (location->capacity < length) {
+                // outgrew its extent. the map on disk may still point at the
+                // old one, so it can't be reused until the next save
+                if (location->capacity > 0) {
+                    pagerFreeExtent(pager, location->offset, location->capacity, true);
+                }
+                location->capacity = (length + EXTENT_GRANULE - 1) / EXTENT_GRANULE * EXTENT_GRANULE;
+                location->offset = pagerAllocateExtent(pager, location->capacity);
+            }
+            location->length = length;
+            memcpy(slot, data, length);
+            memset(slot + length, 0, location->capacity - length);
+        }
+
+        if (run > 0 && (location == NULL || location->offset != runEnd || run == PAGER_MAX_IOVECS)) {
+            ssize_t bytesWritten = pwritev(pager->fileDescriptor, iov, run, runOffset);
+            if (bytesWritten != (ssize_t)(runEnd - runOffset)) {
+                perror("Error writing file\n");
+                exit(EXIT_FAILURE);
+            }
+            __atomic_fetch_add(&(pager->stats.bytesWritten), bytesWritten, __ATOMIC_RELAXED);
+            writeCalls++;
+            run = 0;
+        }
+        if (location == NULL) {
+            break;
+        }
+        if (run == 0) {
+            runOffset = location->offset;
+        }
+        iov[run].iov_base = slot;
+        iov[run].iov_len = location->capacity;
+        run++;
+        runEnd = location->offset + location->capacity;
+    }
+
+    free(staging);
+    return writeCalls;
+}
+
+void pagerSaveLocations(Pager* pager) {
+    CompressedHeader* header = &(pager->compressedHeader);
+    pagerReserveLocations(pager, pager->numPages);
+
+    // write the map into the region the header isn't using, growing it at
+    // the end of the file when the map has outgrown it
+    uint32_t inactive = 1 - header->activeMap;
+    size_t mapBytes = (size_t)pager->numPages * sizeof(PageLocation);
+    if (mapBytes > header->mapCapacity[inactive]) {
+        // nothing on disk points at the inactive region, so it's free now
+        pagerFreeExtent(pager, header->mapOffset[inactive], header->mapCapacity[inactive], false);
+        uint64_t capacity = (mapBytes * 2 + EXTENT_GRANULE - 1) / EXTENT_GRANULE * EXTENT_GRANULE;
+        header->mapOffset[inactive] = pager->fileLength;
+        header->mapCapacity[inactive] = capacity;
+        pager->fileLength += capacity;
+        // the map fills only part of its region, so the file is extended
+        // over all of it; otherwise a reopen would see the file end early
+        if (ftruncate(pager->fileDescriptor, pager->fileLength) == -1) {
+            perror("Error extending file\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (pwrite(pager->fileDescriptor, pager->locations, mapBytes, header->mapOffset[inactive]) != (ssize_t)mapBytes) {
+        perror("Error writing page map\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // pages and map must be on disk before the header points at them
+    if (fdatasync(pager->fileDescriptor) == -1) {
+        perror("Error syncing file\n");
+        exit(EXIT_FAILURE);
+    }
+    header->activeMap = inactive;
+    header->numPages = pager->numPages;
+    uint8_t block[COMPRESSED_HEADER_SIZE];
+    memset(block, 0, COMPRESSED_HEADER_SIZE);
+    memcpy(block, header, sizeof(CompressedHeader));
+    if (pwrite(pager->fileDescriptor, block, COMPRESSED_HEADER_SIZE, 0) != COMPRESSED_HEADER_SIZE ||
+        fdatasync(pager->fileDescriptor) == -1) {
+        perror("Error writing compressed file header\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // the new map no longer refers to extents abandoned since the last one
+    for (uint32_t i = 0; i < EXTENT_CLASSES; i++) {
+        ExtentList* pending = &(pager->pendingExtents[i]);
+        for (uint32_t j = 0; j < pending->count; j++) {
+            extentListPush(&(pager->freeExtents[i]), pending->offsets[j]);
+        }
+        pending->count = 0;
+    }
+}
+
+uint32_t pageCompress(const uint8_t* source, uint8_t* destination) {
+    // positions are stored plus one so that zero means an empty slot
+    uint16_t table[1 << COMPRESS_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    uint32_t in = 0;
+    uint32_t anchor = 0;
+    uint32_t out = 0;
+    uint32_t misses = 0;
+    while (in + COMPRESS_MIN_MATCH <= PAGE_SIZE) {
+        uint32_t sequence;
+        memcpy(&sequence, source + in, sizeof(uint32_t));
+        uint32_t hash = (sequence * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+        uint32_t candidate = table[hash];
+        table[hash] = in + 1;
+
+        uint32_t previous = ~sequence;
+        if (candidate != 0) {
+            memcpy(&previous, source + candidate - 1, sizeof(uint32_t));
+        }
+        if (previous != sequence) {
+            // stride further the longer nothing matches, so random bytes
+            // are given up on quickly
+            in += 1 + (misses++ >> 5);
+            continue;
+        }
+        misses = 0;
+
+        // extend the match a word at a time
+        candidate--;
+        uint32_t matchLength = COMPRESS_MIN_MATCH;
+        while (in + matchLength + sizeof(uint64_t) <= PAGE_SIZE) {
+            uint64_t left, right;
+            memcpy(&left, source + candidate + matchLength, sizeof(uint64_t));
+            memcpy(&right, source + in + matchLength, sizeof(uint64_t));
+            if (left != right) {
+                matchLength += __builtin_ctzll(left ^ right) / 8;
+                break;
+            }
+            matchLength += sizeof(uint64_t);
+        }
+        while (in + matchLength < PAGE_SIZE && source[candidate + matchLength] == source[in + matchLength]) {
+            matchLength++;
+        }
+        out = compressEmitSequence(destination, out, source + anchor, in - anchor, in - candidate, matchLength);
+        in += matchLength;
+        anchor = in;
+    }
+
+    // trailing literals end the stream
+    return compressEmitSequence(destination, out, source + anchor, PAGE_SIZE - anchor, 0, 0);
+}
+
+uint32_t compressEmitSequence(uint8_t* destination, uint32_t out, const uint8_t* literals,
+    uint32_t numLiterals, uint32_t offset, uint32_t matchLength) {
+    // token: literal count in the high nibble, match length past the
+    // minimum in the low one; 15 in either means more length bytes follow
+    uint32_t tokenAt = out++;
+    destination[tokenAt] = (numLiterals < 15 ? numLiterals : 15) << 4;
+    if (numLiterals >= 15) {
+        out = compressEmitLength(destination, out, numLiterals - 15);
+    }
+    memcpy(destination + out, literals, numLiterals);
+    out += numLiterals;
+    if (matchLength == 0) {
+        return out;
+    }
+
+    destination[out++] = offset & 0xff;
+    destination[out++] = offset >> 8;
+    uint32_t extra = matchLength - COMPRESS_MIN_MATCH;
+    destination[tokenAt] |= (extra < 15 ? extra : 15);
+    if (extra >= 15) {
+        out = compressEmitLength(destination, out, extra - 15);
+    }
+    return out;
+}
+
+uint32_t compressEmitLength(uint8_t* destination, uint32_t out, uint32_t length) {
+    while (length >= 255) {
+        destination[out++] = 255;
+        length -= 255;
+    }
+    destination[out++] = length;
+    return out;
+}
+
+bool pageDecompress(const uint8_t* source, uint32_t length, uint8_t* destination) {
+    uint32_t in = 0;
+    uint32_t out = 0;
+    while (in < length) {
+        uint8_t token = source[in++];
+
+        uint32_t numLiterals = token >> 4;
+        if (numLiterals == 15) {
+            uint8_t more;
+            do {
+                if (in >= length) {
+                    return false;
+                }
+                more = source[in++];
+                numLiterals += more;
+            } while (more == 255);
+        }
+        if (in + numLiterals > length || out + numLiterals > PAGE_SIZE) {
+            return false;
+        }
+        memcpy(destination + out, source + in, numLiterals);
+        in += numLiterals;
+        out += numLiterals;
+        if (in == length) {
+            // the last sequence has no match
+            break;
+        }
+
+        if (in + 2 > length) {
+            return false;
+        }
+        uint32_t offset = source[in] | (source[in + 1] << 8);
+        in += 2;
+        uint32_t matchLength = token & 15;
+        if (matchLength == 15) {
+            uint8_t more;
+            do {
+                if (in >= length) {
+                    return false;
+                }
+                more = source[in++];
+                matchLength += more;
+            } while (more == 255);
+        }
+        matchLength += COMPRESS_MIN_MATCH;
+        if (offset == 0 || offset > out || out + matchLength > PAGE_SIZE) {
+            return false;
+        }
+        if (offset >= sizeof(uint64_t) && out + matchLength + sizeof(uint64_t) <= PAGE_SIZE) {
+            // a word at a time; may write a few bytes past the match, which
+            // the next sequence overwrites
+            for (uint32_t i = 0; i < matchLength; i += sizeof(uint64_t)) {
+                memcpy(destination + out + i, destination + out - offset + i, sizeof(uint64_t));
+            }
+        } else {
+            // byte at a time, since a match may overlap its own output
+            for (uint32_t i = 0; i < matchLength; i++) {
+                destination[out + i] = destination[out - offset + i];
+            }
+        }
+        out += matchLength;
+    }
+    return out == PAGE_SIZE;
+}
+
+void frameMarkClean(Pager* pager, Frame* frame) {
+    if (frame->dirty) {
+        frame->dirty = false;
+        pager->numDirty--;
+    }
+}
+
+void* pagerFlusherMain(void* arg) {
+    Pager* pager = arg;
+    PageRef refs[FLUSH_BATCH_PAGES];
+    uint32_t frameIndices[FLUSH_BATCH_PAGES];
+    // page aligned, as direct I/O writes straight from it
+    char* buffer = aligned_alloc(PAGE_SIZE, (size_t)FLUSH_BATCH_PAGES * PAGE_SIZE);
+    uint32_t lowWater = pager->dirtyLimit / 2;
+
+    pthread_mutex_lock(&(pager->lock));
+    while (true) {
+        while (!pager->stopFlusher && pager->numDirty <= pager->dirtyLimit) {
+            pthread_cond_wait(&(pager->flushNeeded), &(pager->lock));
+        }
+        if (pager->stopFlusher) {
+            break;
+        }
+
+        // drain to half the limit so a steady writer wakes us once per batch
+        while (!pager->stopFlusher && pager->numDirty > lowWater) {
+            // snapshot unpinned dirty pages. the flusher's pin keeps each one
+            // cached until its write lands, so a miss can't read a stale copy.
+            // half the pool stays free for statements pinning their paths
+            uint32_t count = 0;
+            uint32_t maxCount = FLUSH_BATCH_PAGES < pager->numFrames / 2 ? FLUSH_BATCH_PAGES : pager->numFrames / 2;
+            for (uint32_t i = 0; i < pager->numUsedFrames && count < maxCount; i++) {
+                Frame* frame = &(pager->frames[i]);
+                if (frame->pageNum == FRAME_NONE || !frame->dirty) {
+                    continue;
+                }
+                // the bucket lock keeps hits from pinning the page, and so
+                // from changing it, while it is copied
+                pthread_mutex_t* bucketLock = pagerBucketLock(pager, frame->pageNum);
+                pthread_mutex_lock(bucketLock);
+                if (frame->pinCount > 0) {
+                    pthread_mutex_unlock(bucketLock);
+                    continue;
+                }
+                frame->pinCount++;
+                memcpy(buffer + (size_t)count * PAGE_SIZE, frame->page, PAGE_SIZE);
+                pthread_mutex_unlock(bucketLock);
+                frameMarkClean(pager, frame);
+                refs[count].pageNum = frame->pageNum;
+                refs[count].page = buffer + (size_t)count * PAGE_SIZE;
+                frameIndices[count] = i;
+                count++;
+            }
+            if (count == 0) {
+                // everything dirty is pinned right now; try again shortly
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += 1000000;
+                if (deadline.tv_nsec >= 1000000000) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&(pager->flushNeeded), &(pager->lock), &deadline);
+                continue;
+            }
+
+            pthread_mutex_unlock(&(pager->lock));
+            qsort(refs, count, sizeof(PageRef), comparePageRefs);
+            uint32_t writeCalls = pagerWritePages(pager, refs, count);
+            pthread_mutex_lock(&(pager->lock));
+
+            for (uint32_t i = 0; i < count; i++) {
+                Frame* frame = &(pager->frames[frameIndices[i]]);
+                pthread_mutex_t* bucketLock = pagerBucketLock(pager, frame->pageNum);
+                pthread_mutex_lock(bucketLock);
+                frame->pinCount--;
+                pthread_mutex_unlock(bucketLock);
+            }
+            uint64_t end = (uint64_t)(refs[count - 1].pageNum + 1) * PAGE_SIZE;
+            if (end > pager->fileLength) {
+                pager->fileLength = end;
+            }
+            pager->stats.pagesWritten += count;
+            pager->stats.writeCalls += writeCalls;
+        }
+    }
+    pthread_mutex_unlock(&(pager->lock));
+
+    free(buffer);
+    return NULL;
+}
+
+void pagerStopFlusher(Pager* pager) {
+    pthread_mutex_lock(&(pager->lock));
+    pager->stopFlusher = true;
+    pthread_cond_signal(&(pager->flushNeeded));
+    pthread_mutex_unlock(&(pager->lock));
+    pthread_join(pager->flusher, NULL);
+    pager->flusherRunning = false;
+}
+
+void walOpen(Pager* pager, const char* filename) {
+    Wal* wal = malloc(sizeof(Wal));
+    wal->filename = malloc(strlen(filename) + 5);
+    sprintf(wal->filename, "%s-wal", filename);
+    wal->fileDescriptor = open(wal->filename, O_RDWR | O_CREAT, 0200 | 0400);
+    if (wal->fileDescriptor == -1) {
+        printf("Error opening write-ahead log\n");
+        exit(EXIT_FAILURE);
+    }
+
+    wal->salt = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    wal->length = 0;
+    wal->lsnBase = 0;
+    wal->durableLsn = 0;
+    wal->syncInProgress = false;
+    pthread_mutex_init(&(wal->lock), NULL);
+    pthread_cond_init(&(wal->synced), NULL);
+    wal->indexCapacity = 1024;
+    wal->indexKeys = malloc(sizeof(uint32_t) * wal->indexCapacity);
+    wal->indexOffsets = malloc(sizeof(uint64_t) * wal->indexCapacity);
+    wal->txnCapacity = 64;
+    wal->txnPages = malloc(sizeof(uint32_t) * wal->txnCapacity);
+    wal->numTxnPages = 0;
+    wal->bufferCapacity = WAL_FRAME_SIZE * 16;
+    wal->buffer = malloc(wal->bufferCapacity);
+    wal->bufferLength = 0;
+    wal->commits = 0;
+    wal->syncs = 0;
+    wal->checkpoints = 0;
+
+    pager->wal = wal;
+    walRecover(pager);
+}
+
+void walClose(Pager* pager) {
+    Wal* wal = pager->wal;
+    close(wal->fileDescriptor);
+    unlink(wal->filename);
+    pthread_mutex_destroy(&(wal->lock));
+    pthread_cond_destroy(&(wal->synced));
+    free(wal->filename);
+    free(wal->indexKeys);
+    free(wal->indexOffsets);
+    free(wal->txnPages);
+    free(wal->buffer);
+    free(wal);
+    pager->wal = NULL;
+}
+
+void walChecksum(uint32_t* checksum, const void* data, uint32_t length) {
+    // two interleaved running sums over 32-bit words, chained frame to frame
+    const uint32_t* words = data;
+    uint32_t s1 = checksum[0];
+    uint32_t s2 = checksum[1];
+    for (uint32_t i = 0; i < length / sizeof(uint32_t); i += 2) {
+        s1 += words[i] + s2;
+        s2 += words[i + 1] + s1;
+    }
+    checksum[0] = s1;
+    checksum[1] = s2;
+}
+
+void walReset(Pager* pager) {
+    Wal* wal = pager->wal;
+    char header[WAL_HEADER_SIZE];
+    memset(header, 0, WAL_HEADER_SIZE);
+    wal->salt++;
+    memcpy(header, WAL_MAGIC, WAL_MAGIC_SIZE);
+    memcpy(header + 8, &PAGE_SIZE, sizeof(uint32_t));
+    memcpy(header + 12, &(wal->salt), sizeof(uint32_t));
+    wal->checksum[0] = 0;
+    wal->checksum[1] = 0;
+    walChecksum(wal->checksum, header, 16);
+    memcpy(header + 16, wal->checksum, sizeof(wal->checksum));
+
+    if (ftruncate(wal->fileDescriptor, 0) == -1 ||
+        pwrite(wal->fileDescriptor, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE ||
+        fdatasync(wal->fileDescriptor) == -1) {
+        perror("Error resetting write-ahead log\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // everything logged before is in the file now, so it counts as durable.
+    // a committer may still be waiting on an LSN from the old log
+    pthread_mutex_lock(&(wal->lock));
+    wal->lsnBase += wal->length;
+    wal->length = WAL_HEADER_SIZE;
+    if (wal->durableLsn < wal->lsnBase + WAL_HEADER_SIZE) {
+        wal->durableLsn = wal->lsnBase + WAL_HEADER_SIZE;
+    }
+    pthread_cond_broadcast(&(wal->synced));
+    pthread_mutex_unlock(&(wal->lock));
+    wal->numFrames = 0;
+    wal->indexCount = 0;
+    for (uint32_t i = 0; i < wal->indexCapacity; i++) {
+        wal->indexKeys[i] = FRAME_NONE;
+    }
+}
+
+void walRecover(Pager* pager) {
+    Wal* wal = pager->wal;
+    off_t walLength = lseek(wal->fileDescriptor, 0, SEEK_END);
+    char header[WAL_HEADER_SIZE];
+    uint32_t checksum[2] = {0, 0};
+
+    bool valid = walLength >= WAL_HEADER_SIZE &&
+        pread(wal->fileDescriptor, header, WAL_HEADER_SIZE, 0) == WAL_HEADER_SIZE &&
+        memcmp(header, WAL_MAGIC, WAL_MAGIC_SIZE) == 0 &&
+        memcmp(header + 8, &PAGE_SIZE, sizeof(uint32_t)) == 0;
+    if (valid) {
+        walChecksum(checksum, header, 16);
+        valid = memcmp(header + 16, checksum, sizeof(checksum)) == 0;
+    }
+    if (!valid) {
+        walReset(pager);
+        return;
+    }
+    memcpy(&(wal->salt), header + 12, sizeof(uint32_t));
+    wal->indexCount = 0;
+    for (uint32_t i = 0; i < wal->indexCapacity; i++) {
+        wal->indexKeys[i] = FRAME_NONE;
+    }
+
+    // walk the checksum chain to the last intact commit; anything after it
+    // is a torn write or a statement that never committed
+    char* frame = malloc(WAL_FRAME_SIZE);
+    uint64_t offset = WAL_HEADER_SIZE;
+    uint64_t commitEnd = WAL_HEADER_SIZE;
+    uint32_t dbPages = 0;
+    while (offset + WAL_FRAME_SIZE <= (uint64_t)walLength) {
+        if (pread(wal->fileDescriptor, frame, WAL_FRAME_SIZE, offset) != WAL_FRAME_SIZE) {
+            break;
+        }
+        WalFrameHeader* frameHeader = (WalFrameHeader*)frame;
+        if (frameHeader->salt != wal->salt) {
+            break;
+        }
+        uint32_t expected[2] = {checksum[0], checksum[1]};
+        walChecksum(expected, frame, 8);
+        walChecksum(expected, frame + WAL_FRAME_HEADER_SIZE, PAGE_SIZE);
+        if (expected[0] != frameHeader->checksum[0] || expected[1] != frameHeader->checksum[1]) {
+            break;
+        }
+        checksum[0] = expected[0];
+        checksum[1] = expected[1];
+        offset += WAL_FRAME_SIZE;
+        if (frameHeader->dbPages != 0) {
+            commitEnd = offset;
+            dbPages = frameHeader->dbPages;
+        }
+    }
+
+    for (offset = WAL_HEADER_SIZE; offset < commitEnd; offset += WAL_FRAME_SIZE) {
+        WalFrameHeader frameHeader;
+        if (pread(wal->fileDescriptor, &frameHeader, sizeof(frameHeader), offset) != sizeof(frameHeader)) {
+            perror("Error reading write-ahead log\n");
+            exit(EXIT_FAILURE);
+        }
+        walIndexInsert(wal, frameHeader.pageNum, offset);
+    }
+    free(frame);
+
+    if (dbPages > pager->numPages) {
+        pager->numPages = dbPages;
+    }
+    wal->length = commitEnd;
+    wal->durableLsn = wal->lsnBase + commitEnd;
+    wal->numFrames = (commitEnd - WAL_HEADER_SIZE) / WAL_FRAME_SIZE;
+
+    // replay committed pages into the database file and start a fresh log
+    walCheckpoint(pager);
+}
+
+uint64_t walIndexLookup(Wal* wal, uint32_t pageNum) {
+    uint32_t mask = wal->indexCapacity - 1;
+    for (uint32_t slot = (pageNum * 2654435761u) & mask; ; slot = (slot + 1) & mask) {
+        if (wal->indexKeys[slot] == pageNum) {
+            return wal->indexOffsets[slot];
+        }
+        if (wal->indexKeys[slot] == FRAME_NONE) {
+            return 0;
+        }
+    }
+}
+
+void walIndexInsert(Wal* wal, uint32_t pageNum, uint64_t offset) {
+    if ((wal->indexCount + 1) * 2 > wal->indexCapacity) {
+        // grow and rehash
+        uint32_t oldCapacity = wal->indexCapacity;
+        uint32_t* oldKeys = wal->indexKeys;
+        uint64_t* oldOffsets = wal->indexOffsets;
+        wal->indexCapacity *= 2;
+        wal->indexKeys = malloc(sizeof(uint32_t) * wal->indexCapacity);
+        wal->indexOffsets = malloc(sizeof(uint64_t) * wal->indexCapacity);
+        for (uint32_t i = 0; i < wal->indexCapacity; i++) {
+            wal->indexKeys[i] = FRAME_NONE;
+        }
+        wal->indexCount = 0;
+        for (uint32_t i = 0; i < oldCapacity; i++) {
+            if (oldKeys[i] != FRAME_NONE) {
+                walIndexInsert(wal, oldKeys[i], oldOffsets[i]);
+            }
+        }
+        free(oldKeys);
+        free(oldOffsets);
+    }
+
+    uint32_t mask = wal->indexCapacity - 1;
+    uint32_t slot = (pageNum * 2654435761u) & mask;
+    while (wal->indexKeys[slot] != FRAME_NONE && wal->indexKeys[slot] != pageNum) {
+        slot = (slot + 1) & mask;
+    }
+    if (wal->indexKeys[slot] == FRAME_NONE) {
+        wal->indexKeys[slot] = pageNum;
+        wal->indexCount++;
+    }
+    wal->indexOffsets[slot] = offset;
+}
+
+void walBufferFrame(Wal* wal, uint32_t pageNum, uint32_t dbPages, void* page) {
+    if (wal->bufferLength + WAL_FRAME_SIZE > wal->bufferCapacity) {
+        wal->bufferCapacity *= 2;
+        wal->buffer = realloc(wal->buffer, wal->bufferCapacity);
+    }
+
+    WalFrameHeader header;
+    header.pageNum = pageNum;
+    header.dbPages = dbPages;
+    header.salt = wal->salt;
+    header.padding = 0;
+    walChecksum(wal->checksum, &header, 8);
+    walChecksum(wal->checksum, page, PAGE_SIZE);
+    header.checksum[0] = wal->checksum[0];
+    header.checksum[1] = wal->checksum[1];
+
+    char* destination = wal->buffer + wal->bufferLength;
+    memcpy(destination, &header, WAL_FRAME_HEADER_SIZE);
+    memcpy(destination + WAL_FRAME_HEADER_SIZE, page, PAGE_SIZE);
+    walIndexInsert(wal, pageNum, wal->length + wal->bufferLength);
+    wal->bufferLength += WAL_FRAME_SIZE;
+    wal->numFrames++;
+}
+
+void walWriteBuffer(Pager* pager) {
+    Wal* wal = pager->wal;
+    ssize_t bytesWritten = pwrite(wal->fileDescriptor, wal->buffer, wal->bufferLength, wal->length);
+    if (bytesWritten != (ssize_t)wal->bufferLength) {
+        perror("Error writing write-ahead log\n");
+        exit(EXIT_FAILURE);
+    }
+    __atomic_fetch_add(&(pager->stats.bytesWritten), bytesWritten, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(pager->stats.writeCalls), 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(pager->stats.walFrames), wal->bufferLength / WAL_FRAME_SIZE, __ATOMIC_RELAXED);
+    wal->length += wal->bufferLength;
+    wal->bufferLength = 0;
+}
+
+void walAppendPage(Pager* pager, uint32_t pageNum, void* page) {
+    // an uncommitted page pushed out of the pool; recovery ignores it
+    // unless a later commit frame follows it
+    Wal* wal = pager->wal;
+    pthread_mutex_lock(&(wal->lock));
+    walBufferFrame(wal, pageNum, 0, page);
+    walWriteBuffer(pager);
+    pthread_mutex_unlock(&(wal->lock));
+}
+
+void walTrackPage(Pager* pager, uint32_t pageNum) {
+    Wal* wal = pager->wal;
+    if (wal->numTxnPages == wal->txnCapacity) {
+        wal->txnCapacity *= 2;
+        wal->txnPages = realloc(wal->txnPages, sizeof(uint32_t) * wal->txnCapacity);
+    }
+    wal->txnPages[wal->numTxnPages++] = pageNum;
+}
+
+uint64_t walCommit(Pager* pager) {
+    Wal* wal = pager->wal;
+    pthread_mutex_lock(&(wal->lock));
+    if (wal->numTxnPages == 0) {
+        uint64_t lsn = wal->lsnBase + wal->length;
+        pthread_mutex_unlock(&(wal->lock));
+        return lsn;
+    }
+
+    // log every page still dirty in the pool; the last one carries the
+    // commit marker. pages already spilled to the log are not repeated.
+    uint32_t lastFrame = FRAME_NONE;
+    for (uint32_t i = 0; i < wal->numTxnPages; i++) {
+        uint32_t frameIndex = pagerLookupFrame(pager, wal->txnPages[i]);
+        if (frameIndex == FRAME_NONE || !pager->frames[frameIndex].dirty) {
+            continue;
+        }
+        if (lastFrame != FRAME_NONE) {
+            Frame* frame = &(pager->frames[lastFrame]);
+            walBufferFrame(wal, frame->pageNum, 0, frame->page);
+            frameMarkClean(pager, frame);
+        }
+        lastFrame = frameIndex;
+    }
+
+    if (lastFrame != FRAME_NONE) {
+        Frame* frame = &(pager->frames[lastFrame]);
+        walBufferFrame(wal, frame->pageNum, pager->numPages, frame->page);
+        frameMarkClean(pager, frame);
+    } else {
+        // every change was spilled already; relog one page to mark the commit
+        uint32_t pageNum = wal->txnPages[wal->numTxnPages - 1];
+        pthread_mutex_unlock(&(wal->lock));
+        void* page = getPage(pager, pageNum);
+        pthread_mutex_lock(&(wal->lock));
+        walBufferFrame(wal, pageNum, pager->numPages, page);
+        unpinPage(pager, pageNum);
+    }
+
+    walWriteBuffer(pager);
+    wal->numTxnPages = 0;
+    wal->commits++;
+    uint64_t lsn = wal->lsnBase + wal->length;
+    pthread_mutex_unlock(&(wal->lock));
+    return lsn;
+}
+
+void walWaitDurable(Pager* pager, uint64_t lsn) {
+    Wal* wal = pager->wal;
+    pthread_mutex_lock(&(wal->lock));
+    while (wal->durableLsn < lsn) {
+        if (wal->syncInProgress) {
+            // someone else is syncing; their sync may cover us too
+            pthread_cond_wait(&(wal->synced), &(wal->lock));
+            continue;
+        }
+
+        // become the leader and sync everything appended so far, which
+        // includes any commits that queued up behind the previous sync
+        wal->syncInProgress = true;
+        uint64_t target = wal->lsnBase + wal->length;
+        pthread_mutex_unlock(&(wal->lock));
+        if (fdatasync(wal->fileDescriptor) == -1) {
+            perror("Error syncing write-ahead log\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_lock(&(wal->lock));
+        if (wal->durableLsn < target) {
+            wal->durableLsn = target;
+        }
+        wal->syncInProgress = false;
+        wal->syncs++;
+        pthread_cond_broadcast(&(wal->synced));
+    }
+    pthread_mutex_unlock(&(wal->lock));
+}
+
+int compareWalIndexEntries(const void* a, const void* b) {
+    uint32_t left = ((const WalIndexEntry*)a)->pageNum;
+    uint32_t right = ((const WalIndexEntry*)b)->pageNum;
+    return (left > right) - (left < right);
+}
+
+void walCheckpoint(Pager* pager) {
+    Wal* wal = pager->wal;
+    if (wal->indexCount == 0) {
+        return;
+    }
+
+    // visit logged pages in file order so neighbours coalesce into one write
+    WalIndexEntry* entries = malloc(sizeof(WalIndexEntry) * wal->indexCount);
+    uint32_t numEntries = 0;
+    for (uint32_t i = 0; i < wal->indexCapacity; i++) {
+        if (wal->indexKeys[i] != FRAME_NONE) {
+            entries[numEntries].pageNum = wal->indexKeys[i];
+            entries[numEntries].offset = wal->indexOffsets[i];
+            numEntries++;
+        }
+    }
+    qsort(entries, numEntries, sizeof(WalIndexEntry), compareWalIndexEntries);
+
+    PageRef batch[PAGER_MAX_IOVECS];
+    char* scratch = aligned_alloc(PAGE_SIZE, (size_t)PAGER_MAX_IOVECS * PAGE_SIZE);
+    for (uint32_t start = 0; start < numEntries; start += PAGER_MAX_IOVECS) {
+        uint32_t count = numEntries - start;
+        if (count > PAGER_MAX_IOVECS) {
+            count = PAGER_MAX_IOVECS;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t pageNum = entries[start + i].pageNum;
+            batch[i].pageNum = pageNum;
+
+            // a clean cached copy matches the newest logged image
+            uint32_t frameIndex = pagerLookupFrame(pager, pageNum);
+            if (frameIndex != FRAME_NONE && !pager->frames[frameIndex].dirty) {
+                batch[i].page = pager->frames[frameIndex].page;
+                continue;
+            }
+            batch[i].page = scratch + (size_t)i * PAGE_SIZE;
+            off_t offset = entries[start + i].offset + WAL_FRAME_HEADER_SIZE;
+            if (pread(wal->fileDescriptor, batch[i].page, PAGE_SIZE, offset) != PAGE_SIZE) {
+                perror("Error reading write-ahead log\n");
+                exit(EXIT_FAILURE);
+            }
+            __atomic_fetch_add(&(pager->stats.bytesRead), PAGE_SIZE, __ATOMIC_RELAXED);
+        }
+        pager->stats.writeCalls += pagerWritePages(pager, batch, count);
+        pager->stats.pagesWritten += count;
+    }
+
+    uint64_t end = (uint64_t)(entries[numEntries - 1].pageNum + 1) * PAGE_SIZE;
+    if (pager->locations == NULL && end > pager->fileLength) {
+        pager->fileLength = end;
+    }
+    free(entries);
+    free(scratch);
+
+    // the file must hold every page before the log that covered them goes
+    if (pager->locations != NULL) {
+        pagerSaveLocations(pager);
+    } else if (fdatasync(pager->fileDescriptor) == -1) {
+        perror("Error syncing file\n");
+        exit(EXIT_FAILURE);
+    }
+    walReset(pager);
+    wal->checkpoints++;
+}
+
+void pagerMapFile(Pager* pager) {
+    pager->map = mmap(NULL, MMAP_RESERVE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pager->map == MAP_FAILED) {
+        perror("Error reserving address space\n");
+        exit(EXIT_FAILURE);
+    }
+    pager->mapLength = 0;
+    pager->dirtyLow = UINT32_MAX;
+    pager->dirtyHigh = 0;
+
+    if (pager->fileLength > 0) {
+        void* mapped = mmap(pager->map, pager->fileLength, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, pager->fileDescriptor, 0);
+        if (mapped == MAP_FAILED) {
+            perror("Error mapping file\n");
+            exit(EXIT_FAILURE);
+        }
+        pager->mapLength = pager->fileLength;
+    }
+}
+
+void pagerGrowMap(Pager* pager, uint32_t minPages) {
+    uint64_t needed = (uint64_t)minPages * PAGE_SIZE;
+    uint64_t newLength = pager->mapLength;
+    while (newLength < needed) {
+        newLength += MMAP_GROW_SIZE;
+    }
+    if (newLength > MMAP_RESERVE_SIZE) {
+        printf("Database exceeds the %llu byte mmap reservation.\n", MMAP_RESERVE_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
+    if (ftruncate(pager->fileDescriptor, newLength) == -1) {
+        perror("Error extending file\n");
+        exit(EXIT_FAILURE);
+    }
+    // map only the new tail, over the reservation, so existing pages stay put
+    void* mapped = mmap(pager->map + pager->mapLength, newLength - pager->mapLength,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, pager->fileDescriptor, pager->mapLength);
+    if (mapped == MAP_FAILED) {
+        perror("Error mapping file\n");
+        exit(EXIT_FAILURE);
+    }
+    pager->mapLength = newLength;
+    pager->fileLength = newLength;
+}
+
+void pagerTrimMap(Pager* pager, uint32_t numPages) {
+    uint64_t length = (uint64_t)numPages * PAGE_SIZE;
+    // give the tail back to the reservation before the file shrinks
+    // under it, so growing again maps fresh pages instead of faulting
+    void* reserved = mmap(pager->map + length, pager->mapLength - length, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    if (reserved == MAP_FAILED) {
+        perror("Error unmapping file tail\n");
+        exit(EXIT_FAILURE);
+    }
+    if (ftruncate(pager->fileDescriptor, length) == -1) {
+        perror("Error truncating file\n");
+        exit(EXIT_FAILURE);
+    }
+    pager->mapLength = length;
+    pager->fileLength = length;
+    pager->numPages = numPages;
+}
+
+void pagerSyncMap(Pager* pager) {
+    if (pager->dirtyLow > pager->dirtyHigh) {
+        return;
+    }
+    uint64_t offset = (uint64_t)pager->dirtyLow * PAGE_SIZE;
+    uint64_t length = (uint64_t)(pager->dirtyHigh - pager->dirtyLow + 1) * PAGE_SIZE;
+    if (msync(pager->map + offset, length, MS_SYNC) == -1) {
+        perror("Error syncing mapped file\n");
+        exit(EXIT_FAILURE);
+    }
+    pager->dirtyLow = UINT32_MAX;
+    pager->dirtyHigh = 0;
+}
+
+void pagerReadAhead(Pager* pager, uint32_t* pageNums, uint32_t count) {
+    if (pager->directIo) {
+        // reads skip the kernel's cache, so there is nothing to warm
+        return;
+    }
+
+    // where each page not already in the pool is stored. pages with a
+    // newer image in the log are left alone, the log is read page by page.
+    // mapped pages have no pool; which are resident is asked per run below
+    PageLocation ranges[count];
+    uint32_t numRanges = 0;
+    if (pager->map != NULL) {
+        for (uint32_t i = 0; i < count; i++) {
+            if ((uint64_t)(pageNums[i] + 1) * PAGE_SIZE <= pager->mapLength) {
+                ranges[numRanges].offset = (uint64_t)pageNums[i] * PAGE_SIZE;
+                ranges[numRanges].length = PAGE_SIZE;
+                numRanges++;
+            }
+        }
+    } else {
+        pthread_mutex_lock(&(pager->lock));
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t pageNum = pageNums[i];
+            if (pagerLookupFrame(pager, pageNum) != FRAME_NONE) {
+                continue;
+            }
+            if (pager->wal != NULL && walIndexLookup(pager->wal, pageNum) != 0) {
+                continue;
+            }
+            if (pager->locations != NULL) {
+                if (pageNum < pager->locationCapacity && pager->locations[pageNum].length > 0) {
+                    ranges[numRanges++] = pager->locations[pageNum];
+                }
+            } else if ((uint64_t)(pageNum + 1) * PAGE_SIZE <= pager->fileLength) {
+                ranges[numRanges].offset = (uint64_t)pageNum * PAGE_SIZE;
+                ranges[numRanges].length = PAGE_SIZE;
+                numRanges++;
+            }
+        }
+        pthread_mutex_unlock(&(pager->lock));
+    }
+    if (numRanges == 0) {
+        return;
+    }
+
+    // one request per run of adjacent extents
+    qsort(ranges, numRanges, sizeof(PageLocation), comparePageLocations);
+    uint64_t start = ranges[0].offset;
+    uint64_t end = start + ranges[0].length;
+    uint32_t runPages = 1;
+    uint32_t advised = 0;
+    for (uint32_t i = 1; i <= numRanges; i++) {
+        if (i < numRanges && ranges[i].offset == end) {
+            end += ranges[i].length;
+            runPages++;
+            continue;
+        }
+        if (pager->map != NULL) {
+            advised += pagerAdviseMapped(pager, start, end - start);
+        } else {
+            posix_fadvise(pager->fileDescriptor, start, end - start, POSIX_FADV_WILLNEED);
+            advised += runPages;
+        }
+        if (i < numRanges) {
+            start = ranges[i].offset;
+            end = start + ranges[i].length;
+            runPages = 1;
+        }
+    }
+    __atomic_fetch_add(&(pager->stats.readAheadPages), advised, __ATOMIC_RELAXED);
+}
+
+uint32_t pagerAdviseMapped(Pager* pager, uint64_t offset, uint64_t length) {
+    uint32_t numPages = length / PAGE_SIZE;
+    unsigned char resident[numPages];
+    if (mincore(pager->map + offset, length, resident) == -1) {
+        memset(resident, 0, numPages);
+    }
+
+    // one madvise per stretch that isn't resident already
+    uint32_t advised = 0;
+    uint32_t i = 0;
+    while (i < numPages) {
+        if (resident[i] & 1) {
+            i++;
+            continue;
+        }
+        uint32_t j = i;
+        while (j < numPages && !(resident[j] & 1)) {
+            j++;
+        }
+        madvise(pager->map + offset + (uint64_t)i * PAGE_SIZE, (uint64_t)(j - i) * PAGE_SIZE, MADV_WILLNEED);
+        advised += j - i;
+        i = j;
+    }
+    return advised;
+}
+
+uint32_t pagerLookupFrame(Pager* pager, uint32_t pageNum) {
+    uint32_t frameIndex = pager->buckets[pageNum & (pager->numBuckets - 1)];
+    while (frameIndex != FRAME_NONE) {
+        if (pager->frames[frameIndex].pageNum == pageNum) {
+            return frameIndex;
+        }
+        frameIndex = pager->frames[frameIndex].hashNext;
+    }
+    return FRAME_NONE;
+}
+
+pthread_mutex_t* pagerBucketLock(Pager* pager, uint32_t pageNum) {
+    uint32_t bucket = pageNum & (pager->numBuckets - 1);
+    return &(pager->bucketLocks[bucket & (PAGER_BUCKET_LOCKS - 1)]);
+}
+
+void pagerHashInsert(Pager* pager, uint32_t frameIndex) {
+    Frame* frame = &(pager->frames[frameIndex]);
+    uint32_t bucket = frame->pageNum & (pager->numBuckets - 1);
+    pthread_mutex_t* bucketLock = pagerBucketLock(pager, frame->pageNum);
+    pthread_mutex_lock(bucketLock);
+    frame->hashNext = pager->buckets[bucket];
+    pager->buckets[bucket] = frameIndex;
+    pthread_mutex_unlock(bucketLock);
+}
+
+void pagerHashRemove(Pager* pager, uint32_t frameIndex) {
+    Frame* frame = &(pager->frames[frameIndex]);
+    uint32_t* link = &(pager->buckets[frame->pageNum & (pager->numBuckets - 1)]);
+    while (*link != frameIndex) {
+        link = &(pager->frames[*link].hashNext);
+    }
+    *link = frame->hashNext;
+}
+
+uint32_t pagerAllocateFrame(Pager* pager) {
+    if (pager->numUsedFrames < pager->numFrames) {
+        // pool not yet full, hand out a fresh frame
+        uint32_t frameIndex = pager->numUsedFrames++;
+        pager->frames[frameIndex].pageNum = FRAME_NONE;
+        return frameIndex;
+    }
+
+    // CLOCK: sweep unpinned frames, giving referenced ones a second chance.
+    // two full sweeps clear every reference bit, so a third means all pinned.
+    for (uint32_t scanned = 0; scanned < pager->numFrames * 3; scanned++) {
+        uint32_t frameIndex = pager->clockHand;
+        pager->clockHand = (pager->clockHand + 1) % pager->numFrames;
+
+        // hits pin under the bucket lock, so with it held an unpinned
+        // victim stays unpinned until it is out of the page table
+        Frame* frame = &(pager->frames[frameIndex]);
+        pthread_mutex_t* bucketLock = pagerBucketLock(pager, frame->pageNum);
+        pthread_mutex_lock(bucketLock);
+        if (frame->pinCount > 0) {
+            pthread_mutex_unlock(bucketLock);
+            continue;
+        }
+        if (frame->referenced) {
+            frame->referenced = false;
+            pthread_mutex_unlock(bucketLock);
+            continue;
+        }
+
+        // write back dirty victim before reusing its frame. with a log the
+        // file is only written at checkpoints, so the page goes to the log
+        if (frame->dirty && pager->wal != NULL) {
+            walAppendPage(pager, frame->pageNum, frame->page);
+            frameMarkClean(pager, frame);
+            pager->stats.dirtyEvictions++;
+        } else if (frame->dirty) {
+            pagerFlush(pager, frame->pageNum);
+            pager->stats.dirtyEvictions++;
+        }
+        pagerHashRemove(pager, frameIndex);
+        pthread_mutex_unlock(bucketLock);
+        frame->pageNum = FRAME_NONE;
+        pager->stats.evictions++;
+        return frameIndex;
+    }
+
+    printf("Buffer pool exhausted: all %d frames are pinned.\n", pager->numFrames);
+    exit(EXIT_FAILURE);
+}
+
+void* getPage(Pager* pager, uint32_t pageNum) {
+    if (pager->map != NULL) {
+        if ((uint64_t)(pageNum + 1) * PAGE_SIZE > pager->mapLength) {
+            pagerGrowMap(pager, pageNum + 1);
+        }
+        if (pageNum >= pager->numPages) {
+            pager->numPages = pageNum + 1;
+        }
+        // readers share the table lock here, so count without one
+        __atomic_fetch_add(&(pager->stats.hits), 1, __ATOMIC_RELAXED);
+        return pager->map + (uint64_t)pageNum * PAGE_SIZE;
+    }
+
+    // a hit only needs its bucket, so descents on different pages don't
+    // queue on the pager lock
+    pthread_mutex_t* bucketLock = pagerBucketLock(pager, pageNum);
+    pthread_mutex_lock(bucketLock);
+    uint32_t frameIndex = pagerLookupFrame(pager, pageNum);
+    if (frameIndex != FRAME_NONE) {
+        Frame* frame = &(pager->frames[frameIndex]);
+        frame->pinCount++;
+        frame->referenced = true;
+        pthread_mutex_unlock(bucketLock);
+        __atomic_fetch_add(&(pager->stats.hits), 1, __ATOMIC_RELAXED);
+        return frame->page;
+    }
+    pthread_mutex_unlock(bucketLock);
+
+    // cache miss. another miss may have loaded the page meanwhile; only
+    // the pager lock holder adds pages, so looking again under it settles it
+    pthread_mutex_lock(&(pager->lock));
+    frameIndex = pagerLookupFrame(pager, pageNum);
+    if (frameIndex != FRAME_NONE) {
+        Frame* frame = &(pager->frames[frameIndex]);
+        pthread_mutex_lock(bucketLock);
+        frame->pinCount++;
+        frame->referenced = true;
+        pthread_mutex_unlock(bucketLock);
+        __atomic_fetch_add(&(pager->stats.hits), 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&(pager->lock));
+        return frame->page;
+    }
+
+    // claim a frame, load from file
+    pager->stats.misses++;
+    frameIndex = pagerAllocateFrame(pager);
+    Frame* frame = &(pager->frames[frameIndex]);
+    void* page = frame->page;
+    uint32_t numPages = pager->fileLength / PAGE_SIZE;
+    uint64_t walOffset = (pager->wal != NULL) ? walIndexLookup(pager->wal, pageNum) : 0;
+
+    if (walOffset != 0) {
+        // newest version of this page is in the log
+        ssize_t bytesRead = pread(pager->wal->fileDescriptor, page, PAGE_SIZE, walOffset + WAL_FRAME_HEADER_SIZE);
+        if (bytesRead != PAGE_SIZE) {
+            perror("Error reading write-ahead log\n");
+            exit(EXIT_FAILURE);
+        }
+        __atomic_fetch_add(&(pager->stats.bytesRead), bytesRead, __ATOMIC_RELAXED);
+    } else if (pager->locations != NULL) {
+        pagerReadCompressed(pager, pageNum, page);
+    } else if (pageNum < numPages) {
+        lseek(pager->fileDescriptor, (off_t)pageNum * PAGE_SIZE, SEEK_SET);
+        ssize_t bytesRead = read(pager->fileDescriptor, page, PAGE_SIZE);
+        if (bytesRead == -1) {
+            perror("Error reading file\n");
+            exit(EXIT_FAILURE);
+        }
+        __atomic_fetch_add(&(pager->stats.bytesRead), bytesRead, __ATOMIC_RELAXED);
+    } else {
+        memset(page, 0, PAGE_SIZE);
+    }
+
+    frame->pageNum = pageNum;
+    frame->pinCount = 1;
+    frame->dirty = false;
+    frame->referenced = true;
+    pagerHashInsert(pager, frameIndex);
+
+    if (pageNum >= pager->numPages) {
+        pager->numPages = pageNum + 1;
+    }
+
+    pthread_mutex_unlock(&(pager->lock));
+    return page;
+}
+
+void unpinPage(Pager* pager, uint32_t pageNum) {
+    if (pager->map != NULL) {
+        // mapped pages are never evicted by us
+        return;
+    }
+
+    pthread_mutex_t* bucketLock = pagerBucketLock(pager, pageNum);
+    pthread_mutex_lock(bucketLock);
+    uint32_t frameIndex = pagerLookupFrame(pager, pageNum);
+    if (frameIndex == FRAME_NONE || pager->frames[frameIndex].pinCount == 0) {
+        printf("Error unpinning page %d that is not pinned\n", pageNum);
+        exit(EXIT_FAILURE);
+    }
+    pager->frames[frameIndex].pinCount--;
+    pthread_mutex_unlock(bucketLock);
+}
+
+void markPageDirty(Pager* pager, uint32_t pageNum) {
+    if (pager->map != NULL) {
+        if (pageNum < pager->dirtyLow) {
+            pager->dirtyLow = pageNum;
+        }
+        if (pageNum > pager->dirtyHigh) {
+            pager->dirtyHigh = pageNum;
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&(pager->lock));
+    uint32_t frameIndex = pagerLookupFrame(pager, pageNum);
+    if (frameIndex == FRAME_NONE) {
+        printf("Error marking page %d dirty, it is not cached\n", pageNum);
+        exit(EXIT_FAILURE);
+    }
+    Frame* frame = &(pager->frames[frameIndex]);
+    if (!frame->dirty) {
+        if (pager->wal != NULL) {
+            walTrackPage(pager, pageNum);
+        }
+        frame->dirty = true;
+        pager->numDirty++;
+        if (pager->flusherRunning && pager->numDirty > pager->dirtyLimit) {
+            pthread_cond_signal(&(pager->flushNeeded));
+        }
+    }
+    pthread_mutex_unlock(&(pager->lock));
+}
+
+uint32_t getUnusedPageNum(Pager* pager) {
+    pthread_mutex_lock(&(pager->freeListLock));
+    if (pager->freeListHead != 0) {
+        uint32_t pageNum = pager->freeListHead;
+        void* page = getPage(pager, pageNum);
+        memcpy(&(pager->freeListHead), page + FREE_PAGE_NEXT_OFFSET, sizeof(uint32_t));
+        unpinPage(pager, pageNum);
+        pager->freeListCount--;
+        pagerSaveFreeList(pager);
+        pagerStampPage(pager, pageNum);
+        pthread_mutex_unlock(&(pager->freeListLock));
+        return pageNum;
+    }
+    pthread_mutex_unlock(&(pager->freeListLock));
+
+    // reserve it now, so concurrent splits never claim the same page
+    uint32_t pageNum;
+    if (pager->map != NULL) {
+        pageNum = pager->numPages++;
+    } else {
+        pthread_mutex_lock(&(pager->lock));
+        pageNum = pager->numPages++;
+        pthread_mutex_unlock(&(pager->lock));
+    }
+    pthread_mutex_lock(&(pager->freeListLock));
+    pagerStampPage(pager, pageNum);
+    pagerSavePageCount(pager);
+    pthread_mutex_unlock(&(pager->freeListLock));
+    return pageNum;
+}
+
+void pagerStampPage(Pager* pager, uint32_t pageNum) {
+    if (pageNum >= pager->versionCapacity) {
+        uint64_t capacity = (pager->versionCapacity == 0) ? 1024 : pager->versionCapacity;
+        while (capacity <= pageNum) {
+            capacity *= 2;
+        }
+        pager->pageVersions = realloc(pager->pageVersions, sizeof(uint64_t) * capacity);
+        memset(pager->pageVersions + pager->versionCapacity, 0,
+               sizeof(uint64_t) * (capacity - pager->versionCapacity));
+        pager->versionCapacity = capacity;
+    }
+    pager->pageVersions[pageNum] = pager->writeVersion;
+}
+
+void freePage(Pager* pager, uint32_t pageNum) {
+    void* page = getPage(pager, pageNum);
+    memset(page, 0, PAGE_SIZE);
+    setNodeType(page, NODE_FREE);
+    pthread_mutex_lock(&(pager->freeListLock));
+    memcpy(page + FREE_PAGE_NEXT_OFFSET, &(pager->freeListHead), sizeof(uint32_t));
+    pager->freeListHead = pageNum;
+    pager->freeListCount++;
+    pagerSaveFreeList(pager);
+    pthread_mutex_unlock(&(pager->freeListLock));
+    markPageDirty(pager, pageNum);
+    unpinPage(pager, pageNum);
+}
+
+void pagerSaveFreeList(Pager* pager) {
+    // the header changes in the same commit as the pages, so the list
+    // on disk always matches them
+    DbHeader* header = getPage(pager, DB_HEADER_PAGE);
+    header->freeListHead = pager->freeListHead;
+    header->freeListCount = pager->freeListCount;
+    markPageDirty(pager, DB_HEADER_PAGE);
+    unpinPage(pager, DB_HEADER_PAGE);
+}
+
+void pagerSavePageCount(Pager* pager) {
+    // like the free list, this commits with the pages it counts
+    DbHeader* header = getPage(pager, DB_HEADER_PAGE);
+    header->numPages = pager->numPages;
+    markPageDirty(pager, DB_HEADER_PAGE);
+    unpinPage(pager, DB_HEADER_PAGE);
+}
+
+void latchPage(Pager* pager, void* page, bool exclusive) {
+    if (pager->map != NULL) {
+        // mapped pages have no frames; the table lock stands in
+        return;
+    }
+    Frame* frame = &(pager->frames[(page - pager->frameArena) / PAGE_SIZE]);
+    if (exclusive) {
+        pthread_rwlock_wrlock(&(frame->latch));
+    } else {
+        pthread_rwlock_rdlock(&(frame->latch));
+    }
+}
+
+void unlatchPage(Pager* pager, void* page) {
+    if (pager->map != NULL) {
+        return;
+    }
+    pthread_rwlock_unlock(&(pager->frames[(page - pager->frameArena) / PAGE_SIZE].latch));
+}
+
+bool tryLatchPage(Pager* pager, void* page, bool exclusive) {
+    if (pager->map != NULL) {
+        return true;
+    }
+    pthread_rwlock_t* latch = &(pager->frames[(page - pager->frameArena) / PAGE_SIZE].latch);
+    if (exclusive) {
+        return pthread_rwlock_trywrlock(latch) == 0;
+    }
+    return pthread_rwlock_tryrdlock(latch) == 0;
+}
+
+void pagerFlush(Pager* pager, uint32_t pageNum) {
+    if (pager->map != NULL) {
+        if (msync(pager->map + (uint64_t)pageNum * PAGE_SIZE, PAGE_SIZE, MS_SYNC) == -1) {
+            perror("Error syncing mapped page\n");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+
+    uint32_t frameIndex = pagerLookupFrame(pager, pageNum);
+    if (frameIndex == FRAME_NONE) {
+        printf("Error flushing null page\n");
+        exit(EXIT_FAILURE);
+    }
+    Frame* frame = &(pager->frames[frameIndex]);
+
+    if (pager->locations != NULL) {
+        PageRef ref = {pageNum, frame->page};
+        pager->stats.writeCalls += pagerWriteCompressed(pager, &ref, 1);
+        pager->stats.pagesWritten++;
+        frameMarkClean(pager, frame);
+        return;
+    }
+
+    off_t offset = lseek(pager->fileDescriptor, (off_t)pageNum * PAGE_SIZE, SEEK_SET);
+
+    if (offset == -1) {
+        perror("Seeking\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ssize_t bytesWritten = write(pager->fileDescriptor, frame->page, PAGE_SIZE);
+
+    if (bytesWritten == -1) {
+        perror("Error writing file\n");
+        exit(EXIT_FAILURE);
+    }
+    __atomic_fetch_add(&(pager->stats.bytesWritten), bytesWritten, __ATOMIC_RELAXED);
+
+    frameMarkClean(pager, frame);
+    pager->stats.pagesWritten++;
+    pager->stats.writeCalls++;
+    if ((uint64_t)(offset + PAGE_SIZE) > pager->fileLength) {
+        pager->fileLength = offset + PAGE_SIZE;
+    }
+}
+
+void tableStart(Table* table, Cursor* cursor) {
+    tableSeek(table, 0, cursor);
+}
+
+void tableSeek(Table* table, uint32_t key, Cursor* cursor) {
+    tableFind(table, key, cursor);
+
+    uint32_t numCells = *leafNodeNumCells(cursor->leaf);
+    cursor->endOfTable = (numCells == 0);
+    if (numCells > 0 && cursor->cellNum >= numCells) {
+        // key is past everything in this leaf; step onto the next one
+        cursor->cellNum = numCells - 1;
+        cursorAdvance(cursor);
+    }
+}
+
+void tableFind(Table* table, uint32_t key, Cursor* cursor) {
+    tableDescend(table, key, LATCH_READ, 0, cursor);
+}
+
+void tableDescend(Table* table, uint32_t key, LatchMode mode, uint32_t valueSize, Cursor* cursor) {
+    Pager* pager = table->pager;
+    cursor->table = table;
+    cursor->endOfTable = false;
+    cursor->exclusive = (mode != LATCH_READ);
+    cursor->depth = 0;
+    cursor->firstLatched = 0;
+    cursor->snapshot = NULL;
+    cursor->readAheadParent = 0;
+    cursor->readAheadEnd = 0;
+    cursor->readAheadIndex = 0;
+
+    // the root page only moves when a writer copies it for a snapshot, and
+    // that writer has the tree to itself. otherwise it only ever turns from
+    // a leaf into an internal node, and nothing above it holds it still
+    // meanwhile, so an optimistic writer checks its type again after
+    // relatching
+    uint32_t pageNum = table->rootPageNum;
+    void* node = getPage(pager, pageNum);
+    bool exclusive = (mode == LATCH_WRITE_PATH);
+    latchPage(pager, node, exclusive);
+    while (mode == LATCH_WRITE_LEAF && (getNodeType(node) == NODE_LEAF) != exclusive) {
+        unlatchPage(pager, node);
+        exclusive = !exclusive;
+        latchPage(pager, node, exclusive);
+    }
+
+    // crab down: a child is latched before its parent is let go
+    while (getNodeType(node) == NODE_INTERNAL) {
+        if (cursor->depth >= BTREE_MAX_DEPTH) {
+            printf("Tree is deeper than %d levels.\n", BTREE_MAX_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        uint32_t index = internalNodeFindChild(node, key);
+        cursor->path[cursor->depth] = pageNum;
+        cursor->pathIndex[cursor->depth] = index;
+        cursor->pathPages[cursor->depth] = node;
+        cursor->depth++;
+
+        uint32_t childNum = *internalNodeChild(node, index);
+        void* child = getPage(pager, childNum);
+        if (mode == LATCH_WRITE_PATH) {
+            latchPage(pager, child, true);
+            if (nodeIsSafe(child, valueSize)) {
+                // a split stops at this child, so nothing above it changes
+                for (uint32_t i = cursor->firstLatched; i < cursor->depth; i++) {
+                    unlatchPage(pager, cursor->pathPages[i]);
+                    unpinPage(pager, cursor->path[i]);
+                }
+                cursor->firstLatched = cursor->depth;
+            }
+        } else {
+            latchPage(pager, child, false);
+            if (mode == LATCH_WRITE_LEAF && getNodeType(child) == NODE_LEAF) {
+                // splitting the leaf takes its parent, which we still hold,
+                // so it is the same leaf once relatched
+                unlatchPage(pager, child);
+                latchPage(pager, child, true);
+            }
+            unlatchPage(pager, node);
+            unpinPage(pager, pageNum);
+            cursor->firstLatched = cursor->depth;
+        }
+        pageNum = childNum;
+        node = child;
+    }
+    __atomic_fetch_add(&(table->stats.descents), 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(table->stats.nodesVisited), cursor->depth + 1, __ATOMIC_RELAXED);
+
+    // the cursor keeps the leaf's pin and latch until it moves off or closes
+    cursor->pageNum = pageNum;
+    cursor->leaf = node;
+    cursor->cellNum = leafNodeLowerBound(node, key);
+}
+
+bool tableTryAppend(Table* table, uint32_t key, uint32_t valueSize, Cursor* cursor) {
+    uint64_t hint = __atomic_load_n(&(table->appendHint), __ATOMIC_RELAXED);
+    uint32_t pageNum = hint >> 32;
+    if (pageNum == 0 || key <= (uint32_t)hint) {
+        return false;
+    }
+
+    // only this leaf gets latched, and nothing after it, so skipping its
+    // ancestors can't deadlock with writers crabbing down to it. the hint
+    // may be stale: a leaf with no next leaf is the rightmost one, and past
+    // its last key is where a descent for key would end up
+    Pager* pager = table->pager;
+    void* node = getPage(pager, pageNum);
+    latchPage(pager, node, true);
+    uint32_t numCells = *leafNodeNumCells(node);
+    if (getNodeType(node) != NODE_LEAF || *leafNodeNextLeaf(node) != 0
+        || (numCells > 0 && *leafNodeKey(node, numCells - 1) >= key) || !nodeIsSafe(node, valueSize)) {
+        unlatchPage(pager, node);
+        unpinPage(pager, pageNum);
+        return false;
+    }
+
+    cursor->table = table;
+    cursor->pageNum = pageNum;
+    cursor->leaf = node;
+    cursor->cellNum = numCells;
+    cursor->endOfTable = false;
+    cursor->exclusive = true;
+    cursor->depth = 0;
+    cursor->firstLatched = 0;
+    cursor->snapshot = NULL;
+    cursor->readAheadParent = 0;
+    cursor->readAheadEnd = 0;
+    cursor->readAheadIndex = 0;
+    __atomic_fetch_add(&(table->stats.appendHits), 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+void tableSetAppendHint(Table* table, uint32_t pageNum, uint32_t maxKey) {
+    uint64_t hint = ((uint64_t)pageNum << 32) | maxKey;
+    __atomic_store_n(&(table->appendHint), hint, __ATOMIC_RELAXED);
+}
+
+bool nodeIsSafe(void* node, uint32_t valueSize) {
+    if (getNodeType(node) == NODE_LEAF) {
+        return leafNodeFreeSpace(node) >= LEAF_NODE_CELL_OVERHEAD + valueSize;
+    }
+    return *internalNodeNumKeys(node) < INTERNAL_NODE_MAX_KEYS;
+}
+
+void closeCursor(Cursor* cursor) {
+    if (cursor->snapshot != NULL) {
+        snapshotUnpinPage(cursor->table, cursor->pageNum);
+        return;
+    }
+    Pager* pager = cursor->table->pager;
+    unlatchPage(pager, cursor->leaf);
+    unpinPage(pager, cursor->pageNum);
+    for (uint32_t i = cursor->firstLatched; i < cursor->depth; i++) {
+        unlatchPage(pager, cursor->pathPages[i]);
+        unpinPage(pager, cursor->path[i]);
+    }
+}
+
+void tableBeginSnapshot(Table* table, Snapshot* snapshot) {
+    pthread_rwlock_wrlock(&(table->lock));
+    // pages allocated from here on are newer than the snapshot
+    snapshot->version = table->pager->writeVersion++;
+    snapshot->rootPageNum = table->rootPageNum;
+    if (table->numSnapshots == table->snapshotCapacity) {
+        table->snapshotCapacity = (table->snapshotCapacity == 0) ? 16 : table->snapshotCapacity * 2;
+        table->snapshots = realloc(table->snapshots, sizeof(uint64_t) * table->snapshotCapacity);
+    }
+    table->snapshots[table->numSnapshots++] = snapshot->version;
+
+    // writers stop appending in place, and the leaf the hint names may be
+    // copied and freed before they start again
+    tableSetAppendHint(table, 0, 0);
+    pthread_rwlock_unlock(&(table->lock));
+}
+
+void tableEndSnapshot(Table* table, Snapshot* snapshot) {
+    pthread_rwlock_wrlock(&(table->lock));
+    uint32_t i = 0;
+    while (table->snapshots[i] != snapshot->version) {
+        i++;
+    }
+    memmove(table->snapshots + i, table->snapshots + i + 1, sizeof(uint64_t) * (table->numSnapshots - i - 1));
+    table->numSnapshots--;
+
+    // a page retired at version v was visible only to snapshots older than v
+    uint64_t oldest = (table->numSnapshots > 0) ? table->snapshots[0] : UINT64_MAX;
+    uint32_t kept = 0;
+    for (i = 0; i < table->numRetired; i++) {
+        if (table->retired[i].version > oldest) {
+            table->retired[kept++] = table->retired[i];
+        } else {
+            freePage(table->pager, table->retired[i].pageNum);
+        }
+    }
+    table->numRetired = kept;
+    pthread_rwlock_unlock(&(table->lock));
+}
+
+void snapshotSeek(Table* table, Snapshot* snapshot, uint32_t key, Cursor* cursor) {
+    cursor->table = table;
+    cursor->endOfTable = false;
+    cursor->exclusive = false;
+    cursor->depth = 0;
+    cursor->snapshot = snapshot;
+    cursor->readAheadParent = 0;
+    cursor->readAheadEnd = 0;
+    cursor->readAheadIndex = 0;
+
+    // one shared hold of the table lock covers the whole descent
+    pthread_rwlock_rdlock(&(table->lock));
+    uint32_t pageNum = snapshot->rootPageNum;
+    void* node = getPage(table->pager, pageNum);
+    while (getNodeType(node) == NODE_INTERNAL) {
+        if (cursor->depth >= BTREE_MAX_DEPTH) {
+            printf("Tree is deeper than %d levels.\n", BTREE_MAX_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        uint32_t index = internalNodeFindChild(node, key);
+        cursor->path[cursor->depth] = pageNum;
+        cursor->pathIndex[cursor->depth] = index;
+        cursor->depth++;
+        uint32_t childNum = *internalNodeChild(node, index);
+        unpinPage(table->pager, pageNum);
+        pageNum = childNum;
+        node = getPage(table->pager, pageNum);
+    }
+    cursor->firstLatched = cursor->depth;
+    __atomic_fetch_add(&(table->stats.descents), 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(table->stats.nodesVisited), cursor->depth + 1, __ATOMIC_RELAXED);
+
+    cursor->pageNum = pageNum;
+    cursor->leaf = node;
+    cursor->cellNum = leafNodeLowerBound(node, key);
+    snapshotReadAhead(cursor);
+    pthread_rwlock_unlock(&(table->lock));
+    if (cursor->cellNum >= *leafNodeNumCells(node)) {
+        snapshotNextLeaf(cursor);
+    }
+}
+
+void snapshotNextLeaf(Cursor* cursor) {
+    Table* table = cursor->table;
+    Pager* pager = table->pager;
+    pthread_rwlock_rdlock(&(table->lock));
+    while (cursor->cellNum >= *leafNodeNumCells(cursor->leaf)) {
+        // climb to the nearest ancestor with a child right of the path, then
+        // take the leftmost way down from it. nothing in a snapshot changes,
+        // so the path from the descent stays good
+        uint32_t level = cursor->depth;
+        uint32_t childNum = 0;
+        while (level > 0 && childNum == 0) {
+            level--;
+            void* node = getPage(pager, cursor->path[level]);
+            if (cursor->pathIndex[level] < *internalNodeNumKeys(node)) {
+                cursor->pathIndex[level]++;
+                childNum = *internalNodeChild(node, cursor->pathIndex[level]);
+            }
+            unpinPage(pager, cursor->path[level]);
+        }
+        if (childNum == 0) {
+            cursor->endOfTable = true;
+            break;
+        }
+
+        unpinPage(pager, cursor->pageNum);
+        uint32_t pageNum = childNum;
+        void* node = getPage(pager, pageNum);
+        for (level++; getNodeType(node) == NODE_INTERNAL; level++) {
+            cursor->path[level] = pageNum;
+            cursor->pathIndex[level] = 0;
+            uint32_t firstChild = *internalNodeChild(node, 0);
+            unpinPage(pager, pageNum);
+            pageNum = firstChild;
+            node = getPage(pager, pageNum);
+        }
+        cursor->pageNum = pageNum;
+        cursor->leaf = node;
+        cursor->cellNum = 0;
+        snapshotReadAhead(cursor);
+    }
+    pthread_rwlock_unlock(&(table->lock));
+}
+
+void snapshotReadAhead(Cursor* cursor) {
+    if (cursor->depth == 0) {
+        return;
+    }
+    Table* table = cursor->table;
+    uint32_t parentNum = cursor->path[cursor->depth - 1];
+    uint32_t index = cursor->pathIndex[cursor->depth - 1];
+    uint32_t first = index + 1;
+    if (parentNum == cursor->readAheadParent) {
+        if (index + READ_AHEAD_LEAVES / 2 < cursor->readAheadEnd) {
+            return;
+        }
+        if (cursor->readAheadEnd > first) {
+            first = cursor->readAheadEnd;
+        }
+    }
+
+    // the parent's last child is its right child, at index numKeys
+    void* parent = getPage(table->pager, parentNum);
+    uint32_t numChildren = *internalNodeNumKeys(parent) + 1;
+    uint32_t end = index + 1 + READ_AHEAD_LEAVES;
+    if (end > numChildren) {
+        end = numChildren;
+    }
+    uint32_t pageNums[READ_AHEAD_LEAVES];
+    uint32_t count = 0;
+    for (uint32_t i = first; i < end; i++) {
+        pageNums[count++] = *internalNodeChild(parent, i);
+    }
+    unpinPage(table->pager, parentNum);
+    cursor->readAheadParent = parentNum;
+    cursor->readAheadEnd = end;
+
+    if (count > 0) {
+        pagerReadAhead(table->pager, pageNums, count);
+    }
+}
+
+void* snapshotGetPage(Table* table, uint32_t pageNum) {
+    pthread_rwlock_rdlock(&(table->lock));
+    void* page = getPage(table->pager, pageNum);
+    pthread_rwlock_unlock(&(table->lock));
+    return page;
+}
+
+void cursorReadAhead(Cursor* cursor) {
+    // count the leaf just reached, and only look at the tree again once
+    // the window runs low
+    cursor->readAheadIndex++;
+    if (cursor->readAheadEnd != 0 && cursor->readAheadIndex + READ_AHEAD_LEAVES / 2 < cursor->readAheadEnd) {
+        return;
+    }
+    if (cursor->endOfTable || *leafNodeNumCells(cursor->leaf) == 0) {
+        return;
+    }
+
+    // find the leaf's parent again from the root. the cursor holds its
+    // leaf, and waiting for an ancestor could deadlock with a writer
+    // crabbing down to it, so a busy node just skips this read-ahead
+    Table* table = cursor->table;
+    Pager* pager = table->pager;
+    uint32_t key = *leafNodeKey(cursor->leaf, 0);
+    uint32_t pageNum = table->rootPageNum;
+    if (pageNum == cursor->pageNum) {
+        return;
+    }
+    void* node = getPage(pager, pageNum);
+    if (!tryLatchPage(pager, node, false)) {
+        unpinPage(pager, pageNum);
+        return;
+    }
+    uint32_t pageNums[READ_AHEAD_LEAVES];
+    uint32_t count = 0;
+    while (getNodeType(node) == NODE_INTERNAL) {
+        uint32_t index = internalNodeFindChild(node, key);
+        uint32_t childNum = *internalNodeChild(node, index);
+        if (childNum == cursor->pageNum) {
+            uint32_t first = index + 1;
+            if (pageNum == cursor->readAheadParent && cursor->readAheadEnd > first) {
+                first = cursor->readAheadEnd;
+            }
+            uint32_t end = index + 1 + READ_AHEAD_LEAVES;
+            if (end > *internalNodeNumKeys(node) + 1) {
+                end = *internalNodeNumKeys(node) + 1;
+            }
+            for (uint32_t i = first; i < end; i++) {
+                pageNums[count++] = *internalNodeChild(node, i);
+            }
+            cursor->readAheadParent = pageNum;
+            cursor->readAheadIndex = index;
+            cursor->readAheadEnd = end;
+            break;
+        }
+
+        void* child = getPage(pager, childNum);
+        bool latched = tryLatchPage(pager, child, false);
+        unlatchPage(pager, node);
+        unpinPage(pager, pageNum);
+        pageNum = childNum;
+        node = child;
+        if (!latched) {
+            unpinPage(pager, pageNum);
+            return;
+        }
+    }
+    unlatchPage(pager, node);
+    unpinPage(pager, pageNum);
+
+    if (count > 0) {
+        pagerReadAhead(pager, pageNums, count);
+    }
+}
+
+void snapshotUnpinPage(Table* table, uint32_t pageNum) {
+    pthread_rwlock_rdlock(&(table->lock));
+    unpinPage(table->pager, pageNum);
+    pthread_rwlock_unlock(&(table->lock));
+}
+
+bool tablePageVisible(Table* table, uint32_t pageNum) {
+    if (table->numSnapshots == 0) {
+        return false;
+    }
+    Pager* pager = table->pager;
+    uint64_t version = (pageNum < pager->versionCapacity) ? pager->pageVersions[pageNum] : 0;
+    return version <= table->snapshots[table->numSnapshots - 1];
+}
+
+uint32_t tableCopyPage(Table* table, uint32_t pageNum) {
+    Pager* pager = table->pager;
+    uint32_t copyNum = getUnusedPageNum(pager);
+    void* page = getPage(pager, pageNum);
+    void* copy = getPage(pager, copyNum);
+    memcpy(copy, page, PAGE_SIZE);
+    markPageDirty(pager, copyNum);
+    unpinPage(pager, copyNum);
+    unpinPage(pager, pageNum);
+    tableRetirePage(table, pageNum);
+    return copyNum;
+}
+
+void tableRetirePage(Table* table, uint32_t pageNum) {
+    if (table->numRetired == table->retiredCapacity) {
+        table->retiredCapacity = (table->retiredCapacity == 0) ? 64 : table->retiredCapacity * 2;
+        table->retired = realloc(table->retired, sizeof(RetiredPage) * table->retiredCapacity);
+    }
+    table->retired[table->numRetired].pageNum = pageNum;
+    table->retired[table->numRetired].version = table->pager->writeVersion;
+    table->numRetired++;
+}
+
+void tableReleasePage(Table* table, uint32_t pageNum) {
+    if (tablePageVisible(table, pageNum)) {
+        tableRetirePage(table, pageNum);
+    } else {
+        freePage(table->pager, pageNum);
+    }
+}
+
+uint32_t tableWritableRoot(Table* table) {
+    Pager* pager = table->pager;
+    uint32_t rootPageNum = table->rootPageNum;
+    if (!tablePageVisible(table, rootPageNum)) {
+        return rootPageNum;
+    }
+
+    // the new root goes in the header, and snapshots keep the old one
+    rootPageNum = tableCopyPage(table, rootPageNum);
+    table->rootPageNum = rootPageNum;
+    DbHeader* header = getPage(pager, DB_HEADER_PAGE);
+    header->rootPageNum = rootPageNum;
+    markPageDirty(pager, DB_HEADER_PAGE);
+    unpinPage(pager, DB_HEADER_PAGE);
+    return rootPageNum;
+}
+
+uint32_t tableWritableChild(Table* table, uint32_t* path, uint32_t* pathIndex, uint32_t depth, uint32_t index) {
+    Pager* pager = table->pager;
+    uint32_t parentPageNum = path[depth - 1];
+    void* parent = getPage(pager, parentPageNum);
+    uint32_t pageNum = *internalNodeChild(parent, index);
+    if (!tablePageVisible(table, pageNum)) {
+        unpinPage(pager, parentPageNum);
+        return pageNum;
+    }
+    uint32_t copyNum = tableCopyPage(table, pageNum);
+    *internalNodeChild(parent, index) = copyNum;
+    markPageDirty(pager, parentPageNum);
+    unpinPage(pager, parentPageNum);
+
+    void* copy = getPage(pager, copyNum);
+    bool isLeaf = (getNodeType(copy) == NODE_LEAF);
+    unpinPage(pager, copyNum);
+    if (!isLeaf) {
+        return copyNum;
+    }
+
+    // the leaf before it is the rightmost one under the nearest child left
+    // of the path. its next link is changed in place: snapshot cursors
+    // never follow next links, and latched ones wait for this writer
+    uint32_t level = depth - 1;
+    uint32_t childIndex = index;
+    while (childIndex == 0 && level > 0) {
+        level--;
+        childIndex = pathIndex[level];
+    }
+    if (childIndex == 0) {
+        return copyNum;
+    }
+    void* node = getPage(pager, path[level]);
+    uint32_t previous = *internalNodeChild(node, childIndex - 1);
+    unpinPage(pager, path[level]);
+    node = getPage(pager, previous);
+    while (getNodeType(node) == NODE_INTERNAL) {
+        uint32_t rightChild = *internalNodeRightChild(node);
+        unpinPage(pager, previous);
+        previous = rightChild;
+        node = getPage(pager, previous);
+    }
+    *leafNodeNextLeaf(node) = copyNum;
+    markPageDirty(pager, previous);
+    unpinPage(pager, previous);
+    return copyNum;
+}
+
+uint32_t tableMakePathWritable(Table* table, uint32_t key, uint32_t* path, uint32_t* pathIndex, uint32_t* depth) {
+    Pager* pager = table->pager;
+    *depth = 0;
+    uint32_t pageNum = tableWritableRoot(table);
+    void* node = getPage(pager, pageNum);
+    while (getNodeType(node) == NODE_INTERNAL) {
+        if (*depth >= BTREE_MAX_DEPTH) {
+            printf("Tree is deeper than %d levels.\n", BTREE_MAX_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        uint32_t index = internalNodeFindChild(node, key);
+        unpinPage(pager, pageNum);
+        path[*depth] = pageNum;
+        pathIndex[*depth] = index;
+        (*depth)++;
+        pageNum = tableWritableChild(table, path, pathIndex, *depth, index);
+        node = getPage(pager, pageNum);
+    }
+    unpinPage(pager, pageNum);
+    return pageNum;
+}
+
+uint32_t internalNodeFindChild(void* node, uint32_t key) {
+    uint32_t numKeys = *internalNodeNumKeys(node);
+
+    // binary search to find index of child to search
+    uint32_t l = 0;
+    uint32_t r = numKeys;
+
+    while (l < r) {
+        uint32_t mid = (l + r) / 2;
+        uint32_t keyToRight = *internalNodeKey(node, mid);
+        if (keyToRight >= key) {
+            r = mid;
+        } else {
+            l = mid + 1;
+        }
+    }
+    return l;
+}
+
+NodeType getNodeType(void* node) {
+    uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
+    return (NodeType)value;
+}
+
+void setNodeType(void* node, NodeType type) {
+    uint8_t value = type;
+    *((uint8_t*)(node + NODE_TYPE_OFFSET)) = value;
+}
+
+void printPrompt() {
+    printf("db > ");
+}
+
+void readInput(InputBuffer* inputBuffer) {
+    ssize_t bytesRead = getline(&(inputBuffer->buffer), &(inputBuffer->bufferLen), stdin);
+
+    if (bytesRead <= 0) {
+        printf("Error reading input\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    // remove trailing newline that came from calling getline()
+    inputBuffer->buffer[bytesRead - 1] = 0;
+    inputBuffer->inputLen = bytesRead - 1;
+}
+
+void closeInputBuffer(InputBuffer* inputBuffer) {
+    free(inputBuffer->buffer);
+    free(inputBuffer);
+}
+
+bool takeLine(InputBuffer* input, size_t* start, bool atEnd, InputBuffer* line) {
+    char* text = input->buffer + *start;
+    char* newline = memchr(text, '\n', input->inputLen - *start);
+    if (newline == NULL) {
+        if (!atEnd || *start == input->inputLen) {
+            return false;
+        }
+        // input ended without a newline after its last line. the buffer
+        // always keeps a spare byte for this terminator
+        newline = input->buffer + input->inputLen;
+    }
+    size_t next = newline - input->buffer + 1;
+    *start = next < input->inputLen ? next : input->inputLen;
+    if (newline > text && newline[-1] == '\r') {
+        newline--;
+    }
+    *newline = 0;
+
+    line->buffer = text;
+    line->bufferLen = newline - text + 1;
+    line->inputLen = newline - text;
+    return true;
+}
+
+MetaCommandResult execMetaCommand(InputBuffer* inputBuffer, Table* table, OutputBuffer* output) {
+    if (strcmp(inputBuffer->buffer, ".exit") == 0) {
+        dbClose(table);
+        exit(EXIT_SUCCESS);
+    } else if (strcmp(inputBuffer->buffer, ".btree") == 0) {
+        printf("Tree:\n");
+        printTree(table->pager, table->rootPageNum, 0);
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(inputBuffer->buffer, ".btree ", 7) == 0) {
+        char* column = inputBuffer->buffer + 7;
+        IndexColumn index = (strcmp(column, "email") == 0) ? INDEX_EMAIL : INDEX_USERNAME;
+        if ((strcmp(column, "username") != 0 && index == INDEX_USERNAME) || table->indexRoots[index] == 0) {
+            printf("No index on '%s'.\n", column);
+            return META_COMMAND_SUCCESS;
+        }
+        printf("Index:\n");
+        printTree(table->pager, table->indexRoots[index], 0);
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(inputBuffer->buffer, ".load ", 6) == 0) {
+        strtok(inputBuffer->buffer, " ");
+        char* filename = strtok(NULL, " ");
+        char* fillString = strtok(NULL, " ");
+        uint32_t fillPercent = LOAD_DEFAULT_FILL_PERCENT;
+        if (fillString != NULL) {
+            fillPercent = atoi(fillString);
+        }
+        if (filename == NULL || fillPercent < 10 || fillPercent > 100) {
+            printf("Usage: .load <file> [fill percent 10-100]\n");
+            return META_COMMAND_SUCCESS;
+        }
+        executeLoad(table, filename, fillPercent);
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(inputBuffer->buffer, ".mode", 5) == 0) {
+        executeMode(inputBuffer, output);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(inputBuffer->buffer, ".vacuum") == 0) {
+        executeVacuum(table);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(inputBuffer->buffer, ".stats") == 0 || strncmp(inputBuffer->buffer, ".stats ", 7) == 0) {
+        executeStats(inputBuffer, table, output);
+        return META_COMMAND_SUCCESS;
+    } else {
+        return META_COMMAND_UNRECOGNIZED;
+    }
+}
+
+void executeMode(InputBuffer* inputBuffer, OutputBuffer* output) {
+    char* mode = inputBuffer->buffer + 5;
+    while (*mode == ' ') {
+        mode++;
+    }
+    if (strcmp(mode, "text") == 0) {
+        output->format = ROW_FORMAT_TEXT;
+    } else if (strcmp(mode, "csv") == 0) {
+        output->format = ROW_FORMAT_CSV;
+    } else if (strcmp(mode, "binary") == 0) {
+        output->format = ROW_FORMAT_BINARY;
+    } else {
+        outputPrintf(output, "Usage: .mode text|csv|binary\n");
+    }
+}
+
+void executeStats(InputBuffer* inputBuffer, Table* table, OutputBuffer* output) {
+    char* argument = inputBuffer->buffer + 6;
+    while (*argument == ' ') {
+        argument++;
+    }
+    bool json = (strcmp(argument, "json") == 0);
+    if (strcmp(argument, "reset") == 0) {
+        tableResetStats(table);
+        return;
+    } else if (!json && *argument != 0) {
+        outputPrintf(output, "Usage: .stats [json|reset]\n");
+        return;
+    }
+
+    static const char* statementNames[STATEMENT_TYPE_COUNT] = {
+        "insert", "select", "create_index", "delete", "update"
+    };
+    // walking down for the depth touches pages, so count it in first
+    uint32_t depth = tableDepth(table);
+    PagerStats* pagerStats = &(table->pager->stats);
+    TreeStats* treeStats = &(table->stats);
+    uint64_t lookups = pagerStats->hits + pagerStats->misses;
+    double hitRate = (lookups > 0) ? 100.0 * pagerStats->hits / lookups : 0;
+    double nodesPerDescent = (treeStats->descents > 0) ? (double)treeStats->nodesVisited / treeStats->descents : 0;
+
+    if (json) {
+        outputPrintf(output, "{\"pager\": {\"hits\": %lu, \"misses\": %lu, \"hit_rate\": %.2f, "
+            "\"evictions\": %lu, \"dirty_evictions\": %lu, \"bytes_read\": %lu, \"bytes_written\": %lu, "
+            "\"pages_written\": %lu, \"wal_frames\": %lu, \"write_calls\": %lu, \"read_ahead_pages\": %lu, "
+            "\"frames\": %u}, ",
+            pagerStats->hits, pagerStats->misses, hitRate, pagerStats->evictions, pagerStats->dirtyEvictions,
+            pagerStats->bytesRead, pagerStats->bytesWritten, pagerStats->pagesWritten, pagerStats->walFrames,
+            pagerStats->writeCalls, pagerStats->readAheadPages, table->pager->numFrames);
+        outputPrintf(output, "\"tree\": {\"depth\": %u, \"pages\": %u, \"leaf_splits\": %lu, "
+            "\"internal_splits\": %lu, \"descents\": %lu, \"nodes_visited\": %lu, \"nodes_per_descent\": %.2f, "
+            "\"append_hits\": %lu}, \"latency\": {",
+            depth, table->pager->numPages, treeStats->leafSplits, treeStats->internalSplits,
+            treeStats->descents, treeStats->nodesVisited, nodesPerDescent, treeStats->appendHits);
+        for (uint32_t i = 0; i < STATEMENT_TYPE_COUNT; i++) {
+            LatencyHistogram* histogram = &(table->latencies[i]);
+            outputPrintf(output, "%s\"%s\": {\"count\": %lu, \"mean_ns\": %.0f, \"p50_ns\": %lu, "
+                "\"p90_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu}",
+                (i > 0) ? ", " : "", statementNames[i], histogram->count,
+                (histogram->count > 0) ? (double)histogram->totalNs / histogram->count : 0,
+                latencyPercentile(histogram, 50), latencyPercentile(histogram, 90),
+                latencyPercentile(histogram, 99), latencyPercentile(histogram, 99.9), histogram->maxNs);
+        }
+        outputPrintf(output, "}}\n");
+        return;
+    }
+
+    outputPrintf(output, "cache: %lu hits, %lu misses (%.2f%% hit rate), %lu evictions (%lu dirty), %u frames\n",
+        pagerStats->hits, pagerStats->misses, hitRate, pagerStats->evictions, pagerStats->dirtyEvictions,
+        table->pager->numFrames);
+    // bytes and calls cover the file and the log together
+    outputPrintf(output, "io: %lu bytes read, %lu bytes written, %lu pages and %lu log frames written "
+        "in %lu calls, %lu read ahead\n",
+        pagerStats->bytesRead, pagerStats->bytesWritten, pagerStats->pagesWritten, pagerStats->walFrames,
+        pagerStats->writeCalls, pagerStats->readAheadPages);
+    outputPrintf(output, "tree: depth %u, %u pages, %lu leaf splits, %lu internal splits\n",
+        depth, table->pager->numPages, treeStats->leafSplits, treeStats->internalSplits);
+    outputPrintf(output, "descents: %lu, %.2f nodes visited each, %lu appends without one\n",
+        treeStats->descents, nodesPerDescent, treeStats->appendHits);
+    outputPrintf(output, "%-13s %10s %10s %10s %10s %10s %10s %10s\n",
+        "latency (ns)", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (uint32_t i = 0; i < STATEMENT_TYPE_COUNT; i++) {
+        LatencyHistogram* histogram = &(table->latencies[i]);
+        if (histogram->count == 0) {
+            continue;
+        }
+        outputPrintf(output, "%-13s %10lu %10.0f %10lu %10lu %10lu %10lu %10lu\n",
+            statementNames[i], histogram->count, (double)histogram->totalNs / histogram->count,
+            latencyPercentile(histogram, 50), latencyPercentile(histogram, 90),
+            latencyPercentile(histogram, 99), latencyPercentile(histogram, 99.9), histogram->maxNs);
+    }
+}
+
+void tableResetStats(Table* table) {
+    memset(&(table->pager->stats), 0, sizeof(table->pager->stats));
+    memset(&(table->stats), 0, sizeof(table->stats));
+    memset(table->latencies, 0, sizeof(table->latencies));
+}
+
+uint32_t tableDepth(Table* table) {
+    uint32_t depth = 1;
+    uint32_t pageNum = table->rootPageNum;
+    void* node = getPage(table->pager, pageNum);
+    while (getNodeType(node) == NODE_INTERNAL) {
+        uint32_t childNum = *internalNodeChild(node, 0);
+        unpinPage(table->pager, pageNum);
+        pageNum = childNum;
+        node = getPage(table->pager, pageNum);
+        depth++;
+    }
+    unpinPage(table->pager, pageNum);
+    return depth;
+}
+
+uint32_t latencyBucket(uint64_t nanoseconds) {
+    if (nanoseconds < LATENCY_SUB_BUCKETS) {
+        return nanoseconds;
+    }
+    if (nanoseconds >> LATENCY_MAX_BITS) {
+        return LATENCY_BUCKETS - 1;
+    }
+    // the top LATENCY_SUB_BUCKET_BITS + 1 bits pick the bucket within the
+    // value's power of two
+    uint32_t exponent = 63 - __builtin_clzll(nanoseconds);
+    uint32_t shift = exponent - LATENCY_SUB_BUCKET_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS + (nanoseconds >> shift) - LATENCY_SUB_BUCKETS;
+}
+
+uint64_t latencyBucketHigh(uint32_t bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    uint32_t shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+void latencyRecord(LatencyHistogram* histogram, uint64_t nanoseconds) {
+    __atomic_fetch_add(&(histogram->counts[latencyBucket(nanoseconds)]), 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(histogram->count), 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(histogram->totalNs), nanoseconds, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&(histogram->maxNs), __ATOMIC_RELAXED);
+    while (nanoseconds > max
+        && !__atomic_compare_exchange_n(&(histogram->maxNs), &max, nanoseconds, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+uint64_t latencyPercentile(LatencyHistogram* histogram, double percentile) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percentile / 100 * histogram->count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            // a bucket's top can be past the largest value actually seen
+            uint64_t high = latencyBucketHigh(i);
+            return (high < histogram->maxNs) ? high : histogram->maxNs;
+        }
+    }
+    return histogram->maxNs;
+}
+
+PrepareResult prepareStatement(InputBuffer* inputBuffer, Statement* statement) {
+    if (strncmp(inputBuffer->buffer, "insert", 6) == 0) {
+        return prepareInsert(inputBuffer, statement);
+    } else if (strncmp(inputBuffer->buffer, "select", 6) == 0) {
+        return prepareSelect(inputBuffer, statement);
+    } else if (strncmp(inputBuffer->buffer, "create", 6) == 0) {
+        return prepareCreateIndex(inputBuffer, statement);
+    } else if (strncmp(inputBuffer->buffer, "delete", 6) == 0) {
+        return prepareDelete(inputBuffer, statement);
+    } else if (strncmp(inputBuffer->buffer, "update", 6) == 0) {
+        // same shape as an insert: the row's id, then its new values
+        PrepareResult result = prepareInsert(inputBuffer, statement);
+        statement->type = STATEMENT_UPDATE;
+        return result;
+    } else {
+        return PREPARE_UNRECOGNIZED;
+    }
+}
+
+PrepareResult prepareInsert(InputBuffer* inputBuffer, Statement* statement) {
+    statement->type = STATEMENT_INSERT;
+
+    char* keyword = strtok(inputBuffer->buffer, " ");
+    char* idString = strtok(NULL, " ");
+    char* username = strtok(NULL, " ");
+    char* email = strtok(NULL, " ");
+
+    if (idString == NULL || username == NULL || email == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    int id = atoi(idString);
+    if (id < 0) {
+        return PREPARE_NEGATIVE_ID;
+    }
+    if (strlen(username) > COLUMN_USERNAME_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    if (strlen(email) > COLUMN_EMAIL_SIZE) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+
+    statement->rowToInsert.id = id;
+    strcpy(statement->rowToInsert.username, username);
+    strcpy(statement->rowToInsert.email, email);
+
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult prepareSelect(InputBuffer* inputBuffer, Statement* statement) {
+    statement->type = STATEMENT_SELECT;
+    statement->numAggregates = 0;
+
+    // anything between select and the where clause is a list of aggregates
+    char* item = inputBuffer->buffer + 6;
+    char* where = strstr(inputBuffer->buffer, " where ");
+    char* end = (where != NULL) ? where : item + strlen(item);
+    bool expectItem = false;
+    while (true) {
+        item += strspn(item, " ");
+        if (item >= end) {
+            if (expectItem) {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            break;
+        }
+        AggregateKind kind;
+        if (strncmp(item, "count(*)", 8) == 0) {
+            kind = AGGREGATE_COUNT;
+        } else if (strncmp(item, "min(id)", 7) == 0) {
+            kind = AGGREGATE_MIN_ID;
+        } else if (strncmp(item, "max(id)", 7) == 0) {
+            kind = AGGREGATE_MAX_ID;
+        } else {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if (statement->numAggregates == MAX_AGGREGATES) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->aggregates[statement->numAggregates++] = kind;
+        item += (kind == AGGREGATE_COUNT) ? 8 : 7;
+        item += strspn(item, " ");
+        expectItem = (item < end && *item == ',');
+        if (expectItem) {
+            item++;
+        } else if (item < end) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+    }
+    return prepareWhere(inputBuffer->buffer, statement);
+}
+
+PrepareResult prepareDelete(InputBuffer* inputBuffer, Statement* statement) {
+    statement->type = STATEMENT_DELETE;
+    // deleting everything takes asking for it by range
+    if (strstr(inputBuffer->buffer, " where ") == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    PrepareResult result = prepareWhere(inputBuffer->buffer, statement);
+    if (result == PREPARE_SUCCESS && statement->byColumn) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return result;
+}
+
+PrepareResult prepareWhere(char* text, Statement* statement) {
+    statement->minId = 0;
+    statement->maxId = UINT32_MAX;
+    statement->byColumn = false;
+    statement->prefix = false;
+
+    char* where = strstr(text, " where ");
+    if (where == NULL) {
+        return PREPARE_SUCCESS;
+    }
+
+    long long low, high;
+    char op[3];
+    char column[16];
+    int consumed = 0;
+    if (sscanf(where, " where %15[a-z] = %n", column, &consumed) == 1 && consumed > 0 && strcmp(column, "id") != 0) {
+        uint32_t maxLength;
+        if (strcmp(column, "username") == 0) {
+            statement->column = INDEX_USERNAME;
+            maxLength = COLUMN_USERNAME_SIZE;
+        } else if (strcmp(column, "email") == 0) {
+            statement->column = INDEX_EMAIL;
+            maxLength = COLUMN_EMAIL_SIZE;
+        } else {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        char* value = where + consumed;
+        size_t length = strcspn(value, " ");
+        if (length == 0 || value[length + strspn(value + length, " ")] != 0) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if (length > maxLength) {
+            return PREPARE_STRING_TOO_LONG;
+        }
+        memcpy(statement->value, value, length);
+        statement->value[length] = 0;
+        statement->byColumn = true;
+        return PREPARE_SUCCESS;
+    }
+
+    consumed = 0;
+    if (sscanf(where, " where %15[a-z] like %n", column, &consumed) == 1 && consumed > 0) {
+        uint32_t maxLength;
+        if (strcmp(column, "username") == 0) {
+            statement->column = INDEX_USERNAME;
+            maxLength = COLUMN_USERNAME_SIZE;
+        } else if (strcmp(column, "email") == 0) {
+            statement->column = INDEX_EMAIL;
+            maxLength = COLUMN_EMAIL_SIZE;
+        } else {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        // only prefixes: the pattern is the value with one % on the end
+        char* value = where + consumed;
+        size_t length = strcspn(value, " ");
+        if (length == 0 || value[length - 1] != '%' || memchr(value, '%', length - 1) != NULL
+            || value[length + strspn(value + length, " ")] != 0) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        length--;
+        if (length > maxLength) {
+            return PREPARE_STRING_TOO_LONG;
+        }
+        memcpy(statement->value, value, length);
+        statement->value[length] = 0;
+        statement->byColumn = true;
+        statement->prefix = true;
+        return PREPARE_SUCCESS;
+    }
+
+    consumed = 0;
+    if (sscanf(where, " where id between %lld and %lld %n", &low, &high, &consumed) == 2 && where[consumed] == 0) {
+        if (low < 0 || high < 0) {
+            return PREPARE_NEGATIVE_ID;
+        }
+        if (low > UINT32_MAX || high > UINT32_MAX) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->minId = low;
+        statement->maxId = high;
+        return PREPARE_SUCCESS;
+    }
+
+    consumed = 0;
+    if (sscanf(where, " where id %2[=<>] %lld %n", op, &low, &consumed) != 2 || where[consumed] != 0) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (low < 0) {
+        return PREPARE_NEGATIVE_ID;
+    }
+    if (low > UINT32_MAX) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    // bounds are widened to 64 bits so "< 0" and "> max" come out empty
+    long long minId = 0;
+    long long maxId = UINT32_MAX;
+    if (strcmp(op, "=") == 0) {
+        minId = low;
+        maxId = low;
+    } else if (strcmp(op, "<") == 0) {
+        maxId = low - 1;
+    } else if (strcmp(op, "<=") == 0) {
+        maxId = low;
+    } else if (strcmp(op, ">") == 0) {
+        minId = low + 1;
+    } else if (strcmp(op, ">=") == 0) {
+        minId = low;
+    } else {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (minId > maxId) {
+        statement->minId = 1;
+        statement->maxId = 0;
+    } else {
+        statement->minId = minId;
+        statement->maxId = maxId;
+    }
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult prepareCreateIndex(InputBuffer* inputBuffer, Statement* statement) {
+    statement->type = STATEMENT_CREATE_INDEX;
+
+    char column[16];
+    int consumed = 0;
+    if (sscanf(inputBuffer->buffer, "create index on %15s %n", column, &consumed) != 1
+        || inputBuffer->buffer[consumed] != 0) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (strcmp(column, "username") == 0) {
+        statement->column = INDEX_USERNAME;
+    } else if (strcmp(column, "email") == 0) {
+        statement->column = INDEX_EMAIL;
+    } else {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+}
+
+void runStatement(InputBuffer* inputBuffer, Table* table, OutputBuffer* output) {
+    Statement statement;
+    switch (prepareStatement(inputBuffer, &statement)) {
+        case (PREPARE_SUCCESS):
+            break;
+        case (PREPARE_NEGATIVE_ID):
+            outputPrintf(output, "ID must be positive.\n");
+            return;
+        case (PREPARE_STRING_TOO_LONG):
+            outputPrintf(output, "String is too long.\n");
+            return;
+        case (PREPARE_SYNTAX_ERROR):
+            outputPrintf(output, "Syntax error. Couldn't parse statement\n");
+            return;
+        case (PREPARE_UNRECOGNIZED):
+            outputPrintf(output, "Unrecognized keyword at start of '%s'\n", inputBuffer->buffer);
+            return;
+    }
+
+    switch (executeStatement(&statement, table, output)) {
+        case (EXECUTE_SUCCESS):
+            // a csv or binary select is exactly its rows, so the output can
+            // be loaded back as it is
+            if (statement.type != STATEMENT_SELECT || output->format == ROW_FORMAT_TEXT) {
+                outputPrintf(output, "Executed.\n");
+            }
+            break;
+        case (EXECUTE_DUPLICATE_KEY):
+            outputPrintf(output, "Error: Duplicate key.\n");
+            break;
+        case (EXECUTE_TABLE_FULL):
+            outputPrintf(output, "Error: Table full.\n");
+            break;
+        case (EXECUTE_INDEX_EXISTS):
+            outputPrintf(output, "Error: Index already exists.\n");
+            break;
+        case (EXECUTE_KEY_NOT_FOUND):
+            outputPrintf(output, "Error: Key not found.\n");
+            break;
+    }
+}
+
+ExecuteResult executeStatement(Statement* statement, Table* table, OutputBuffer* output) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ExecuteResult result = EXECUTE_SUCCESS;
+    switch (statement->type) {
+        case (STATEMENT_INSERT):
+            result = executeInsert(statement, table);
+            break;
+        case (STATEMENT_SELECT):
+            result = executeSelect(statement, table, output);
+            break;
+        case (STATEMENT_CREATE_INDEX):
+            result = executeCreateIndex(statement, table);
+            break;
+        case (STATEMENT_DELETE):
+            result = executeDelete(statement, table);
+            break;
+        case (STATEMENT_UPDATE):
+            result = executeUpdate(statement, table);
+            break;
+    }
+    arenaReset(statementArena());
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t nanoseconds = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+    latencyRecord(&(table->latencies[statement->type]), nanoseconds);
+    return result;
+}
+
+ExecuteResult executeInsert(Statement* statement, Table* table) {
+    // mapped pages can't be latched, so writers there run alone. so do
+    // writers while a snapshot is open, as any page they touch may need
+    // copying first
+    bool mapped = (table->pager->map != NULL);
+    if (mapped) {
+        pthread_rwlock_wrlock(&(table->lock));
+    } else {
+        pthread_rwlock_rdlock(&(table->lock));
+        if (table->numSnapshots > 0) {
+            pthread_rwlock_unlock(&(table->lock));
+            pthread_rwlock_wrlock(&(table->lock));
+        }
+    }
+    ExecuteResult result = tableInsert(table, &(statement->rowToInsert));
+    pthread_rwlock_unlock(&(table->lock));
+    return result;
+}
+
+ExecuteResult tableInsert(Table* table, Row* rowToInsert) {
+    uint32_t keyToInsert = rowToInsert->id;
+    uint32_t valueSize = serializedRowSize(rowToInsert);
+
+    // ids from a sequence go on the end of the rightmost leaf, which we
+    // can find without descending. otherwise most inserts fit in their
+    // leaf and touch nothing else; only when this one would split do we go
+    // again holding what the split needs
+    Cursor cursor;
+    bool copying = (table->numSnapshots > 0);
+    if (copying) {
+        // an open snapshot may see any page here, so the path is copied
+        // first, and the split case is taken as read: this writer is alone
+        uint32_t path[BTREE_MAX_DEPTH];
+        uint32_t pathIndex[BTREE_MAX_DEPTH];
+        uint32_t depth;
+        tableMakePathWritable(table, keyToInsert, path, pathIndex, &depth);
+        tableDescend(table, keyToInsert, LATCH_WRITE_PATH, valueSize, &cursor);
+    } else if (!tableTryAppend(table, keyToInsert, valueSize, &cursor)) {
+        tableDescend(table, keyToInsert, LATCH_WRITE_LEAF, valueSize, &cursor);
+        if (!nodeIsSafe(cursor.leaf, valueSize)) {
+            closeCursor(&cursor);
+            tableDescend(table, keyToInsert, LATCH_WRITE_PATH, valueSize, &cursor);
+        }
+    }
+
+    // check for a duplicate in the leaf the cursor landed on
+    ExecuteResult result = EXECUTE_SUCCESS;
+    uint32_t numCells = (*leafNodeNumCells(cursor.leaf));
+    if (cursor.cellNum < numCells && *leafNodeKey(cursor.leaf, cursor.cellNum) == keyToInsert) {
+        result = EXECUTE_DUPLICATE_KEY;
+    } else {
+        leafNodeInsert(&cursor, rowToInsert->id, rowToInsert);
+        // after a split this leaf has a next one, and the next insert past
+        // it descends once to find the new rightmost leaf
+        if (!copying && *leafNodeNextLeaf(cursor.leaf) == 0) {
+            tableSetAppendHint(table, cursor.pageNum, getNodeMaxKey(cursor.leaf));
+        }
+    }
+    closeCursor(&cursor);
+
+    // the row is in; now each index. no leaf latch is held here, and index
+    // lookups take page latches only after their index lock, so this order
+    // can't deadlock
+    for (uint32_t i = 0; i < INDEX_COUNT && result == EXECUTE_SUCCESS; i++) {
+        if (table->indexRoots[i] == 0) {
+            continue;
+        }
+        const uint8_t* bytes;
+        uint32_t length;
+        rowColumnOf(rowToInsert, i, &bytes, &length);
+        pthread_rwlock_wrlock(&(table->indexLocks[i]));
+        indexInsert(table, i, bytes, length, keyToInsert);
+        pthread_rwlock_unlock(&(table->indexLocks[i]));
+    }
+    return result;
+}
+
+ExecuteResult executeDelete(Statement* statement, Table* table) {
+    if (statement->minId > statement->maxId) {
+        return EXECUTE_SUCCESS;
+    }
+
+    // merging nodes rewrites parents and frees pages, which the latch
+    // protocol doesn't cover, so deletes have the tree to themselves
+    pthread_rwlock_wrlock(&(table->lock));
+    uint32_t key = statement->minId;
+    while (true) {
+        Cursor cursor;
+        tableSeek(table, key, &cursor);
+        bool found = !(cursor.endOfTable);
+        uint32_t id = found ? *leafNodeKey(cursor.leaf, cursor.cellNum) : 0;
+        closeCursor(&cursor);
+        if (!found || id > statement->maxId) {
+            break;
+        }
+        tableDelete(table, id);
+        if (id == statement->maxId) {
+            break;
+        }
+        key = id + 1;
+    }
+    pthread_rwlock_unlock(&(table->lock));
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult executeUpdate(Statement* statement, Table* table) {
+    Row* row = &(statement->rowToInsert);
+    ExecuteResult result = EXECUTE_KEY_NOT_FOUND;
+    pthread_rwlock_wrlock(&(table->lock));
+    if (tableDelete(table, row->id)) {
+        result = tableInsert(table, row);
+    }
+    pthread_rwlock_unlock(&(table->lock));
+    return result;
+}
+
+bool tableDelete(Table* table, uint32_t key) {
+    Pager* pager = table->pager;
+    uint32_t path[BTREE_MAX_DEPTH];
+    uint32_t pathIndex[BTREE_MAX_DEPTH];
+    uint32_t depth = 0;
+
+    // nothing else is in the tree, so no latches on the way down
+    uint32_t pageNum = table->rootPageNum;
+    void* node = getPage(pager, pageNum);
+    while (getNodeType(node) == NODE_INTERNAL) {
+        if (depth >= BTREE_MAX_DEPTH) {
+            printf("Tree is deeper than %d levels.\n", BTREE_MAX_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        uint32_t index = internalNodeFindChild(node, key);
+        path[depth] = pageNum;
+        pathIndex[depth] = index;
+        depth++;
+        uint32_t childPageNum = *internalNodeChild(node, index);
+        unpinPage(pager, pageNum);
+        pageNum = childPageNum;
+        node = getPage(pager, pageNum);
+    }
+
+    uint32_t cellNum = leafNodeLowerBound(node, key);
+    if (cellNum >= *leafNodeNumCells(node) || *leafNodeKey(node, cellNum) != key) {
+        unpinPage(pager, pageNum);
+        return false;
+    }
+    if (table->numSnapshots > 0) {
+        // everything the delete and rebalancing change is on the path or
+        // beside it; the path is copied now, siblings as they are reached
+        unpinPage(pager, pageNum);
+        pageNum = tableMakePathWritable(table, key, path, pathIndex, &depth);
+        node = getPage(pager, pageNum);
+    }
+
+    void* value = leafNodeValue(node, cellNum);
+    for (uint32_t i = 0; i < INDEX_COUNT; i++) {
+        if (table->indexRoots[i] != 0) {
+            const uint8_t* bytes;
+            uint32_t length;
+            rowColumn(value, i, &bytes, &length);
+            indexDelete(table, i, bytes, length, key);
+        }
+    }
+    leafNodeRemoveCell(node, cellNum);
+    markPageDirty(pager, pageNum);
+    unpinPage(pager, pageNum);
+
+    // rebalancing may free the hinted leaf for a later split to reuse
+    tableSetAppendHint(table, 0, 0);
+    tableRebalance(table, path, pathIndex, depth, pageNum);
+    return true;
+}
+
+void tableRebalance(Table* table, uint32_t* path, uint32_t* pathIndex, uint32_t depth, uint32_t pageNum) {
+    Pager* pager = table->pager;
+    void* node = getPage(pager, pageNum);
+
+    if (depth == 0) {
+        // a root down to one child hands its place to that child. the root
+        // page never moves, so the child is copied up and its page freed
+        while (getNodeType(node) == NODE_INTERNAL && *internalNodeNumKeys(node) == 0) {
+            uint32_t childPageNum = *internalNodeRightChild(node);
+            void* child = getPage(pager, childPageNum);
+            memcpy(node, child, PAGE_SIZE);
+            setNodeRoot(node, true);
+            unpinPage(pager, childPageNum);
+            tableReleasePage(table, childPageNum);
+            markPageDirty(pager, pageNum);
+        }
+        unpinPage(pager, pageNum);
+        return;
+    }
+
+    bool isLeaf = (getNodeType(node) == NODE_LEAF);
+    bool underflows = nodeUnderflows(node);
+    unpinPage(pager, pageNum);
+    if (!underflows) {
+        return;
+    }
+
+    // pair the node with its left sibling, or its right one if it is first
+    uint32_t parentPageNum = path[depth - 1];
+    uint32_t index = pathIndex[depth - 1];
+    void* parent = getPage(pager, parentPageNum);
+    bool merged = false;
+    if (*internalNodeNumKeys(parent) > 0) {
+        uint32_t leftIndex = (index > 0) ? index - 1 : 0;
+        if (table->numSnapshots > 0) {
+            tableWritableChild(table, path, pathIndex, depth, leftIndex);
+            tableWritableChild(table, path, pathIndex, depth, leftIndex + 1);
+        }
+        if (isLeaf) {
+            merged = leafNodeRebalance(table, parent, leftIndex);
+        } else {
+            merged = internalNodeRebalance(table, parent, leftIndex);
+        }
+        markPageDirty(pager, parentPageNum);
+    }
+    unpinPage(pager, parentPageNum);
+
+    // a merge took a child from the parent, which may now be short itself
+    if (merged) {
+        tableRebalance(table, path, pathIndex, depth - 1, parentPageNum);
+    }
+}
+
+bool nodeUnderflows(void* node) {
+    if (getNodeType(node) == NODE_LEAF) {
+        return LEAF_NODE_SPACE_FOR_CELLS - leafNodeFreeSpace(node) < LEAF_NODE_MIN_USED;
+    }
+    return *internalNodeNumKeys(node) < INTERNAL_NODE_MIN_KEYS;
+}
+
+bool leafNodeRebalance(Table* table, void* parent, uint32_t leftIndex) {
+    Pager* pager = table->pager;
+    uint32_t leftPageNum = *internalNodeChild(parent, leftIndex);
+    uint32_t rightPageNum = *internalNodeChild(parent, leftIndex + 1);
+    void* left = getPage(pager, leftPageNum);
+    void* right = getPage(pager, rightPageNum);
+    uint32_t leftUsed = LEAF_NODE_SPACE_FOR_CELLS - leafNodeFreeSpace(left);
+    uint32_t rightUsed = LEAF_NODE_SPACE_FOR_CELLS - leafNodeFreeSpace(right);
+    bool merge = leftUsed + rightUsed <= LEAF_NODE_SPACE_FOR_CELLS;
+
+    // a merge moves every cell left. otherwise cells move from the fuller
+    // side while each move brings the two closer to even
+    while (*leafNodeNumCells(right) > 0) {
+        uint32_t cellSize = leafNodeCellSize(right, 0);
+        if (!merge && (rightUsed <= leftUsed || cellSize >= rightUsed - leftUsed)) {
+            break;
+        }
+        uint32_t valueSize = cellSize - LEAF_NODE_CELL_OVERHEAD;
+        void* destination = leafNodeAllocateCell(left, *leafNodeNumCells(left), *leafNodeKey(right, 0), valueSize);
+        memcpy(destination, leafNodeValue(right, 0), valueSize);
+        leafNodeRemoveCell(right, 0);
+        leftUsed += cellSize;
+        rightUsed -= cellSize;
+    }
+    while (!merge && leftUsed > rightUsed) {
+        uint32_t last = *leafNodeNumCells(left) - 1;
+        uint32_t cellSize = leafNodeCellSize(left, last);
+        if (cellSize >= leftUsed - rightUsed) {
+            break;
+        }
+        uint32_t valueSize = cellSize - LEAF_NODE_CELL_OVERHEAD;
+        void* destination = leafNodeAllocateCell(right, 0, *leafNodeKey(left, last), valueSize);
+        memcpy(destination, leafNodeValue(left, last), valueSize);
+        leafNodeRemoveCell(left, last);
+        leftUsed -= cellSize;
+        rightUsed += cellSize;
+    }
+
+    markPageDirty(pager, leftPageNum);
+    if (merge) {
+        *leafNodeNextLeaf(left) = *leafNodeNextLeaf(right);
+        internalNodeRemove(parent, leftIndex);
+        unpinPage(pager, leftPageNum);
+        unpinPage(pager, rightPageNum);
+        tableReleasePage(table, rightPageNum);
+        return true;
+    }
+
+    // the boundary between them moved, so the left child's bound did too
+    *internalNodeKey(parent, leftIndex) = getNodeMaxKey(left);
+    markPageDirty(pager, rightPageNum);
+    unpinPage(pager, leftPageNum);
+    unpinPage(pager, rightPageNum);
+    return false;
+}
+
+bool internalNodeRebalance(Table* table, void* parent, uint32_t leftIndex) {
+    Pager* pager = table->pager;
+    uint32_t leftPageNum = *internalNodeChild(parent, leftIndex);
+    uint32_t rightPageNum = *internalNodeChild(parent, leftIndex + 1);
+    void* left = getPage(pager, leftPageNum);
+    void* right = getPage(pager, rightPageNum);
+    uint32_t leftKeys = *internalNodeNumKeys(left);
+    uint32_t rightKeys = *internalNodeNumKeys(right);
+
+    // lay out both nodes' children with their bounds. the left node's right
+    // child is bounded by the parent's separator between the two
+    uint32_t children[2 * INTERNAL_NODE_MAX_KEYS + 2];
+    uint32_t keys[2 * INTERNAL_NODE_MAX_KEYS + 2];
+    uint32_t n = 0;
+    for (uint32_t i = 0; i <= leftKeys; i++) {
+        children[n] = *internalNodeChild(left, i);
+        keys[n] = (i < leftKeys) ? *internalNodeKey(left, i) : *internalNodeKey(parent, leftIndex);
+        n++;
+    }
+    for (uint32_t i = 0; i <= rightKeys; i++) {
+        children[n] = *internalNodeChild(right, i);
+        keys[n] = (i < rightKeys) ? *internalNodeKey(right, i) : 0;
+        n++;
+    }
+
+    markPageDirty(pager, leftPageNum);
+    if (n - 1 <= INTERNAL_NODE_MAX_KEYS) {
+        internalNodeWrite(left, children, keys, n);
+        internalNodeRemove(parent, leftIndex);
+        unpinPage(pager, leftPageNum);
+        unpinPage(pager, rightPageNum);
+        tableReleasePage(table, rightPageNum);
+        return true;
+    }
+
+    // split them evenly again, as internalNodeInsert would
+    uint32_t leftCount = n / 2;
+    internalNodeWrite(left, children, keys, leftCount);
+    internalNodeWrite(right, children + leftCount, keys + leftCount, n - leftCount);
+    *internalNodeKey(parent, leftIndex) = keys[leftCount - 1];
+    markPageDirty(pager, rightPageNum);
+    unpinPage(pager, leftPageNum);
+    unpinPage(pager, rightPageNum);
+    return false;
+}
+
+void internalNodeRemove(void* node, uint32_t leftIndex) {
+    uint32_t numKeys = *internalNodeNumKeys(node);
+    uint32_t children[INTERNAL_NODE_MAX_KEYS + 1];
+    uint32_t keys[INTERNAL_NODE_MAX_KEYS + 1];
+
+    // the merged child takes over the bound of the one it absorbed
+    uint32_t n = 0;
+    for (uint32_t i = 0; i <= numKeys; i++) {
+        if (i == leftIndex + 1) {
+            continue;
+        }
+        uint32_t bound = (i == leftIndex) ? i + 1 : i;
+        children[n] = *internalNodeChild(node, i);
+        keys[n] = (bound < numKeys) ? *internalNodeKey(node, bound) : 0;
+        n++;
+    }
+    internalNodeWrite(node, children, keys, n);
+}
+
+void internalNodeWrite(void* node, uint32_t* children, uint32_t* keys, uint32_t numChildren) {
+    *internalNodeNumKeys(node) = numChildren - 1;
+    for (uint32_t i = 0; i < numChildren - 1; i++) {
+        *internalNodeCell(node, i) = children[i];
+        *internalNodeKey(node, i) = keys[i];
+    }
+    *internalNodeRightChild(node) = children[numChildren - 1];
+}
+
+ExecuteResult executeSelect(Statement* statement, Table* table, OutputBuffer* output) {
+    if (statement->numAggregates > 0) {
+        return executeAggregate(statement, table, output);
+    }
+    if (statement->byColumn) {
+        return executeSelectByColumn(statement, table, output);
+    }
+    beginRows(output);
+    if (statement->minId > statement->maxId) {
+        endRows(output);
+        return EXECUTE_SUCCESS;
+    }
+
+    // seek to the lower bound once, then walk leaves until the upper bound.
+    // rows are formatted straight from the leaf, never copied out whole. a
+    // long range reads a snapshot instead, taking the table lock only to
+    // move between leaves, so inserts carry on beside it
+    Snapshot snapshot;
+    Cursor cursor;
+    bool useSnapshot = (statement->maxId - statement->minId >= SNAPSHOT_MIN_RANGE);
+    if (useSnapshot) {
+        tableBeginSnapshot(table, &snapshot);
+        snapshotSeek(table, &snapshot, statement->minId, &cursor);
+    } else {
+        pthread_rwlock_rdlock(&(table->lock));
+        tableSeek(table, statement->minId, &cursor);
+    }
+
+    ScanFilter filter;
+    scanFilterInit(&filter, statement);
+    uint16_t selection[LEAF_NODE_MAX_CELLS];
+    while (!(cursor.endOfTable)) {
+        void* leaf = cursor.leaf;
+        uint32_t count = leafNodeSelect(leaf, cursor.cellNum, &filter, selection);
+        for (uint32_t i = 0; i < count; i++) {
+            printRow(output, leafNodeValue(leaf, selection[i]));
+        }
+        if (output->fileDescriptor != -1 && output->length >= OUTPUT_FLUSH_SIZE) {
+            outputFlush(output);
+        }
+        uint32_t numCells = *leafNodeNumCells(leaf);
+        if (numCells > 0 && *leafNodeKey(leaf, numCells - 1) >= statement->maxId) {
+            break;
+        }
+        cursorNextLeaf(&cursor);
+    }
+
+    closeCursor(&cursor);
+    if (useSnapshot) {
+        tableEndSnapshot(table, &snapshot);
+    } else {
+        pthread_rwlock_unlock(&(table->lock));
+    }
+    endRows(output);
+
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult executeSelectByColumn(Statement* statement, Table* table, OutputBuffer* output) {
+    Pager* pager = table->pager;
+    IndexColumn column = statement->column;
+    const uint8_t* wanted = (const uint8_t*)statement->value;
+    uint32_t wantedLength = strlen(statement->value);
+    beginRows(output);
+    pthread_rwlock_rdlock(&(table->lock));
+
+    if (table->indexRoots[column] == 0 || statement->prefix) {
+        // no index: look at every row, a leaf at a time
+        ScanFilter filter;
+        scanFilterInit(&filter, statement);
+        uint16_t selection[LEAF_NODE_MAX_CELLS];
+        Cursor cursor;
+        tableStart(table, &cursor);
+        while (!(cursor.endOfTable)) {
+            cursorReadAhead(&cursor);
+            void* leaf = cursor.leaf;
+            uint32_t count = leafNodeSelect(leaf, cursor.cellNum, &filter, selection);
+            for (uint32_t i = 0; i < count; i++) {
+                printRow(output, leafNodeValue(leaf, selection[i]));
+            }
+            if (output->fileDescriptor != -1 && output->length >= OUTPUT_FLUSH_SIZE) {
+                outputFlush(output);
+            }
+            cursorNextLeaf(&cursor);
+        }
+        closeCursor(&cursor);
+        pthread_rwlock_unlock(&(table->lock));
+        endRows(output);
+        return EXECUTE_SUCCESS;
+    }
+
+    // matching entries are adjacent, in id order, starting at (value, 0)
+    pthread_rwlock_rdlock(&(table->indexLocks[column]));
+    uint32_t path[BTREE_MAX_DEPTH];
+    uint32_t pathIndex[BTREE_MAX_DEPTH];
+    uint32_t depth;
+    uint32_t pageNum;
+    void* leaf = indexDescend(table, column, wanted, wantedLength, 0, &pageNum, path, pathIndex, &depth);
+    uint32_t cellNum = indexLeafLowerBound(leaf, wanted, wantedLength, 0);
+
+    while (true) {
+        if (cellNum >= *indexNodeNumCells(leaf)) {
+            uint32_t nextPageNum = *indexNodeLink(leaf);
+            unpinPage(pager, pageNum);
+            if (nextPageNum == 0) {
+                break;
+            }
+            pageNum = nextPageNum;
+            leaf = getPage(pager, pageNum);
+            cellNum = 0;
+            continue;
+        }
+
+        uint8_t key[COLUMN_EMAIL_SIZE];
+        IndexEntry entry;
+        indexLeafEntry(leaf, cellNum, key, &entry);
+        if (entry.length != wantedLength || memcmp(entry.key, wanted, wantedLength) != 0) {
+            unpinPage(pager, pageNum);
+            break;
+        }
+
+        Cursor cursor;
+        tableFind(table, entry.id, &cursor);
+        if (cursor.cellNum < *leafNodeNumCells(cursor.leaf) && *leafNodeKey(cursor.leaf, cursor.cellNum) == entry.id) {
+            printRow(output, cursorValue(&cursor));
+        }
+        closeCursor(&cursor);
+        if (output->fileDescriptor != -1 && output->length >= OUTPUT_FLUSH_SIZE) {
+            outputFlush(output);
+        }
+        cellNum++;
+    }
+
+    pthread_rwlock_unlock(&(table->indexLocks[column]));
+    pthread_rwlock_unlock(&(table->lock));
+    endRows(output);
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult executeAggregate(Statement* statement, Table* table, OutputBuffer* output) {
+    AggregateResult total;
+    total.count = 0;
+    total.minId = UINT32_MAX;
+    total.maxId = 0;
+    if (statement->minId <= statement->maxId) {
+        // the workers read a snapshot, taking the table lock only to move
+        // between leaves, so inserts carry on meanwhile
+        Snapshot snapshot;
+        tableBeginSnapshot(table, &snapshot);
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        uint32_t numThreads = (cores < 1) ? 1 : (cores > AGGREGATE_MAX_THREADS) ? AGGREGATE_MAX_THREADS : cores;
+        AggregateScan scan;
+        scan.table = table;
+        scanFilterInit(&(scan.filter), statement);
+        scan.version = snapshot.version;
+        scan.numRanges = aggregateRanges(table, &snapshot, statement->minId, statement->maxId,
+                                         numThreads * AGGREGATE_RANGES_PER_THREAD, &(scan.ranges));
+        scan.nextRange = 0;
+        if (numThreads > scan.numRanges) {
+            numThreads = scan.numRanges;
+        }
+
+        // the calling thread is a worker too. if a thread can't be started
+        // the others take its share
+        AggregateWorker workers[AGGREGATE_MAX_THREADS];
+        pthread_t threads[AGGREGATE_MAX_THREADS];
+        uint32_t started = 1;
+        while (started < numThreads) {
+            workers[started].scan = &scan;
+            if (pthread_create(&(threads[started]), NULL, aggregateWorkerMain, &(workers[started])) != 0) {
+                break;
+            }
+            started++;
+        }
+        workers[0].scan = &scan;
+        aggregateWorkerMain(&(workers[0]));
+        for (uint32_t i = 1; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        for (uint32_t i = 0; i < started; i++) {
+            AggregateResult* result = &(workers[i].result);
+            total.count += result->count;
+            if (result->count > 0 && result->minId < total.minId) {
+                total.minId = result->minId;
+            }
+            if (result->count > 0 && result->maxId > total.maxId) {
+                total.maxId = result->maxId;
+            }
+        }
+        free(scan.ranges);
+        tableEndSnapshot(table, &snapshot);
+    }
+
+    // an aggregate isn't a row, so binary output gets the csv form. min and
+    // max of nothing are NULL, or empty in csv
+    static const char* names[] = {"count(*)", "min(id)", "max(id)"};
+    bool text = (output->format == ROW_FORMAT_TEXT);
+    if (!text) {
+        for (uint32_t i = 0; i < statement->numAggregates; i++) {
+            outputPrintf(output, (i == 0) ? "%s" : ",%s", names[statement->aggregates[i]]);
+        }
+        outputAppend(output, "\n", 1);
+    }
+    outputAppend(output, text ? "(" : "", text ? 1 : 0);
+    for (uint32_t i = 0; i < statement->numAggregates; i++) {
+        if (i > 0) {
+            outputAppend(output, text ? ", " : ",", text ? 2 : 1);
+        }
+        AggregateKind kind = statement->aggregates[i];
+        if (kind == AGGREGATE_COUNT) {
+            outputPrintf(output, "%lu", total.count);
+        } else if (total.count == 0) {
+            outputAppend(output, text ? "NULL" : "", text ? 4 : 0);
+        } else {
+            outputPrintf(output, "%u", (kind == AGGREGATE_MIN_ID) ? total.minId : total.maxId);
+        }
+    }
+    outputAppend(output, text ? ")\n" : "\n", text ? 2 : 1);
+    return EXECUTE_SUCCESS;
+}
+
+uint32_t aggregateRanges(Table* table, Snapshot* snapshot, uint32_t minId, uint32_t maxId, uint32_t target,
+                         AggregateRange** ranges) {
+    uint32_t count = 1;
+    AggregateRange* current = malloc(sizeof(AggregateRange));
+    current[0].pageNum = snapshot->rootPageNum;
+    current[0].minId = minId;
+    current[0].maxId = maxId;
+
+    // go down a level at a time until there are enough subtrees. each
+    // child's separator bounds it, clipped to what its parent's range wants
+    while (count < target) {
+        void* node = snapshotGetPage(table, current[0].pageNum);
+        bool isLeaf = (getNodeType(node) == NODE_LEAF);
+        snapshotUnpinPage(table, current[0].pageNum);
+        if (isLeaf) {
+            break;
+        }
+
+        uint32_t nextCount = 0;
+        uint32_t nextCapacity = count * 2;
+        AggregateRange* next = malloc(sizeof(AggregateRange) * nextCapacity);
+        for (uint32_t r = 0; r < count; r++) {
+            node = snapshotGetPage(table, current[r].pageNum);
+            uint32_t numKeys = *internalNodeNumKeys(node);
+            uint32_t low = current[r].minId;
+            for (uint32_t i = 0; i <= numKeys; i++) {
+                uint32_t high = current[r].maxId;
+                if (i < numKeys) {
+                    uint32_t key = *internalNodeKey(node, i);
+                    if (key < low) {
+                        continue;
+                    }
+                    if (key < high) {
+                        high = key;
+                    }
+                }
+                if (nextCount == nextCapacity) {
+                    nextCapacity *= 2;
+                    next = realloc(next, sizeof(AggregateRange) * nextCapacity);
+                }
+                next[nextCount].pageNum = *internalNodeChild(node, i);
+                next[nextCount].minId = low;
+                next[nextCount].maxId = high;
+                nextCount++;
+                if (high == current[r].maxId) {
+                    break;
+                }
+                low = high + 1;
+            }
+            snapshotUnpinPage(table, current[r].pageNum);
+        }
+        free(current);
+        current = next;
+        count = nextCount;
+    }
+
+    *ranges = current;
+    return count;
+}
+
+void* aggregateWorkerMain(void* argument) {
+    AggregateWorker* worker = argument;
+    AggregateScan* scan = worker->scan;
+    worker->result.count = 0;
+    worker->result.minId = UINT32_MAX;
+    worker->result.maxId = 0;
+    while (true) {
+        uint32_t next = __atomic_fetch_add(&(scan->nextRange), 1, __ATOMIC_RELAXED);
+        if (next >= scan->numRanges) {
+            break;
+        }
+        aggregateScanRange(scan, &(scan->ranges[next]), &(worker->result));
+    }
+    return NULL;
+}
+
+void aggregateScanRange(AggregateScan* scan, AggregateRange* range, AggregateResult* result) {
+    ScanFilter filter = scan->filter;
+    filter.minId = range->minId;
+    filter.maxId = range->maxId;
+
+    // a subtree of a snapshot reads as a snapshot of its own, whose cursor
+    // runs out where the subtree does
+    Snapshot subtree;
+    subtree.rootPageNum = range->pageNum;
+    subtree.version = scan->version;
+    Cursor cursor;
+    snapshotSeek(scan->table, &subtree, range->minId, &cursor);
+
+    // only the keys of selected cells are read: ids come in order, so the
+    // first and last selected are the leaf's min and max
+    uint16_t selection[LEAF_NODE_MAX_CELLS];
+    while (!(cursor.endOfTable)) {
+        void* leaf = cursor.leaf;
+        uint32_t count = leafNodeSelect(leaf, cursor.cellNum, &filter, selection);
+        if (count > 0) {
+            uint32_t firstId = *leafNodeKey(leaf, selection[0]);
+            uint32_t lastId = *leafNodeKey(leaf, selection[count - 1]);
+            result->count += count;
+            if (firstId < result->minId) {
+                result->minId = firstId;
+            }
+            if (lastId > result->maxId) {
+                result->maxId = lastId;
+            }
+        }
+        uint32_t numCells = *leafNodeNumCells(leaf);
+        if (*leafNodeKey(leaf, numCells - 1) >= range->maxId) {
+            break;
+        }
+        cursorNextLeaf(&cursor);
+    }
+    closeCursor(&cursor);
+}
+
+void scanFilterInit(ScanFilter* filter, Statement* statement) {
+    filter->minId = statement->minId;
+    filter->maxId = statement->maxId;
+    filter->byColumn = statement->byColumn;
+    filter->column = statement->column;
+    filter->prefix = statement->prefix;
+    filter->value = (const uint8_t*)statement->value;
+    filter->length = statement->byColumn ? strlen(statement->value) : 0;
+}
+
+uint32_t leafNodeSelect(void* node, uint32_t cellNum, ScanFilter* filter, uint16_t* selection) {
+    uint32_t numCells = *leafNodeNumCells(node);
+    uint32_t begin = leafNodeLowerBound(node, filter->minId);
+    uint32_t end = (filter->maxId == UINT32_MAX) ? numCells : leafNodeLowerBound(node, filter->maxId + 1);
+    if (begin < cellNum) {
+        begin = cellNum;
+    }
+    uint32_t count = 0;
+    for (uint32_t i = begin; i < end; i++) {
+        selection[count++] = i;
+    }
+    if (!(filter->byColumn) || count == 0) {
+        return count;
+    }
+
+    // gather each selected row's column slice into vectors
+    const uint8_t* bytes[LEAF_NODE_MAX_CELLS];
+    uint8_t lengths[LEAF_NODE_MAX_CELLS];
+    bool email = (filter->column == INDEX_EMAIL);
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t* value = leafNodeValue(node, selection[i]);
+        uint8_t* rowLengths = value + ID_SIZE;
+        lengths[i] = rowLengths[email];
+        bytes[i] = value + ROW_HEADER_SIZE + (email ? rowLengths[0] : 0);
+    }
+
+    // then narrow them without branching on the outcome: lengths first,
+    // and the first byte, before comparing whole values
+    uint32_t length = filter->length;
+    uint8_t first = (length > 0) ? filter->value[0] : 0;
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        bool keep = filter->prefix ? (lengths[i] >= length) : (lengths[i] == length);
+        keep = keep && (length == 0 || bytes[i][0] == first);
+        selection[kept] = selection[i];
+        bytes[kept] = bytes[i];
+        kept += keep;
+    }
+    count = kept;
+    kept = 0;
+    if (length > LEAF_SELECT_INLINE_COMPARE) {
+        for (uint32_t i = 0; i < count; i++) {
+            selection[kept] = selection[i];
+            kept += (memcmp(bytes[i], filter->value, length) == 0);
+        }
+        return kept;
+    }
+    // short values, the usual case, are cheaper to compare inline than
+    // through a call per row
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t difference = 0;
+        for (uint32_t j = 0; j < length; j++) {
+            difference |= bytes[i][j] ^ filter->value[j];
+        }
+        selection[kept] = selection[i];
+        kept += (difference == 0);
+    }
+    return kept;
+}
+
+ExecuteResult executeCreateIndex(Statement* statement, Table* table) {
+    IndexColumn column = statement->column;
+
+    // building reads every row, so writers wait until it is done
+    pthread_rwlock_wrlock(&(table->lock));
+    if (table->indexRoots[column] != 0) {
+        pthread_rwlock_unlock(&(table->lock));
+        return EXECUTE_INDEX_EXISTS;
+    }
+
+    indexCreate(table, column);
+    pthread_rwlock_unlock(&(table->lock));
+    return EXECUTE_SUCCESS;
+}
+
+uint32_t serializeRow(Row* source, void* destination) {
+    uint8_t* lengths = destination + ID_SIZE;
+    lengths[0] = strlen(source->username);
+    lengths[1] = strlen(source->email);
+    memcpy(destination, &(source->id), ID_SIZE);
+    memcpy(destination + ROW_HEADER_SIZE, source->username, lengths[0]);
+    memcpy(destination + ROW_HEADER_SIZE + lengths[0], source->email, lengths[1]);
+    return ROW_HEADER_SIZE + lengths[0] + lengths[1];
+}
+
+uint32_t serializedRowSize(Row* row) {
+    return ROW_HEADER_SIZE + strlen(row->username) + strlen(row->email);
+}
+
+void deserializeRow(void* source, Row* destination) {
+    uint8_t* lengths = source + ID_SIZE;
+    memcpy(&(destination->id), source, ID_SIZE);
+    memcpy(destination->username, source + ROW_HEADER_SIZE, lengths[0]);
+    destination->username[lengths[0]] = 0;
+    memcpy(destination->email, source + ROW_HEADER_SIZE + lengths[0], lengths[1]);
+    destination->email[lengths[1]] = 0;
+}
+
+uint32_t rowValueSize(void* source) {
+    uint8_t* lengths = source + ID_SIZE;
+    return ROW_HEADER_SIZE + lengths[0] + lengths[1];
+}
+
+void deserializeFixedRow(void* source, Row* destination) {
     memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
     memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
     memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
 }
 
-void* cursorValue(Cursor* cursor) {
-    uint32_t pageNum = cursor->pageNum;
-    void* page = getPage(cursor->table->pager, pageNum);
-    return leafNodeValue(page, cursor->cellNum);
+void* cursorValue(Cursor* cursor) {
+    return leafNodeValue(cursor->leaf, cursor->cellNum);
+}
+
+void cursorNextLeaf(Cursor* cursor) {
+    // from past the last cell, advancing steps onto the next leaf
+    cursor->cellNum = *leafNodeNumCells(cursor->leaf);
+    cursorAdvance(cursor);
+}
+
+void cursorAdvance(Cursor* cursor) {
+    Pager* pager = cursor->table->pager;
+    void* node = cursor->leaf;
+
+    cursor->cellNum += 1;
+    if (cursor->snapshot != NULL) {
+        if (cursor->cellNum >= (*leafNodeNumCells(node))) {
+            snapshotNextLeaf(cursor);
+        }
+        return;
+    }
+    if (cursor->cellNum >= (*leafNodeNumCells(node))) {
+        // advance to leaf node, moving the cursor's pin and latch along
+        // with it. leaves are only ever latched left to right, so holding
+        // both for a moment can't deadlock
+        uint32_t nextPageNum = *leafNodeNextLeaf(node);
+        if (nextPageNum == 0) {
+            cursor->endOfTable = true;
+        } else {
+            void* next = getPage(pager, nextPageNum);
+            latchPage(pager, next, cursor->exclusive);
+            unlatchPage(pager, node);
+            unpinPage(pager, cursor->pageNum);
+            cursor->pageNum = nextPageNum;
+            cursor->leaf = next;
+            cursor->cellNum = 0;
+        }
+    }
+}
+
+void printRow(OutputBuffer* output, void* value) {
+    uint8_t* lengths = value + ID_SIZE;
+    char* username = value + ROW_HEADER_SIZE;
+    char* email = username + lengths[0];
+
+    if (output->format == ROW_FORMAT_BINARY) {
+        // the stored row is already a binary row file record
+        outputAppend(output, value, ROW_HEADER_SIZE + lengths[0] + lengths[1]);
+        return;
+    }
+
+    uint32_t id;
+    memcpy(&id, value, ID_SIZE);
+    if (output->format == ROW_FORMAT_CSV) {
+        outputReserve(output, FORMAT_UINT_MAX_SIZE + 1);
+        output->length += formatUint(output->data + output->length, id);
+        output->data[output->length++] = ',';
+        printCsvField(output, username, lengths[0]);
+        outputAppend(output, ",", 1);
+        printCsvField(output, email, lengths[1]);
+        outputAppend(output, "\n", 1);
+        return;
+    }
+
+    // "(id, username, email)\n" by hand; this runs once per row selected
+    outputReserve(output, ROW_TEXT_PUNCTUATION_SIZE + FORMAT_UINT_MAX_SIZE + lengths[0] + lengths[1]);
+    char* out = output->data + output->length;
+    *out++ = '(';
+    out += formatUint(out, id);
+    *out++ = ',';
+    *out++ = ' ';
+    memcpy(out, username, lengths[0]);
+    out += lengths[0];
+    *out++ = ',';
+    *out++ = ' ';
+    memcpy(out, email, lengths[1]);
+    out += lengths[1];
+    *out++ = ')';
+    *out++ = '\n';
+    output->length = out - output->data;
+}
+
+void printCsvField(OutputBuffer* output, const char* field, uint32_t length) {
+    bool quote = false;
+    for (uint32_t i = 0; i < length && !quote; i++) {
+        quote = field[i] == ',' || field[i] == '"' || field[i] == '\n' || field[i] == '\r';
+    }
+    if (!quote) {
+        outputAppend(output, field, length);
+        return;
+    }
+
+    // RFC 4180: wrap in quotes and double the quotes inside
+    outputReserve(output, 2 * length + 2);
+    char* out = output->data + output->length;
+    *out++ = '"';
+    for (uint32_t i = 0; i < length; i++) {
+        if (field[i] == '"') {
+            *out++ = '"';
+        }
+        *out++ = field[i];
+    }
+    *out++ = '"';
+    output->length = out - output->data;
+}
+
+void beginRows(OutputBuffer* output) {
+    if (output->format == ROW_FORMAT_CSV) {
+        outputPrintf(output, "id,username,email\n");
+    } else if (output->format == ROW_FORMAT_BINARY) {
+        outputAppend(output, ROW_FILE_MAGIC, ROW_FILE_MAGIC_SIZE);
+    }
+}
+
+void endRows(OutputBuffer* output) {
+    if (output->format == ROW_FORMAT_BINARY) {
+        // lets a reader of a stream find where this result ends
+        uint8_t marker[ROW_HEADER_SIZE];
+        memset(marker, 0, ROW_HEADER_SIZE);
+        marker[ID_SIZE] = ROW_FILE_END_LENGTH;
+        outputAppend(output, (char*)marker, ROW_HEADER_SIZE);
+    }
+}
+
+uint32_t formatUint(char* destination, uint32_t value) {
+    char digits[FORMAT_UINT_MAX_SIZE];
+    uint32_t numDigits = 0;
+    uint32_t length = 0;
+    do {
+        digits[numDigits++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    while (numDigits > 0) {
+        destination[length++] = digits[--numDigits];
+    }
+    return length;
+}
+
+uint32_t* leafNodeNumCells(void* node) {
+    return node + LEAF_NODE_NUM_CELLS_OFFSET;
+}
+
+uint16_t* leafNodeContentStart(void* node) {
+    return node + LEAF_NODE_CONTENT_START_OFFSET;
+}
+
+uint16_t* leafNodeFragmentedBytes(void* node) {
+    return node + LEAF_NODE_FRAGMENTED_OFFSET;
+}
+
+uint32_t* leafNodeKeys(void* node) {
+    return node + LEAF_NODE_HEADER_SIZE;
+}
+
+uint16_t* leafNodeSlots(void* node) {
+    // slots follow the key array, so they move as it grows
+    return (void*)(leafNodeKeys(node) + *leafNodeNumCells(node));
+}
+
+uint32_t* leafNodeKey(void* node, uint32_t cellNum) {
+    return leafNodeKeys(node) + cellNum;
+}
+
+void* leafNodeValue(void* node, uint32_t cellNum) {
+    return node + leafNodeSlots(node)[cellNum];
+}
+
+void* leafNodeAllocateCell(void* node, uint32_t cellNum, uint32_t key, uint32_t valueSize) {
+    uint32_t numCells = *leafNodeNumCells(node);
+    uint32_t arraysEnd = LEAF_NODE_HEADER_SIZE + (numCells + 1) * LEAF_NODE_CELL_OVERHEAD;
+    if (arraysEnd + valueSize > *leafNodeContentStart(node)) {
+        leafNodeCompact(node);
+    }
+
+    uint32_t* keys = leafNodeKeys(node);
+    uint8_t* slots = (uint8_t*)leafNodeSlots(node);
+
+    // widen both arrays by one entry, highest bytes first: slots after the
+    // gap shift by a key plus a slot, slots before it by a key, then keys
+    memmove(slots + (cellNum + 1) * LEAF_NODE_SLOT_SIZE + LEAF_NODE_KEY_SIZE,
+        slots + cellNum * LEAF_NODE_SLOT_SIZE, (numCells - cellNum) * LEAF_NODE_SLOT_SIZE);
+    memmove(slots + LEAF_NODE_KEY_SIZE, slots, cellNum * LEAF_NODE_SLOT_SIZE);
+    memmove(keys + cellNum + 1, keys + cellNum, (numCells - cellNum) * LEAF_NODE_KEY_SIZE);
+
+    *leafNodeNumCells(node) = numCells + 1;
+    *leafNodeContentStart(node) -= valueSize;
+    keys[cellNum] = key;
+    leafNodeSlots(node)[cellNum] = *leafNodeContentStart(node);
+    return node + *leafNodeContentStart(node);
+}
+
+void leafNodeRemoveCell(void* node, uint32_t cellNum) {
+    uint32_t numCells = *leafNodeNumCells(node);
+    uint32_t* keys = leafNodeKeys(node);
+    uint8_t* slots = (uint8_t*)leafNodeSlots(node);
+
+    uint16_t offset = leafNodeSlots(node)[cellNum];
+    uint32_t valueSize = rowValueSize(node + offset);
+    if (offset == *leafNodeContentStart(node)) {
+        *leafNodeContentStart(node) += valueSize;
+    } else {
+        *leafNodeFragmentedBytes(node) += valueSize;
+    }
+
+    // the reverse of allocation, lowest bytes first
+    memmove(keys + cellNum, keys + cellNum + 1, (numCells - cellNum - 1) * LEAF_NODE_KEY_SIZE);
+    memmove(slots - LEAF_NODE_KEY_SIZE, slots, cellNum * LEAF_NODE_SLOT_SIZE);
+    memmove(slots + cellNum * LEAF_NODE_SLOT_SIZE - LEAF_NODE_KEY_SIZE,
+        slots + (cellNum + 1) * LEAF_NODE_SLOT_SIZE, (numCells - cellNum - 1) * LEAF_NODE_SLOT_SIZE);
+    *leafNodeNumCells(node) = numCells - 1;
+}
+
+void leafNodeCompact(void* node) {
+    uint8_t scratch[PAGE_SIZE];
+    memcpy(scratch, node, PAGE_SIZE);
+
+    uint32_t numCells = *leafNodeNumCells(node);
+    uint16_t* slots = leafNodeSlots(node);
+    uint32_t contentStart = PAGE_SIZE;
+    for (uint32_t i = 0; i < numCells; i++) {
+        uint32_t valueSize = rowValueSize(scratch + slots[i]);
+        contentStart -= valueSize;
+        memcpy(node + contentStart, scratch + slots[i], valueSize);
+        slots[i] = contentStart;
+    }
+    *leafNodeContentStart(node) = contentStart;
+    *leafNodeFragmentedBytes(node) = 0;
+}
+
+uint32_t leafNodeCellSize(void* node, uint32_t cellNum) {
+    return LEAF_NODE_CELL_OVERHEAD + rowValueSize(leafNodeValue(node, cellNum));
+}
+
+uint32_t leafNodeFreeSpace(void* node) {
+    uint32_t arraysEnd = LEAF_NODE_HEADER_SIZE + *leafNodeNumCells(node) * LEAF_NODE_CELL_OVERHEAD;
+    return *leafNodeContentStart(node) - arraysEnd + *leafNodeFragmentedBytes(node);
+}
+
+uint32_t leafNodeLowerBound(void* node, uint32_t key) {
+    uint32_t* keys = leafNodeKeys(node);
+    uint32_t l = 0;
+    uint32_t r = *leafNodeNumCells(node);
+
+    // narrow with binary search, then count the keys below key in the
+    // remaining window; keys are sorted so that count is the offset
+    while (r - l > LEAF_NODE_SEARCH_WINDOW) {
+        uint32_t mid = (l + r) / 2;
+        if (keys[mid] < key) {
+            l = mid + 1;
+        } else {
+            r = mid;
+        }
+    }
+
+    uint32_t i = l;
+    uint32_t below = 0;
+#if defined(__AVX2__)
+    // compares are signed, so flip the sign bit to order unsigned keys
+    __m256i bias8 = _mm256_set1_epi32(INT32_MIN);
+    __m256i needle8 = _mm256_xor_si256(_mm256_set1_epi32(key), bias8);
+    for (; i + 8 <= r; i += 8) {
+        __m256i chunk = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(keys + i)), bias8);
+        __m256i less = _mm256_cmpgt_epi32(needle8, chunk);
+        below += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(less)));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i bias = _mm_set1_epi32(INT32_MIN);
+    __m128i needle = _mm_xor_si128(_mm_set1_epi32(key), bias);
+    for (; i + 4 <= r; i += 4) {
+        __m128i chunk = _mm_xor_si128(_mm_loadu_si128((__m128i*)(keys + i)), bias);
+        __m128i less = _mm_cmpgt_epi32(needle, chunk);
+        below += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(less)));
+    }
+#endif
+    for (; i < r; i++) {
+        below += (keys[i] < key);
+    }
+    return l + below;
+}
+
+uint32_t* leafNodeNextLeaf(void* node) {
+    return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
+void initializeLeafNode(void* node) {
+    setNodeType(node, NODE_LEAF);
+    setNodeRoot(node, false);
+    *leafNodeNumCells(node) = 0;
+    *leafNodeNextLeaf(node) = 0;
+    *leafNodeContentStart(node) = PAGE_SIZE;
+    *leafNodeFragmentedBytes(node) = 0;
+}
+
+void leafNodeInsert(Cursor* cursor, uint32_t key, Row* value) {
+    void* node = getPage(cursor->table->pager, cursor->pageNum);
+
+    uint32_t valueSize = serializedRowSize(value);
+    if (leafNodeFreeSpace(node) < LEAF_NODE_CELL_OVERHEAD + valueSize) {
+        // node full
+        unpinPage(cursor->table->pager, cursor->pageNum);
+        leafNodeSplitAndInsert(cursor, key, value);
+        return;
+    }
+
+    serializeRow(value, leafNodeAllocateCell(node, cursor->cellNum, key, valueSize));
+    markPageDirty(cursor->table->pager, cursor->pageNum);
+    unpinPage(cursor->table->pager, cursor->pageNum);
+}
+
+void leafNodeSplitAndInsert(Cursor* cursor, uint32_t key, Row* value) {
+    // create new node
+    Pager* pager = cursor->table->pager;
+    __atomic_fetch_add(&(cursor->table->stats.leafSplits), 1, __ATOMIC_RELAXED);
+    void* oldNode = getPage(pager, cursor->pageNum);
+    uint32_t newPageNum = getUnusedPageNum(pager);
+    void* newNode = getPage(pager, newPageNum);
+    initializeLeafNode(newNode);
+    *leafNodeNextLeaf(newNode) = *leafNodeNextLeaf(oldNode);
+    *leafNodeNextLeaf(oldNode) = newPageNum;
+
+    // rows vary in length, so split by bytes: the left node keeps cells
+    // while they stay within half of the total, counting the new row. a
+    // row past the end of the table is most likely the next of a sequence,
+    // so then the left node keeps everything and the new row starts the
+    // right one; appends leave full leaves behind instead of half empty ones
+    uint32_t numCells = *leafNodeNumCells(oldNode);
+    bool appending = (cursor->cellNum == numCells && *leafNodeNextLeaf(newNode) == 0);
+    uint32_t newCellSize = LEAF_NODE_CELL_OVERHEAD + serializedRowSize(value);
+    uint32_t totalBytes = newCellSize;
+    for (uint32_t i = 0; i < numCells; i++) {
+        totalBytes += leafNodeCellSize(oldNode, i);
+    }
+    uint32_t leftCount = appending ? numCells : 0;
+    uint32_t leftBytes = 0;
+    while (leftCount < numCells) {
+        uint32_t cellSize;
+        if (leftCount == cursor->cellNum) {
+            cellSize = newCellSize;
+        } else {
+            cellSize = leafNodeCellSize(oldNode, leftCount > cursor->cellNum ? leftCount - 1 : leftCount);
+        }
+        if (leftCount > 0 && (leftBytes + cellSize) * 2 > totalBytes) {
+            break;
+        }
+        leftBytes += cellSize;
+        leftCount++;
+    }
+
+    // move the old cells past the split point, counting the new row's
+    // position, then trim them from the end of the old node. the holes
+    // they leave are compacted away if the new row lands on the left
+    uint32_t firstMoved = (cursor->cellNum < leftCount) ? leftCount - 1 : leftCount;
+    for (uint32_t i = firstMoved; i < numCells; i++) {
+        uint32_t valueSize = rowValueSize(leafNodeValue(oldNode, i));
+        void* destination = leafNodeAllocateCell(newNode, *leafNodeNumCells(newNode),
+            *leafNodeKey(oldNode, i), valueSize);
+        memcpy(destination, leafNodeValue(oldNode, i), valueSize);
+    }
+    for (uint32_t i = numCells; i > firstMoved; i--) {
+        leafNodeRemoveCell(oldNode, i - 1);
+    }
+
+    void* destinationNode = oldNode;
+    uint32_t indexWithinNode = cursor->cellNum;
+    if (cursor->cellNum >= leftCount) {
+        destinationNode = newNode;
+        indexWithinNode = cursor->cellNum - leftCount;
+    }
+    serializeRow(value, leafNodeAllocateCell(destinationNode, indexWithinNode, key, serializedRowSize(value)));
+
+    markPageDirty(pager, cursor->pageNum);
+    markPageDirty(pager, newPageNum);
+
+    // update node's parent
+    bool wasRoot = isNodeRoot(oldNode);
+    uint32_t oldMaxKey = getNodeMaxKey(oldNode);
+    unpinPage(pager, cursor->pageNum);
+    unpinPage(pager, newPageNum);
+    if (wasRoot) {
+        return createNewRoot(cursor->table, newPageNum, oldMaxKey);
+    } else {
+        return internalNodeInsert(cursor, cursor->depth - 1, oldMaxKey, newPageNum, appending);
+    }
+}
+
+void internalNodeInsert(Cursor* cursor, uint32_t level, uint32_t leftMaxKey, uint32_t rightChildPageNum,
+    bool appending) {
+    Table* table = cursor->table;
+    Pager* pager = table->pager;
+    uint32_t pageNum = cursor->path[level];
+    uint32_t splitIndex = cursor->pathIndex[level];
+    void* node = getPage(pager, pageNum);
+    uint32_t numKeys = *internalNodeNumKeys(node);
+
+    // lay out every child with its upper bound, splicing the new sibling in
+    // right after the child that split. the split child keeps its page and
+    // gets leftMaxKey; the sibling inherits the split child's old bound.
+    // the last entry is the right child, whose bound is not stored.
+    uint32_t numChildren = numKeys + 2;
+    uint32_t children[INTERNAL_NODE_MAX_KEYS + 2];
+    uint32_t keys[INTERNAL_NODE_MAX_KEYS + 2];
+    uint32_t n = 0;
+    for (uint32_t i = 0; i <= numKeys; i++) {
+        uint32_t bound = (i < numKeys) ? *internalNodeKey(node, i) : 0;
+        children[n] = *internalNodeChild(node, i);
+        keys[n] = bound;
+        n++;
+        if (i == splitIndex) {
+            keys[n - 1] = leftMaxKey;
+            children[n] = rightChildPageNum;
+            keys[n] = bound;
+            n++;
+        }
+    }
+
+    if (numChildren - 1 <= INTERNAL_NODE_MAX_KEYS) {
+        // room in this node, rewrite it in place
+        *internalNodeNumKeys(node) = numChildren - 1;
+        for (uint32_t i = 0; i < numChildren - 1; i++) {
+            *internalNodeCell(node, i) = children[i];
+            *internalNodeKey(node, i) = keys[i];
+        }
+        *internalNodeRightChild(node) = children[numChildren - 1];
+        markPageDirty(pager, pageNum);
+        unpinPage(pager, pageNum);
+        return;
+    }
+
+    // node full. left half stays here, right half moves to a new node and
+    // the bound of the left half's last child is promoted to the parent
+    __atomic_fetch_add(&(table->stats.internalSplits), 1, __ATOMIC_RELAXED);
+    uint32_t newPageNum = getUnusedPageNum(pager);
+    void* newNode = getPage(pager, newPageNum);
+    initializeInternalNode(newNode);
+
+    // on an append the split child was the rightmost one, so the new node
+    // gets just it and its new sibling, as leaves split unevenly then too
+    uint32_t leftCount = appending ? numChildren - 2 : numChildren / 2;
+    uint32_t rightCount = numChildren - leftCount;
+
+    *internalNodeNumKeys(node) = leftCount - 1;
+    for (uint32_t i = 0; i < leftCount - 1; i++) {
+        *internalNodeCell(node, i) = children[i];
+        *internalNodeKey(node, i) = keys[i];
+    }
+    *internalNodeRightChild(node) = children[leftCount - 1];
+    uint32_t promotedKey = keys[leftCount - 1];
+
+    *internalNodeNumKeys(newNode) = rightCount - 1;
+    for (uint32_t i = 0; i < rightCount - 1; i++) {
+        *internalNodeCell(newNode, i) = children[leftCount + i];
+        *internalNodeKey(newNode, i) = keys[leftCount + i];
+    }
+    *internalNodeRightChild(newNode) = children[numChildren - 1];
+
+    markPageDirty(pager, pageNum);
+    markPageDirty(pager, newPageNum);
+    unpinPage(pager, pageNum);
+    unpinPage(pager, newPageNum);
+
+    if (level == 0) {
+        createNewRoot(table, newPageNum, promotedKey);
+    } else {
+        internalNodeInsert(cursor, level - 1, promotedKey, newPageNum, appending);
+    }
+}
+
+bool isNodeRoot(void* node) {
+    uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
+    return (bool)value;
+}
+    
+void setNodeRoot(void* node, bool is_root) {
+    uint8_t value = is_root;
+    *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+}
+
+void createNewRoot(Table* table, uint32_t rightChildPageNum, uint32_t leftChildMaxKey) {
+    void* root = getPage(table->pager, table->rootPageNum);
+    uint32_t leftChildPageNum = getUnusedPageNum(table->pager);
+    void* leftChild = getPage(table->pager, leftChildPageNum);
+
+    memcpy(leftChild, root, PAGE_SIZE);
+    setNodeRoot(leftChild, false);
+
+    initializeInternalNode(root);
+    setNodeRoot(root, true);
+    *internalNodeNumKeys(root) = 1;
+    *internalNodeChild(root, 0) = leftChildPageNum;
+    *internalNodeKey(root, 0) = leftChildMaxKey;
+    *internalNodeRightChild(root) = rightChildPageNum;
+
+    markPageDirty(table->pager, table->rootPageNum);
+    markPageDirty(table->pager, leftChildPageNum);
+    unpinPage(table->pager, table->rootPageNum);
+    unpinPage(table->pager, leftChildPageNum);
+}
+
+void initializeInternalNode(void* node) {
+    setNodeType(node, NODE_INTERNAL);
+    setNodeRoot(node, false);
+    *internalNodeNumKeys(node) = 0;
+}
+
+uint32_t* internalNodeNumKeys(void* node) {
+    return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+}
+    
+uint32_t* internalNodeRightChild(void* node) {
+    return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
+
+uint32_t* internalNodeCell(void* node, uint32_t cellNum) {
+    return node + INTERNAL_NODE_HEADER_SIZE + cellNum * INTERNAL_NODE_CELL_SIZE;
+}
+
+uint32_t* internalNodeChild(void* node, uint32_t childNum) {
+    uint32_t numKeys = *internalNodeNumKeys(node);
+    if (childNum > numKeys) {
+        printf("Tried to access child_num %d > num_keys %d\n", childNum, numKeys);
+        exit(EXIT_FAILURE);
+    } else if (childNum == numKeys) {
+        return internalNodeRightChild(node);
+    } else {
+        return internalNodeCell(node, childNum);
+    }
+}
+
+uint32_t* internalNodeKey(void* node, uint32_t keyNum) {
+    return (void*)internalNodeCell(node, keyNum) + INTERNAL_NODE_CHILD_SIZE;
+}
+
+uint32_t getNodeMaxKey(void* node) {
+    switch (getNodeType(node)) {
+        case NODE_INTERNAL:
+          return *internalNodeKey(node, *internalNodeNumKeys(node) - 1);
+        case NODE_LEAF:
+          return *leafNodeKey(node, *leafNodeNumCells(node) - 1);
+        default:
+          printf("Index node has no integer max key.\n");
+          exit(EXIT_FAILURE);
+    }
+}
+
+int compareIndexEntries(const uint8_t* a, uint32_t aLength, uint32_t aId,
+    const uint8_t* b, uint32_t bLength, uint32_t bId) {
+    int cmp = memcmp(a, b, aLength < bLength ? aLength : bLength);
+    if (cmp != 0) {
+        return cmp;
+    }
+    if (aLength != bLength) {
+        return aLength < bLength ? -1 : 1;
+    }
+    if (aId != bId) {
+        return aId < bId ? -1 : 1;
+    }
+    return 0;
+}
+
+void rowColumn(void* value, IndexColumn column, const uint8_t** bytes, uint32_t* length) {
+    uint8_t* lengths = value + ID_SIZE;
+    uint8_t* username = value + ROW_HEADER_SIZE;
+    if (column == INDEX_USERNAME) {
+        *bytes = username;
+        *length = lengths[0];
+    } else {
+        *bytes = username + lengths[0];
+        *length = lengths[1];
+    }
+}
+
+void rowColumnOf(Row* row, IndexColumn column, const uint8_t** bytes, uint32_t* length) {
+    const char* text = (column == INDEX_USERNAME) ? row->username : row->email;
+    *bytes = (const uint8_t*)text;
+    *length = strlen(text);
+}
+
+uint16_t* indexNodeNumCells(void* node) {
+    return node + INDEX_NODE_NUM_CELLS_OFFSET;
+}
+
+uint16_t* indexNodeContentStart(void* node) {
+    return node + INDEX_NODE_CONTENT_START_OFFSET;
+}
+
+uint32_t* indexNodeLink(void* node) {
+    return node + INDEX_NODE_LINK_OFFSET;
+}
+
+uint8_t* indexLeafPrefixLength(void* node) {
+    return node + INDEX_NODE_PREFIX_LENGTH_OFFSET;
+}
+
+uint8_t* indexLeafPrefix(void* node) {
+    return node + INDEX_NODE_HEADER_SIZE;
+}
+
+uint16_t* indexNodeSlots(void* node) {
+    return node + INDEX_NODE_HEADER_SIZE + *indexLeafPrefixLength(node);
+}
+
+uint8_t* indexNodeCell(void* node, uint32_t cellNum) {
+    return node + indexNodeSlots(node)[cellNum];
+}
+
+uint32_t indexNodeFreeSpace(void* node) {
+    uint32_t slotsEnd = INDEX_NODE_HEADER_SIZE + *indexLeafPrefixLength(node)
+        + *indexNodeNumCells(node) * INDEX_NODE_SLOT_SIZE;
+    return *indexNodeContentStart(node) - slotsEnd;
+}
+
+void initializeIndexNode(void* node, NodeType type) {
+    setNodeType(node, type);
+    setNodeRoot(node, false);
+    *indexNodeNumCells(node) = 0;
+    *indexNodeContentStart(node) = PAGE_SIZE;
+    *indexNodeLink(node) = 0;
+    *indexLeafPrefixLength(node) = 0;
+}
+
+void indexLeafEntry(void* node, uint32_t cellNum, uint8_t* key, IndexEntry* entry) {
+    uint32_t prefixLength = *indexLeafPrefixLength(node);
+    uint8_t* cell = indexNodeCell(node, cellNum);
+    memcpy(key, indexLeafPrefix(node), prefixLength);
+    memcpy(key + prefixLength, cell + 1, cell[0]);
+    entry->key = key;
+    entry->length = prefixLength + cell[0];
+    memcpy(&(entry->id), cell + 1 + cell[0], ID_SIZE);
+    entry->childPageNum = 0;
+}
+
+void indexInternalEntry(void* node, uint32_t cellNum, IndexEntry* entry) {
+    uint8_t* cell = indexNodeCell(node, cellNum);
+    memcpy(&(entry->childPageNum), cell, sizeof(uint32_t));
+    entry->length = cell[4];
+    entry->key = cell + 5;
+    memcpy(&(entry->id), cell + 5 + entry->length, ID_SIZE);
+}
+
+uint32_t indexNodeDecode(void* node, IndexEntry* entries, uint8_t* keys) {
+    uint32_t numCells = *indexNodeNumCells(node);
+    if (getNodeType(node) == NODE_INDEX_LEAF) {
+        for (uint32_t i = 0; i < numCells; i++) {
+            indexLeafEntry(node, i, keys, &(entries[i]));
+            keys += entries[i].length;
+        }
+        return numCells;
+    }
+
+    for (uint32_t i = 0; i < numCells; i++) {
+        indexInternalEntry(node, i, &(entries[i]));
+        memcpy(keys, entries[i].key, entries[i].length);
+        entries[i].key = keys;
+        keys += entries[i].length;
+    }
+    entries[numCells] = (IndexEntry){keys, 0, 0, *indexNodeLink(node)};
+    return numCells + 1;
+}
+
+uint32_t indexLeafLowerBound(void* node, const uint8_t* key, uint32_t length, uint32_t id) {
+    uint32_t numCells = *indexNodeNumCells(node);
+    uint32_t prefixLength = *indexLeafPrefixLength(node);
+
+    // every entry here starts with the prefix, so a key that doesn't sorts
+    // wholly before or after them
+    uint32_t common = length < prefixLength ? length : prefixLength;
+    int cmp = memcmp(key, indexLeafPrefix(node), common);
+    if (cmp < 0 || (cmp == 0 && length < prefixLength)) {
+        return 0;
+    } else if (cmp > 0) {
+        return numCells;
+    }
+
+    // then only suffixes need comparing
+    const uint8_t* suffix = key + prefixLength;
+    uint32_t suffixLength = length - prefixLength;
+    uint32_t l = 0;
+    uint32_t r = numCells;
+    while (l < r) {
+        uint32_t mid = (l + r) / 2;
+        uint8_t* cell = indexNodeCell(node, mid);
+        uint32_t cellId;
+        memcpy(&cellId, cell + 1 + cell[0], ID_SIZE);
+        if (compareIndexEntries(cell + 1, cell[0], cellId, suffix, suffixLength, id) < 0) {
+            l = mid + 1;
+        } else {
+            r = mid;
+        }
+    }
+    return l;
+}
+
+uint32_t indexInternalFindChild(void* node, const uint8_t* key, uint32_t length, uint32_t id) {
+    uint32_t numCells = *indexNodeNumCells(node);
+    uint32_t l = 0;
+    uint32_t r = numCells;
+    while (l < r) {
+        uint32_t mid = (l + r) / 2;
+        IndexEntry bound;
+        indexInternalEntry(node, mid, &bound);
+        if (compareIndexEntries(bound.key, bound.length, bound.id, key, length, id) < 0) {
+            l = mid + 1;
+        } else {
+            r = mid;
+        }
+    }
+    return l;
+}
+
+uint32_t indexNodeChild(void* node, uint32_t index) {
+    if (index == *indexNodeNumCells(node)) {
+        return *indexNodeLink(node);
+    }
+    IndexEntry bound;
+    indexInternalEntry(node, index, &bound);
+    return bound.childPageNum;
+}
+
+uint32_t indexCommonPrefix(IndexEntry* a, IndexEntry* b) {
+    uint32_t limit = a->length < b->length ? a->length : b->length;
+    uint32_t i = 0;
+    while (i < limit && a->key[i] == b->key[i]) {
+        i++;
+    }
+    return i;
+}
+
+bool indexNodeBuild(void* node, NodeType type, IndexEntry* entries, uint32_t count, uint32_t rightChild) {
+    bool leaf = (type == NODE_INDEX_LEAF);
+    uint32_t prefixLength = 0;
+    if (leaf && count > 0) {
+        // entries are sorted, so the first and last share the least
+        prefixLength = indexCommonPrefix(&(entries[0]), &(entries[count - 1]));
+    }
+
+    uint32_t size = INDEX_NODE_HEADER_SIZE + prefixLength + count * INDEX_NODE_SLOT_SIZE;
+    for (uint32_t i = 0; i < count; i++) {
+        size += leaf ? INDEX_LEAF_CELL_OVERHEAD + entries[i].length - prefixLength
+            : INDEX_INTERNAL_CELL_OVERHEAD + entries[i].length;
+    }
+    if (size > PAGE_SIZE) {
+        return false;
+    }
+
+    // the root flag and a leaf's next link survive the rewrite
+    setNodeType(node, type);
+    *indexNodeNumCells(node) = count;
+    *indexLeafPrefixLength(node) = prefixLength;
+    if (leaf) {
+        if (count > 0) {
+            memcpy(indexLeafPrefix(node), entries[0].key, prefixLength);
+        }
+    } else {
+        *indexNodeLink(node) = rightChild;
+    }
+
+    uint16_t* slots = indexNodeSlots(node);
+    uint32_t contentStart = PAGE_SIZE;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t length = entries[i].length - prefixLength;
+        uint8_t* cell;
+        if (leaf) {
+            contentStart -= INDEX_LEAF_CELL_OVERHEAD + length;
+            cell = node + contentStart;
+            cell[0] = length;
+            memcpy(cell + 1, entries[i].key + prefixLength, length);
+            memcpy(cell + 1 + length, &(entries[i].id), ID_SIZE);
+        } else {
+            contentStart -= INDEX_INTERNAL_CELL_OVERHEAD + length;
+            cell = node + contentStart;
+            memcpy(cell, &(entries[i].childPageNum), sizeof(uint32_t));
+            cell[4] = length;
+            memcpy(cell + 5, entries[i].key, length);
+            memcpy(cell + 5 + length, &(entries[i].id), ID_SIZE);
+        }
+        slots[i] = contentStart;
+    }
+    *indexNodeContentStart(node) = contentStart;
+    return true;
+}
+
+uint32_t indexChooseSplit(NodeType type, IndexEntry* entries, uint32_t count) {
+    bool leaf = (type == NODE_INDEX_LEAF);
+    uint32_t overhead = INDEX_NODE_SLOT_SIZE + (leaf ? INDEX_LEAF_CELL_OVERHEAD : INDEX_INTERNAL_CELL_OVERHEAD);
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        total += overhead + entries[i].length;
+    }
+
+    // a leaf split at k keeps entries [0, k) and moves [k, count), each
+    // half compressing by its own prefix. an internal split at k keeps k - 1
+    // cells and entry k - 1's child as right child, promotes entry k - 1's
+    // bound and moves the cells after it; the last entry is the right child
+    uint32_t best = count / 2;
+    uint32_t bestDifference = UINT32_MAX;
+    uint32_t leftBytes = 0;
+    uint32_t first = leaf ? 1 : 2;
+    uint32_t last = leaf ? count - 1 : count - 2;
+    for (uint32_t k = 1; k <= last; k++) {
+        leftBytes += overhead + entries[k - 1].length;
+        if (k < first) {
+            continue;
+        }
+        uint32_t left, right;
+        if (leaf) {
+            uint32_t leftPrefix = indexCommonPrefix(&(entries[0]), &(entries[k - 1]));
+            uint32_t rightPrefix = indexCommonPrefix(&(entries[k]), &(entries[count - 1]));
+            left = INDEX_NODE_HEADER_SIZE + leftBytes - (k - 1) * leftPrefix;
+            right = INDEX_NODE_HEADER_SIZE + (total - leftBytes) - (count - k - 1) * rightPrefix;
+        } else {
+            left = INDEX_NODE_HEADER_SIZE + leftBytes - overhead - entries[k - 1].length;
+            right = INDEX_NODE_HEADER_SIZE + (total - leftBytes) - overhead;
+        }
+        if (left > PAGE_SIZE || right > PAGE_SIZE) {
+            continue;
+        }
+        uint32_t difference = left > right ? left - right : right - left;
+        if (difference < bestDifference) {
+            best = k;
+            bestDifference = difference;
+        }
+    }
+    return best;
+}
+
+void* indexDescend(Table* table, IndexColumn column, const uint8_t* key, uint32_t length, uint32_t id,
+    uint32_t* pageNum, uint32_t* path, uint32_t* pathIndex, uint32_t* depth) {
+    Pager* pager = table->pager;
+    *depth = 0;
+    *pageNum = table->indexRoots[column];
+    void* node = getPage(pager, *pageNum);
+
+    while (getNodeType(node) == NODE_INDEX_INTERNAL) {
+        if (*depth >= BTREE_MAX_DEPTH) {
+            printf("Index is deeper than %d levels.\n", BTREE_MAX_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        uint32_t index = indexInternalFindChild(node, key, length, id);
+        uint32_t childPageNum = indexNodeChild(node, index);
+        path[*depth] = *pageNum;
+        pathIndex[*depth] = index;
+        (*depth)++;
+
+        unpinPage(pager, *pageNum);
+        *pageNum = childPageNum;
+        node = getPage(pager, *pageNum);
+    }
+    return node;
+}
+
+void indexInsert(Table* table, IndexColumn column, const uint8_t* key, uint32_t length, uint32_t id) {
+    Pager* pager = table->pager;
+    uint32_t path[BTREE_MAX_DEPTH];
+    uint32_t pathIndex[BTREE_MAX_DEPTH];
+    uint32_t depth;
+    uint32_t pageNum;
+    void* leaf = indexDescend(table, column, key, length, id, &pageNum, path, pathIndex, &depth);
+
+    uint32_t numCells = *indexNodeNumCells(leaf);
+    uint32_t cellNum = indexLeafLowerBound(leaf, key, length, id);
+    if (cellNum < numCells) {
+        uint8_t existing[COLUMN_EMAIL_SIZE];
+        IndexEntry entry;
+        indexLeafEntry(leaf, cellNum, existing, &entry);
+        if (compareIndexEntries(entry.key, entry.length, entry.id, key, length, id) == 0) {
+            unpinPage(pager, pageNum);
+            return;
+        }
+    }
+
+    // usually the key shares the leaf's prefix and its cell fits in the gap
+    uint32_t prefixLength = *indexLeafPrefixLength(leaf);
+    uint32_t cellSize = INDEX_LEAF_CELL_OVERHEAD + length - prefixLength;
+    if (length >= prefixLength && memcmp(key, indexLeafPrefix(leaf), prefixLength) == 0
+        && indexNodeFreeSpace(leaf) >= cellSize + INDEX_NODE_SLOT_SIZE) {
+        uint32_t contentStart = *indexNodeContentStart(leaf) - cellSize;
+        uint8_t* cell = leaf + contentStart;
+        cell[0] = length - prefixLength;
+        memcpy(cell + 1, key + prefixLength, length - prefixLength);
+        memcpy(cell + 1 + cell[0], &id, ID_SIZE);
+
+        uint16_t* slots = indexNodeSlots(leaf);
+        memmove(slots + cellNum + 1, slots + cellNum, (numCells - cellNum) * INDEX_NODE_SLOT_SIZE);
+        slots[cellNum] = contentStart;
+        *indexNodeContentStart(leaf) = contentStart;
+        *indexNodeNumCells(leaf) = numCells + 1;
+        markPageDirty(pager, pageNum);
+        unpinPage(pager, pageNum);
+        return;
+    }
+
+    // otherwise unpack the leaf, add the entry and lay it out again with a
+    // fresh prefix, splitting if it no longer fits
+    Arena* arena = statementArena();
+    ArenaMark mark = arenaMark(arena);
+    IndexEntry* entries = arenaAlloc(arena, sizeof(IndexEntry) * (numCells + 1));
+    uint8_t* keys = arenaAlloc(arena, (size_t)(numCells + 1) * COLUMN_EMAIL_SIZE);
+    indexNodeDecode(leaf, entries, keys);
+    memmove(entries + cellNum + 1, entries + cellNum, (numCells - cellNum) * sizeof(IndexEntry));
+    entries[cellNum] = (IndexEntry){key, length, id, 0};
+    uint32_t count = numCells + 1;
+
+    if (indexNodeBuild(leaf, NODE_INDEX_LEAF, entries, count, 0)) {
+        markPageDirty(pager, pageNum);
+        unpinPage(pager, pageNum);
+    } else {
+        uint32_t leftCount = indexChooseSplit(NODE_INDEX_LEAF, entries, count);
+        uint32_t newPageNum = getUnusedPageNum(pager);
+        void* newNode = getPage(pager, newPageNum);
+        initializeIndexNode(newNode, NODE_INDEX_LEAF);
+        indexNodeBuild(newNode, NODE_INDEX_LEAF, entries + leftCount, count - leftCount, 0);
+        indexNodeBuild(leaf, NODE_INDEX_LEAF, entries, leftCount, 0);
+        *indexNodeLink(newNode) = *indexNodeLink(leaf);
+        *indexNodeLink(leaf) = newPageNum;
+        markPageDirty(pager, pageNum);
+        markPageDirty(pager, newPageNum);
+        unpinPage(pager, pageNum);
+        unpinPage(pager, newPageNum);
+
+        IndexEntry leftMax = entries[leftCount - 1];
+        if (depth == 0) {
+            indexCreateNewRoot(table, column, newPageNum, &leftMax);
+        } else {
+            indexInsertSplit(table, column, path, pathIndex, depth - 1, &leftMax, newPageNum);
+        }
+    }
+    arenaRelease(arena, mark);
+}
+
+void indexInsertSplit(Table* table, IndexColumn column, uint32_t* path, uint32_t* pathIndex, uint32_t level,
+    IndexEntry* leftMax, uint32_t rightChildPageNum) {
+    Pager* pager = table->pager;
+    uint32_t pageNum = path[level];
+    uint32_t splitIndex = pathIndex[level];
+    void* node = getPage(pager, pageNum);
+    uint32_t numCells = *indexNodeNumCells(node);
+
+    // as in internalNodeInsert: the split child keeps its page and gets
+    // leftMax as its bound, the new sibling inherits the old bound
+    Arena* arena = statementArena();
+    ArenaMark mark = arenaMark(arena);
+    IndexEntry* old = arenaAlloc(arena, sizeof(IndexEntry) * (numCells + 1));
+    IndexEntry* entries = arenaAlloc(arena, sizeof(IndexEntry) * (numCells + 2));
+    uint8_t* keys = arenaAlloc(arena, (size_t)(numCells + 1) * COLUMN_EMAIL_SIZE);
+    indexNodeDecode(node, old, keys);
+    uint32_t count = 0;
+    for (uint32_t i = 0; i <= numCells; i++) {
+        if (i == splitIndex) {
+            entries[count] = *leftMax;
+            entries[count].childPageNum = old[i].childPageNum;
+            count++;
+            entries[count] = old[i];
+            entries[count].childPageNum = rightChildPageNum;
+        } else {
+            entries[count] = old[i];
+        }
+        count++;
+    }
+
+    if (indexNodeBuild(node, NODE_INDEX_INTERNAL, entries, count - 1, entries[count - 1].childPageNum)) {
+        markPageDirty(pager, pageNum);
+        unpinPage(pager, pageNum);
+    } else {
+        // left half stays, right half moves to a new node and the bound of
+        // the left half's last child goes up
+        uint32_t leftCount = indexChooseSplit(NODE_INDEX_INTERNAL, entries, count);
+        uint32_t newPageNum = getUnusedPageNum(pager);
+        void* newNode = getPage(pager, newPageNum);
+        initializeIndexNode(newNode, NODE_INDEX_INTERNAL);
+        indexNodeBuild(newNode, NODE_INDEX_INTERNAL, entries + leftCount, count - leftCount - 1,
+            entries[count - 1].childPageNum);
+        indexNodeBuild(node, NODE_INDEX_INTERNAL, entries, leftCount - 1, entries[leftCount - 1].childPageNum);
+        markPageDirty(pager, pageNum);
+        markPageDirty(pager, newPageNum);
+        unpinPage(pager, pageNum);
+        unpinPage(pager, newPageNum);
+
+        IndexEntry promoted = entries[leftCount - 1];
+        if (level == 0) {
+            indexCreateNewRoot(table, column, newPageNum, &promoted);
+        } else {
+            indexInsertSplit(table, column, path, pathIndex, level - 1, &promoted, newPageNum);
+        }
+    }
+    arenaRelease(arena, mark);
+}
+
+void indexCreateNewRoot(Table* table, IndexColumn column, uint32_t rightChildPageNum, IndexEntry* leftMax) {
+    Pager* pager = table->pager;
+    uint32_t rootPageNum = table->indexRoots[column];
+    void* root = getPage(pager, rootPageNum);
+    uint32_t leftChildPageNum = getUnusedPageNum(pager);
+    void* leftChild = getPage(pager, leftChildPageNum);
+
+    // the root keeps its page, so the header never has to follow it
+    memcpy(leftChild, root, PAGE_SIZE);
+    setNodeRoot(leftChild, false);
+
+    initializeIndexNode(root, NODE_INDEX_INTERNAL);
+    setNodeRoot(root, true);
+    IndexEntry bound = *leftMax;
+    bound.childPageNum = leftChildPageNum;
+    indexNodeBuild(root, NODE_INDEX_INTERNAL, &bound, 1, rightChildPageNum);
+
+    markPageDirty(pager, rootPageNum);
+    markPageDirty(pager, leftChildPageNum);
+    unpinPage(pager, rootPageNum);
+    unpinPage(pager, leftChildPageNum);
+}
+
+void indexCreate(Table* table, IndexColumn column) {
+    Pager* pager = table->pager;
+    uint32_t rootPageNum = getUnusedPageNum(pager);
+    void* root = getPage(pager, rootPageNum);
+    initializeIndexNode(root, NODE_INDEX_LEAF);
+    setNodeRoot(root, true);
+    markPageDirty(pager, rootPageNum);
+    unpinPage(pager, rootPageNum);
+
+    table->indexRoots[column] = rootPageNum;
+    DbHeader* header = getPage(pager, DB_HEADER_PAGE);
+    header->indexRootPageNums[column] = rootPageNum;
+    markPageDirty(pager, DB_HEADER_PAGE);
+    unpinPage(pager, DB_HEADER_PAGE);
+
+    indexPopulate(table, column);
+}
+
+void indexDelete(Table* table, IndexColumn column, const uint8_t* key, uint32_t length, uint32_t id) {
+    Pager* pager = table->pager;
+    uint32_t path[BTREE_MAX_DEPTH];
+    uint32_t pathIndex[BTREE_MAX_DEPTH];
+    uint32_t depth;
+    uint32_t pageNum;
+    void* leaf = indexDescend(table, column, key, length, id, &pageNum, path, pathIndex, &depth);
+
+    uint32_t numCells = *indexNodeNumCells(leaf);
+    uint32_t cellNum = indexLeafLowerBound(leaf, key, length, id);
+    if (cellNum < numCells) {
+        uint8_t existing[COLUMN_EMAIL_SIZE];
+        IndexEntry entry;
+        indexLeafEntry(leaf, cellNum, existing, &entry);
+        if (compareIndexEntries(entry.key, entry.length, entry.id, key, length, id) == 0) {
+            // the cell's bytes stay until the leaf is next laid out again
+            uint16_t* slots = indexNodeSlots(leaf);
+            memmove(slots + cellNum, slots + cellNum + 1, (numCells - cellNum - 1) * INDEX_NODE_SLOT_SIZE);
+            *indexNodeNumCells(leaf) = numCells - 1;
+            markPageDirty(pager, pageNum);
+        }
+    }
+    unpinPage(pager, pageNum);
+}
+
+void indexPopulate(Table* table, IndexColumn column) {
+    Cursor cursor;
+    tableStart(table, &cursor);
+    while (!(cursor.endOfTable)) {
+        void* value = cursorValue(&cursor);
+        const uint8_t* bytes;
+        uint32_t length;
+        uint32_t id;
+        rowColumn(value, column, &bytes, &length);
+        memcpy(&id, value, ID_SIZE);
+        indexInsert(table, column, bytes, length, id);
+        cursorAdvance(&cursor);
+    }
+    closeCursor(&cursor);
+}
+
+void indent(uint32_t level) {
+    for (uint32_t i = 0; i < level; i++) {
+        printf("  ");
+    }
+}
+    
+void printTree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
+    void* node = getPage(pager, page_num);
+    uint32_t num_keys, child;
+
+    switch (getNodeType(node)) {
+        case (NODE_LEAF):
+            num_keys = *leafNodeNumCells(node);
+            indent(indentation_level);
+            printf("- leaf (size %d)\n", num_keys);
+            for (uint32_t i = 0; i < num_keys; i++) {
+            indent(indentation_level + 1);
+            printf("- %d\n", *leafNodeKey(node, i));
+            }
+            break;
+        case (NODE_INTERNAL):
+            num_keys = *internalNodeNumKeys(node);
+            indent(indentation_level);
+            printf("- internal (size %d)\n", num_keys);
+            for (uint32_t i = 0; i < num_keys; i++) {
+            child = *internalNodeChild(node, i);
+            printTree(pager, child, indentation_level + 1);
+
+            indent(indentation_level + 1);
+            printf("- key %d\n", *internalNodeKey(node, i));
+            }
+            child = *internalNodeRightChild(node);
+            printTree(pager, child, indentation_level + 1);
+            break;
+        case (NODE_INDEX_LEAF):
+            num_keys = *indexNodeNumCells(node);
+            indent(indentation_level);
+            printf("- index leaf (size %d, prefix %d)\n", num_keys, *indexLeafPrefixLength(node));
+            for (uint32_t i = 0; i < num_keys; i++) {
+                uint8_t key[COLUMN_EMAIL_SIZE];
+                IndexEntry entry;
+                indexLeafEntry(node, i, key, &entry);
+                indent(indentation_level + 1);
+                printf("- %.*s %d\n", entry.length, entry.key, entry.id);
+            }
+            break;
+        case (NODE_INDEX_INTERNAL):
+            num_keys = *indexNodeNumCells(node);
+            indent(indentation_level);
+            printf("- index internal (size %d)\n", num_keys);
+            for (uint32_t i = 0; i < num_keys; i++) {
+                IndexEntry entry;
+                indexInternalEntry(node, i, &entry);
+                printTree(pager, entry.childPageNum, indentation_level + 1);
+
+                indent(indentation_level + 1);
+                printf("- key %.*s %d\n", entry.length, entry.key, entry.id);
+            }
+            printTree(pager, *indexNodeLink(node), indentation_level + 1);
+            break;
+        case (NODE_FREE):
+            indent(indentation_level);
+            printf("- free page\n");
+            break;
+    }
+    unpinPage(pager, page_num);
+}
+
+bool rowSourceOpen(RowSource* source, const char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL) {
+        printf("Error opening %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    setvbuf(file, NULL, _IOFBF, LOAD_IO_BUFFER_SIZE);
+    rowSourceAttach(source, file);
+    return true;
+}
+
+void rowSourceAttach(RowSource* source, FILE* file) {
+    source->file = file;
+    source->line = NULL;
+    source->lineLen = 0;
+    source->lineNum = 0;
+
+    char magic[ROW_FILE_MAGIC_SIZE];
+    size_t got = fread(magic, 1, ROW_FILE_MAGIC_SIZE, file);
+    if (got == ROW_FILE_MAGIC_SIZE && memcmp(magic, ROW_FILE_MAGIC, ROW_FILE_MAGIC_SIZE) == 0) {
+        source->format = ROW_FORMAT_BINARY;
+    } else {
+        source->format = ROW_FORMAT_CSV;
+        rewind(file);
+    }
+}
+
+void rowSourceClose(RowSource* source) {
+    fclose(source->file);
+    free(source->line);
+}
+
+int rowSourceNext(RowSource* source, Row* row) {
+    if (source->format == ROW_FORMAT_BINARY) {
+        uint8_t lengths[2];
+        if (fread(&(row->id), ID_SIZE, 1, source->file) != 1) {
+            return 0;
+        }
+        bool gotLengths = fread(lengths, 1, 2, source->file) == 2;
+        if (gotLengths && lengths[0] == ROW_FILE_END_LENGTH) {
+            return 0;
+        }
+        if (!gotLengths || lengths[0] > COLUMN_USERNAME_SIZE ||
+            fread(row->username, 1, lengths[0], source->file) != lengths[0] ||
+            fread(row->email, 1, lengths[1], source->file) != lengths[1]) {
+            printf("Truncated or corrupt binary row file.\n");
+            return -1;
+        }
+        row->username[lengths[0]] = 0;
+        row->email[lengths[1]] = 0;
+        return 1;
+    }
+
+    while (true) {
+        ssize_t len = getline(&(source->line), &(source->lineLen), source->file);
+        if (len == -1) {
+            return 0;
+        }
+        source->lineNum++;
+        while (len > 0 && (source->line[len - 1] == '\n' || source->line[len - 1] == '\r')) {
+            source->line[--len] = 0;
+        }
+        if (len == 0) {
+            continue;
+        }
+
+        char* idString = source->line;
+        char* username = strchr(idString, ',');
+        char* email = username ? strchr(username + 1, ',') : NULL;
+        if (email == NULL) {
+            printf("Syntax error on line %lu. Expected id,username,email\n", source->lineNum);
+            return -1;
+        }
+        *username++ = 0;
+        *email++ = 0;
+
+        char* end;
+        long id = strtol(idString, &end, 10);
+        if (end == idString || *end != 0) {
+            if (source->lineNum == 1) {
+                // header line
+                continue;
+            }
+            printf("Syntax error on line %lu. Couldn't parse id\n", source->lineNum);
+            return -1;
+        }
+        if (id < 0) {
+            printf("ID must be positive on line %lu.\n", source->lineNum);
+            return -1;
+        }
+        if (id > UINT32_MAX) {
+            printf("ID is too large on line %lu.\n", source->lineNum);
+            return -1;
+        }
+        if (strlen(username) > COLUMN_USERNAME_SIZE || strlen(email) > COLUMN_EMAIL_SIZE) {
+            printf("String is too long on line %lu.\n", source->lineNum);
+            return -1;
+        }
+
+        row->id = id;
+        strcpy(row->username, username);
+        strcpy(row->email, email);
+        return 1;
+    }
+}
+
+void writeRowRecord(FILE* file, Row* row) {
+    // binary records use the same encoding as rows stored in leaves
+    uint8_t record[ROW_MAX_SIZE];
+    fwrite(record, 1, serializeRow(row, record), file);
+}
+
+void bulkLoaderInit(BulkLoader* loader, Table* table, uint32_t fillPercent) {
+    loader->table = table;
+    loader->leafCapacity = LEAF_NODE_SPACE_FOR_CELLS * fillPercent / 100;
+    loader->internalCapacity = (INTERNAL_NODE_MAX_KEYS + 1) * fillPercent / 100;
+    if (loader->internalCapacity < 2) {
+        loader->internalCapacity = 2;
+    }
+    loader->rowsLoaded = 0;
+    loader->duplicates = 0;
+    loader->numChildren = 0;
+    loader->childCapacity = 1024;
+    loader->children = malloc(sizeof(uint32_t) * loader->childCapacity);
+    loader->keys = malloc(sizeof(uint32_t) * loader->childCapacity);
+
+    // the first leaf is built in the root page and only moved out once a
+    // second leaf is needed, so a small load stays a single-page tree
+    loader->leafPageNum = table->rootPageNum;
+    loader->leaf = getPage(table->pager, loader->leafPageNum);
+    initializeLeafNode(loader->leaf);
+    setNodeRoot(loader->leaf, true);
+}
+
+void* bulkLoaderNewPage(BulkLoader* loader, uint32_t* pageNum) {
+    // getPage on a page past the end extends the pager; returned pinned
+    *pageNum = getUnusedPageNum(loader->table->pager);
+    return getPage(loader->table->pager, *pageNum);
+}
+
+void bulkLoaderAdd(BulkLoader* loader, Row* row) {
+    Pager* pager = loader->table->pager;
+
+    if (loader->rowsLoaded > 0 && row->id <= loader->lastKey) {
+        // sorted input, so anything not increasing repeats an earlier key
+        loader->duplicates++;
+        return;
+    }
+
+    uint32_t numCells = *leafNodeNumCells(loader->leaf);
+    uint32_t valueSize = serializedRowSize(row);
+    uint32_t usedBytes = LEAF_NODE_SPACE_FOR_CELLS - leafNodeFreeSpace(loader->leaf);
+    if (numCells > 0 && usedBytes + LEAF_NODE_CELL_OVERHEAD + valueSize > loader->leafCapacity) {
+        if (loader->leafPageNum == loader->table->rootPageNum) {
+            // move the first leaf out of the root page
+            uint32_t movedPageNum;
+            void* moved = bulkLoaderNewPage(loader, &movedPageNum);
+            memcpy(moved, loader->leaf, PAGE_SIZE);
+            setNodeRoot(moved, false);
+            markPageDirty(pager, loader->leafPageNum);
+            unpinPage(pager, loader->leafPageNum);
+            loader->leafPageNum = movedPageNum;
+            loader->leaf = moved;
+        }
+
+        uint32_t nextPageNum;
+        void* next = bulkLoaderNewPage(loader, &nextPageNum);
+        initializeLeafNode(next);
+        *leafNodeNextLeaf(loader->leaf) = nextPageNum;
+
+        if (loader->numChildren == loader->childCapacity) {
+            loader->childCapacity *= 2;
+            loader->children = realloc(loader->children, sizeof(uint32_t) * loader->childCapacity);
+            loader->keys = realloc(loader->keys, sizeof(uint32_t) * loader->childCapacity);
+        }
+        loader->children[loader->numChildren] = loader->leafPageNum;
+        loader->keys[loader->numChildren] = loader->lastKey;
+        loader->numChildren++;
+
+        markPageDirty(pager, loader->leafPageNum);
+        unpinPage(pager, loader->leafPageNum);
+        loader->leafPageNum = nextPageNum;
+        loader->leaf = next;
+        numCells = 0;
+    }
+
+    serializeRow(row, leafNodeAllocateCell(loader->leaf, numCells, row->id, valueSize));
+    loader->lastKey = row->id;
+    loader->rowsLoaded++;
+}
+
+void bulkLoaderFinish(BulkLoader* loader) {
+    Table* table = loader->table;
+    Pager* pager = table->pager;
+
+    markPageDirty(pager, loader->leafPageNum);
+    unpinPage(pager, loader->leafPageNum);
+    if (loader->leafPageNum == table->rootPageNum) {
+        // everything fit in the root leaf
+        free(loader->children);
+        free(loader->keys);
+        return;
+    }
+
+    if (loader->numChildren == loader->childCapacity) {
+        loader->childCapacity += 1;
+        loader->children = realloc(loader->children, sizeof(uint32_t) * loader->childCapacity);
+        loader->keys = realloc(loader->keys, sizeof(uint32_t) * loader->childCapacity);
+    }
+    loader->children[loader->numChildren] = loader->leafPageNum;
+    loader->keys[loader->numChildren] = loader->lastKey;
+    loader->numChildren++;
+
+    // pack each level into internal nodes until one node covers it all.
+    // nodes in a level share children evenly so none is left underfull.
+    uint32_t count = loader->numChildren;
+    while (true) {
+        uint32_t numNodes = (count + loader->internalCapacity - 1) / loader->internalCapacity;
+        uint32_t next = 0;
+        uint32_t consumed = 0;
+        for (uint32_t n = 0; n < numNodes; n++) {
+            uint32_t take = count / numNodes + (n < count % numNodes ? 1 : 0);
+            uint32_t pageNum = table->rootPageNum;
+            void* node;
+            if (numNodes == 1) {
+                node = getPage(pager, pageNum);
+            } else {
+                node = bulkLoaderNewPage(loader, &pageNum);
+            }
+            initializeInternalNode(node);
+            setNodeRoot(node, numNodes == 1);
+            *internalNodeNumKeys(node) = take - 1;
+            for (uint32_t i = 0; i < take - 1; i++) {
+                *internalNodeCell(node, i) = loader->children[consumed + i];
+                *internalNodeKey(node, i) = loader->keys[consumed + i];
+            }
+            *internalNodeRightChild(node) = loader->children[consumed + take - 1];
+            markPageDirty(pager, pageNum);
+            unpinPage(pager, pageNum);
+
+            // each level is no longer than the one below it, so it can
+            // be rewritten in place
+            loader->children[next] = pageNum;
+            loader->keys[next] = loader->keys[consumed + take - 1];
+            next++;
+            consumed += take;
+        }
+        if (numNodes == 1) {
+            break;
+        }
+        count = next;
+    }
+
+    free(loader->children);
+    free(loader->keys);
+}
+
+int compareRowIds(const void* a, const void* b) {
+    uint32_t left = ((const Row*)a)->id;
+    uint32_t right = ((const Row*)b)->id;
+    return (left > right) - (left < right);
+}
+
+bool sortRowsExternally(RowSource* source, BulkLoader* loader) {
+    Row* run = malloc(sizeof(Row) * LOAD_SORT_RUN_ROWS);
+    FILE** runFiles = NULL;
+    uint32_t numRuns = 0;
+    bool ok = true;
+
+    // phase 1: cut the input into sorted runs
+    while (true) {
+        uint32_t numRows = 0;
+        int status = 1;
+        while (numRows < LOAD_SORT_RUN_ROWS && (status = rowSourceNext(source, &run[numRows])) == 1) {
+            numRows++;
+        }
+        if (status == -1) {
+            ok = false;
+            break;
+        }
+        if (numRows == 0) {
+            break;
+        }
+        qsort(run, numRows, sizeof(Row), compareRowIds);
+
+        FILE* runFile = tmpfile();
+        if (runFile == NULL) {
+            printf("Error creating sort run file: %s\n", strerror(errno));
+            ok = false;
+            break;
+        }
+        setvbuf(runFile, NULL, _IOFBF, LOAD_IO_BUFFER_SIZE);
+        fwrite(ROW_FILE_MAGIC, 1, ROW_FILE_MAGIC_SIZE, runFile);
+        for (uint32_t i = 0; i < numRows; i++) {
+            writeRowRecord(runFile, &run[i]);
+        }
+        if (fflush(runFile) != 0) {
+            printf("Error writing sort run file: %s\n", strerror(errno));
+            fclose(runFile);
+            ok = false;
+            break;
+        }
+        rewind(runFile);
+        runFiles = realloc(runFiles, sizeof(FILE*) * (numRuns + 1));
+        runFiles[numRuns++] = runFile;
+        if (status == 0) {
+            break;
+        }
+    }
+    free(run);
+
+    if (!ok) {
+        for (uint32_t i = 0; i < numRuns; i++) {
+            fclose(runFiles[i]);
+        }
+        free(runFiles);
+        return false;
+    }
+
+    // phase 2: k-way merge of the runs through a binary min-heap on id
+    RowSource* runs = malloc(sizeof(RowSource) * numRuns);
+    Row* heads = malloc(sizeof(Row) * numRuns);
+    uint32_t* heap = malloc(sizeof(uint32_t) * numRuns);
+    uint32_t heapSize = 0;
+    for (uint32_t i = 0; i < numRuns; i++) {
+        rowSourceAttach(&runs[i], runFiles[i]);
+        if (rowSourceNext(&runs[i], &heads[i]) == 1) {
+            // sift up
+            uint32_t pos = heapSize++;
+            while (pos > 0 && heads[heap[(pos - 1) / 2]].id > heads[i].id) {
+                heap[pos] = heap[(pos - 1) / 2];
+                pos = (pos - 1) / 2;
+            }
+            heap[pos] = i;
+        }
+    }
+
+    while (heapSize > 0) {
+        uint32_t top = heap[0];
+        bulkLoaderAdd(loader, &heads[top]);
+
+        if (rowSourceNext(&runs[top], &heads[top]) != 1) {
+            heap[0] = heap[--heapSize];
+        }
+        if (heapSize == 0) {
+            break;
+        }
+        // sift down
+        uint32_t pos = 0;
+        uint32_t item = heap[0];
+        while (true) {
+            uint32_t child = pos * 2 + 1;
+            if (child >= heapSize) {
+                break;
+            }
+            if (child + 1 < heapSize && heads[heap[child + 1]].id < heads[heap[child]].id) {
+                child++;
+            }
+            if (heads[heap[child]].id >= heads[item].id) {
+                break;
+            }
+            heap[pos] = heap[child];
+            pos = child;
+        }
+        heap[pos] = item;
+    }
+
+    for (uint32_t i = 0; i < numRuns; i++) {
+        rowSourceClose(&runs[i]);
+    }
+    free(runs);
+    free(heads);
+    free(heap);
+    free(runFiles);
+    return true;
+}
+
+void executeLoad(Table* table, const char* filename, uint32_t fillPercent) {
+    RowSource source;
+    Row row;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    void* root = getPage(table->pager, table->rootPageNum);
+    bool tableEmpty = getNodeType(root) == NODE_LEAF && *leafNodeNumCells(root) == 0;
+    unpinPage(table->pager, table->rootPageNum);
+
+    if (!rowSourceOpen(&source, filename)) {
+        return;
+    }
+
+    uint64_t rowsLoaded = 0;
+    uint64_t duplicates = 0;
+    if (!tableEmpty) {
+        // existing rows: bottom-up building doesn't apply, insert one by one
+        Statement statement;
+        statement.type = STATEMENT_INSERT;
+        int status;
+        while ((status = rowSourceNext(&source, &(statement.rowToInsert))) == 1) {
+            if (executeInsert(&statement, table) == EXECUTE_DUPLICATE_KEY) {
+                duplicates++;
+            } else {
+                rowsLoaded++;
+            }
+        }
+        rowSourceClose(&source);
+        if (status == -1) {
+            printf("Load stopped after %lu rows.\n", rowsLoaded);
+            return;
+        }
+    } else {
+        // one cheap pass to validate the input and see if it is already sorted
+        bool sorted = true;
+        uint32_t lastKey = 0;
+        uint64_t numRows = 0;
+        int status;
+        while ((status = rowSourceNext(&source, &row)) == 1) {
+            if (numRows > 0 && row.id < lastKey) {
+                sorted = false;
+            }
+            lastKey = row.id;
+            numRows++;
+        }
+        rowSourceClose(&source);
+        if (status == -1) {
+            printf("Nothing loaded.\n");
+            return;
+        }
+        if (!rowSourceOpen(&source, filename)) {
+            return;
+        }
+
+        BulkLoader loader;
+        bulkLoaderInit(&loader, table, fillPercent);
+        if (sorted) {
+            while (rowSourceNext(&source, &row) == 1) {
+                bulkLoaderAdd(&loader, &row);
+            }
+        } else if (!sortRowsExternally(&source, &loader)) {
+            // input was validated above, so only temp file I/O can fail here
+            printf("External sort failed; table may be partially loaded.\n");
+        }
+        rowSourceClose(&source);
+        bulkLoaderFinish(&loader);
+        tableSetAppendHint(table, 0, 0);
+        rowsLoaded = loader.rowsLoaded;
+        duplicates = loader.duplicates;
+
+        // the loader bypasses executeInsert; the indexes were empty with
+        // the table, so fill them from what it built
+        for (uint32_t i = 0; i < INDEX_COUNT; i++) {
+            if (table->indexRoots[i] != 0) {
+                indexPopulate(table, i);
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Loaded %lu rows in %.2fs (%lu duplicates skipped).\n", rowsLoaded, seconds, duplicates);
 }
 
-void cursorAdvance(Cursor* cursor) {
-    uint32_t pageNum = cursor->pageNum;
-    void* node = getPage(cursor->table->pager, pageNum);
+void executeVacuum(Table* table) {
+    Pager* pager = table->pager;
+    uint32_t pagesBefore = pager->numPages;
 
-    cursor->cellNum += 1;
-    if (cursor->cellNum >= (*leafNodeNumCells(node))) {
-        // advance to leaf node
-        uint32_t nextPageNum = *leafNodeNextLeaf(node);
-        if (nextPageNum == 0) {
-            cursor->endOfTable = true;
-        } else {
-            cursor->pageNum = nextPageNum;
-            cursor->cellNum = 0;
+    // the copy is built beside the file in the same format, leaves packed
+    // full. nothing sees it until it is complete and synced, so it needs
+    // no log
+    char* copyName = malloc(strlen(table->filename) + 8);
+    sprintf(copyName, "%s-vacuum", table->filename);
+    unlink(copyName);
+    DbOptions options = table->options;
+    options.useWal = false;
+    options.useCompression = (pager->locations != NULL);
+    Table* copy = dbOpen(copyName, &options);
+
+    BulkLoader loader;
+    bulkLoaderInit(&loader, copy, 100);
+    Row row;
+    Cursor cursor;
+    tableStart(table, &cursor);
+    while (!(cursor.endOfTable)) {
+        deserializeRow(cursorValue(&cursor), &row);
+        bulkLoaderAdd(&loader, &row);
+        cursorAdvance(&cursor);
+    }
+    closeCursor(&cursor);
+    bulkLoaderFinish(&loader);
+    for (uint32_t i = 0; i < INDEX_COUNT; i++) {
+        if (table->indexRoots[i] != 0) {
+            indexCreate(copy, i);
         }
     }
-}
+    uint32_t pagesAfter = copy->pager->numPages;
+    dbClose(copy);
 
-void printRow(Row* row) {
-    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
-}
+    int fd = open(copyName, O_RDONLY);
+    if (fd == -1 || fsync(fd) == -1) {
+        perror("Error syncing vacuumed copy\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
 
-uint32_t* leafNodeNumCells(void* node) {
-    return node + LEAF_NODE_NUM_CELLS_OFFSET;
-}
+    // the old file's log is checkpointed and removed as it closes, then the
+    // copy takes its name
+    dbClosePager(table);
+    if (rename(copyName, table->filename) == -1) {
+        perror("Error replacing db file\n");
+        exit(EXIT_FAILURE);
+    }
+    free(copyName);
+    table->pager = pagerOpen(table->filename, &(table->options));
+    dbReadHeader(table);
 
-void* leafNodeCell(void* node, uint32_t cellNum) {
-    return node + LEAF_NODE_HEADER_SIZE + cellNum * LEAF_NODE_CELL_SIZE;
+    printf("Vacuumed %d pages down to %d.\n", pagesBefore, pagesAfter);
 }
 
-uint32_t* leafNodeKey(void* node, uint32_t cellNum) {
-    return leafNodeCell(node, cellNum);
-}
+void batchRun(Table* table, int fileDescriptor) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-void* leafNodeValue(void* node, uint32_t cellNum) {
-    return leafNodeCell(node, cellNum) + LEAF_NODE_KEY_SIZE;
-}
+    InputBuffer* input = newInputBuffer();
+    input->bufferLen = BATCH_READ_SIZE * 2;
+    input->buffer = malloc(input->bufferLen);
+    OutputBuffer* output = newOutputBuffer();
+    outputReserve(output, OUTPUT_FLUSH_SIZE);
+    output->fileDescriptor = STDOUT_FILENO;
+    uint64_t numStatements = 0;
+    bool atEnd = false;
+    bool exiting = false;
 
-uint32_t* leafNodeNextLeaf(void* node) {
-    return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+    while (!atEnd && !exiting) {
+        // keep a spare byte so takeLine can terminate an unterminated last line
+        if (input->bufferLen - input->inputLen < BATCH_READ_SIZE + 1) {
+            input->bufferLen *= 2;
+            input->buffer = realloc(input->buffer, input->bufferLen);
+        }
+        ssize_t bytesRead = read(fileDescriptor, input->buffer + input->inputLen, BATCH_READ_SIZE);
+        if (bytesRead == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error reading input\n");
+            exit(EXIT_FAILURE);
+        }
+        input->inputLen += bytesRead;
+        atEnd = (bytesRead == 0);
+
+        // statements are parsed in place, straight out of the read buffer
+        size_t position = 0;
+        InputBuffer line;
+        while (takeLine(input, &position, atEnd, &line)) {
+            if (line.buffer[0] == '.') {
+                // meta commands print directly, so everything before them
+                // goes out first
+                batchFlush(table, output);
+                if (strcmp(line.buffer, ".exit") == 0) {
+                    exiting = true;
+                    break;
+                }
+                if (execMetaCommand(&line, table, output) == META_COMMAND_UNRECOGNIZED) {
+                    printf("Unrecognized command %s\n", line.buffer);
+                }
+                continue;
+            }
+            if (line.inputLen == 0) {
+                continue;
+            }
+            if (output->length > 0 && strncmp(line.buffer, "select", 6) == 0) {
+                // a select streams its rows out as it goes, so replies it
+                // would overtake are committed and sent first
+                batchFlush(table, output);
+            }
+            runStatement(&line, table, output);
+            numStatements++;
+            if (output->length >= OUTPUT_FLUSH_SIZE) {
+                batchFlush(table, output);
+            }
+        }
+        memmove(input->buffer, input->buffer + position, input->inputLen - position);
+        input->inputLen -= position;
+
+        // one commit per block read, not per statement
+        batchFlush(table, output);
+    }
+
+    closeInputBuffer(input);
+    closeOutputBuffer(output);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Ran %lu statements in %.3fs (%.0f per second).\n",
+        numStatements, seconds, seconds > 0 ? numStatements / seconds : 0);
 }
 
-void initializeLeafNode(void* node) {
-    setNodeType(node, NODE_LEAF);
-    setNodeRoot(node, false);
-    *leafNodeNumCells(node) = 0;
-    *leafNodeNextLeaf(node) = 0;
+void batchFlush(Table* table, OutputBuffer* output) {
+    // replies only go out once what they acknowledge is durable
+    dbCommit(table);
+    outputFlush(output);
 }
 
-void leafNodeInsert(Cursor* cursor, uint32_t key, Row* value) {
-    void* node = getPage(cursor->table->pager, cursor->pageNum);
+volatile sig_atomic_t serverStopping = 0;
 
-    uint32_t numCells = *leafNodeNumCells(node);
-    if (numCells >= LEAF_NODE_MAX_CELLS) {
-        // node full
-        leafNodeSplitAndInsert(cursor, key, value);
-        return;
-    }
+void serverHandleSignal(int sig) {
+    (void)sig;
+    serverStopping = 1;
+}
 
-    if (cursor->cellNum < numCells) {
-        // make room for new cell
-        for (uint32_t i = numCells; i > cursor->cellNum; i--) {
-            memcpy(leafNodeCell(node, i), leafNodeCell(node, i - 1), LEAF_NODE_CELL_SIZE);
-        }
+void serverRun(Table* table, const char* address) {
+    int listenFd = serverListen(address);
+    int epollFd = epoll_create1(0);
+    if (epollFd == -1) {
+        perror("Error creating epoll instance\n");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event) == -1) {
+        perror("Error watching listening socket\n");
+        exit(EXIT_FAILURE);
     }
 
-    *(leafNodeNumCells(node)) += 1;
-    *(leafNodeKey(node, cursor->cellNum)) = key;
-    serializeRow(value, leafNodeValue(node, cursor->cellNum));
-}
+    // no SA_RESTART, so a signal interrupts epoll_wait and we notice it
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = serverHandleSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    printf("Listening on %s\n", address);
+    fflush(stdout);
 
-void leafNodeSplitAndInsert(Cursor* cursor, uint32_t key, Row* value) {
-    // create new node
-    void* oldNode = getPage(cursor->table->pager, cursor->pageNum);
-    uint32_t newPageNum = getUnusedPageNum(cursor->table->pager);
-    void* newNode = getPage(cursor->table->pager, newPageNum);
-    initializeLeafNode(newNode);
-    *leafNodeNextLeaf(newNode) = *leafNodeNextLeaf(oldNode);
-    *leafNodeNextLeaf(oldNode) = newPageNum;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    Connection* ready[SERVER_MAX_EVENTS];
+    while (!serverStopping) {
+        int numEvents = epoll_wait(epollFd, events, SERVER_MAX_EVENTS, -1);
+        if (numEvents == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error waiting for events\n");
+            exit(EXIT_FAILURE);
+        }
 
-    // split keys between oldNode and newNode
-    for (uint32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-        void* destinationNode;
-        if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-            destinationNode = newNode;
-        } else {
-            destinationNode = oldNode;
+        uint32_t numReady = 0;
+        for (int i = 0; i < numEvents; i++) {
+            Connection* connection = events[i].data.ptr;
+            if (connection == NULL) {
+                serverAccept(epollFd, listenFd);
+                continue;
+            }
+            if ((events[i].events & EPOLLERR) ||
+                ((events[i].events & EPOLLOUT) && !connectionFlush(connection))) {
+                connectionClose(epollFd, connection);
+                continue;
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLHUP)) && !connectionRead(connection)) {
+                connection->closing = true;
+            }
+            connectionProcess(connection, table);
+            ready[numReady++] = connection;
         }
-        uint32_t indexWithinNode = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-        void* destination = leafNodeCell(destinationNode, indexWithinNode);
 
-        if (i == cursor->cellNum) {
-            serializeRow(value, leafNodeValue(destinationNode, indexWithinNode));
-            *leafNodeKey(destinationNode, indexWithinNode) = key;
-        } else if (i > cursor->cellNum) {
-            memcpy(destination, leafNodeCell(oldNode, i-1), LEAF_NODE_CELL_SIZE);
-        } else {
-            memcpy(destination, leafNodeCell(oldNode, i), LEAF_NODE_CELL_SIZE);
+        // one commit makes this pass's statements durable before any reply
+        // to them leaves
+        dbCommit(table);
+        for (uint32_t i = 0; i < numReady; i++) {
+            if (!connectionFlush(ready[i])) {
+                connectionClose(epollFd, ready[i]);
+            } else {
+                connectionUpdate(epollFd, ready[i]);
+            }
         }
     }
 
-    // update cell count on leaf nodes
-    *(leafNodeNumCells(oldNode)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leafNodeNumCells(newNode)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+    // connections still open are dropped with the process
+    close(epollFd);
+    close(listenFd);
+    if (strchr(address, ':') == NULL) {
+        unlink(address);
+    }
+}
 
-    // update node's parent
-    if (isNodeRoot(oldNode)) {
-        return createNewRoot(cursor->table, newPageNum);
+int serverListen(const char* address) {
+    const char* colon = strrchr(address, ':');
+    int fd;
+    if (colon == NULL) {
+        // a Unix socket path; a stale socket file from a previous run is
+        // replaced
+        struct sockaddr_un local;
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(local.sun_path)) {
+            printf("Socket path %s is too long.\n", address);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(local.sun_path, address);
+        unlink(address);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd == -1 || bind(fd, (struct sockaddr*)&local, sizeof(local)) == -1) {
+            perror("Error binding socket\n");
+            exit(EXIT_FAILURE);
+        }
     } else {
-        printf("will implement updating parent after split here\n");
-        exit(EXIT_FAILURE);
+        char host[256];
+        size_t hostLength = colon - address;
+        if (hostLength >= sizeof(host)) {
+            printf("Host name in %s is too long.\n", address);
+            exit(EXIT_FAILURE);
+        }
+        memcpy(host, address, hostLength);
+        host[hostLength] = 0;
+
+        struct addrinfo hints;
+        struct addrinfo* result;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        int status = getaddrinfo(hostLength > 0 ? host : NULL, colon + 1, &hints, &result);
+        if (status != 0) {
+            printf("Can't resolve %s: %s\n", address, gai_strerror(status));
+            exit(EXIT_FAILURE);
+        }
+        fd = socket(result->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        int on = 1;
+        if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+            bind(fd, result->ai_addr, result->ai_addrlen) == -1) {
+            perror("Error binding socket\n");
+            exit(EXIT_FAILURE);
+        }
+        freeaddrinfo(result);
     }
-}
 
-bool isNodeRoot(void* node) {
-    uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
-    return (bool)value;
-}
-    
-void setNodeRoot(void* node, bool is_root) {
-    uint8_t value = is_root;
-    *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+    if (listen(fd, SOMAXCONN) == -1) {
+        perror("Error listening on socket\n");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
 }
 
-void createNewRoot(Table* table, uint32_t rightChildPageNum) {
-    void* root = getPage(table->pager, table->rootPageNum);
-    void* rightChild = getPage(table->pager, rightChildPageNum);
-    uint32_t leftChildPageNum = getUnusedPageNum(table->pager);
-    void* leftChild = getPage(table->pager, leftChildPageNum);
-
-    memcpy(leftChild, root, PAGE_SIZE);
-    setNodeRoot(leftChild, false);
+void serverAccept(int epollFd, int listenFd) {
+    while (true) {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Error accepting connection\n");
+            }
+            return;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        // replies are already batched, so don't let Nagle hold them back.
+        // this fails harmlessly on Unix sockets
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
 
-    initializeInternalNode(root);
-    setNodeRoot(root, true);
-    *internalNodeNumKeys(root) = 1;
-    *internalNodeChild(root, 0) = leftChildPageNum;
-    uint32_t leftChildMaxKey = getNodeMaxKey(leftChild);
-    *internalNodeKey(root, 0) = leftChildMaxKey;
-    *internalNodeRightChild(root) = rightChildPageNum;
-}
+        Connection* connection = malloc(sizeof(Connection));
+        connection->fileDescriptor = fd;
+        connection->input = newInputBuffer();
+        connection->input->bufferLen = SERVER_READ_SIZE;
+        connection->input->buffer = malloc(connection->input->bufferLen);
+        connection->output = newOutputBuffer();
+        connection->output->client = true;
+        connection->outputSent = 0;
+        connection->closing = false;
+        connection->events = EPOLLIN;
 
-void initializeInternalNode(void* node) {
-    setNodeType(node, NODE_INTERNAL);
-    setNodeRoot(node, false);
-    *internalNodeNumKeys(node) = 0;
+        struct epoll_event event;
+        event.events = connection->events;
+        event.data.ptr = connection;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            perror("Error watching connection\n");
+            close(fd);
+            closeInputBuffer(connection->input);
+            closeOutputBuffer(connection->output);
+            free(connection);
+        }
+    }
 }
 
-uint32_t* internalNodeNumKeys(void* node) {
-    return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
-}
-    
-uint32_t* internalNodeRightChild(void* node) {
-    return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+bool connectionRead(Connection* connection) {
+    InputBuffer* input = connection->input;
+    while (true) {
+        if (input->bufferLen - input->inputLen < SERVER_READ_SIZE / 2) {
+            input->bufferLen *= 2;
+            input->buffer = realloc(input->buffer, input->bufferLen);
+        }
+        ssize_t bytesRead = read(connection->fileDescriptor, input->buffer + input->inputLen,
+            input->bufferLen - input->inputLen - 1);
+        if (bytesRead > 0) {
+            input->inputLen += bytesRead;
+            if (input->inputLen > SERVER_MAX_LINE && memchr(input->buffer, '\n', input->inputLen) == NULL) {
+                return false;
+            }
+            // leave the rest for the next pass so one client can't hog it
+            if (input->inputLen >= SERVER_MAX_PENDING) {
+                return true;
+            }
+            continue;
+        }
+        if (bytesRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (bytesRead == -1 && errno == EINTR) {
+            continue;
+        }
+        return false;
+    }
 }
 
-uint32_t* internalNodeCell(void* node, uint32_t cellNum) {
-    return node + INTERNAL_NODE_HEADER_SIZE + cellNum * INTERNAL_NODE_CELL_SIZE;
-}
+void connectionProcess(Connection* connection, Table* table) {
+    InputBuffer* input = connection->input;
+    OutputBuffer* output = connection->output;
+    size_t start = 0;
 
-uint32_t* internalNodeChild(void* node, uint32_t childNum) {
-    uint32_t numKeys = *internalNodeNumKeys(node);
-    if (childNum > numKeys) {
-        printf("Tried to access child_num %d > num_keys %d\n", childNum, numKeys);
-        exit(EXIT_FAILURE);
-    } else if (childNum == numKeys) {
-        return internalNodeRightChild(node);
-    } else {
-        return internalNodeCell(node, childNum);
+    // statements are parsed in place, straight out of the read buffer
+    InputBuffer statementInput;
+    while (!serverStopping && output->length - connection->outputSent < SERVER_MAX_PENDING &&
+        takeLine(input, &start, connection->closing, &statementInput)) {
+        char* line = statementInput.buffer;
+        if (line[0] == '.') {
+            // most meta commands act on the server's own terminal and files,
+            // so clients only get to say goodbye, pick an output format and
+            // read or reset the counters
+            if (strcmp(line, ".exit") == 0) {
+                connection->closing = true;
+                start = input->inputLen;
+                break;
+            }
+            if (strncmp(line, ".mode", 5) == 0) {
+                executeMode(&statementInput, output);
+                continue;
+            }
+            if (strcmp(line, ".stats") == 0 || strncmp(line, ".stats ", 7) == 0) {
+                executeStats(&statementInput, table, output);
+                continue;
+            }
+            outputPrintf(output, "Unrecognized command %s\n", line);
+            continue;
+        }
+        if (strncmp(line, "select", 6) == 0) {
+            connectionSelect(connection, &statementInput, table);
+            if (output->failed) {
+                // the client stopped reading or hung up mid-result
+                connection->closing = true;
+                start = input->inputLen;
+                break;
+            }
+        } else if (statementInput.inputLen > 0) {
+            runStatement(&statementInput, table, output);
+        }
     }
-}
 
-uint32_t* internalNodeKey(void* node, uint32_t keyNum) {
-    return internalNodeCell(node, keyNum) + INTERNAL_NODE_CHILD_SIZE;
+    memmove(input->buffer, input->buffer + start, input->inputLen - start);
+    input->inputLen -= start;
 }
 
-uint32_t getNodeMaxKey(void* node) {
-    switch (getNodeType(node)) {
-        case NODE_INTERNAL:
-          return *internalNodeKey(node, *internalNodeNumKeys(node) - 1);
-        case NODE_LEAF:
-          return *leafNodeKey(node, *leafNodeNumCells(node) - 1);
+void connectionSelect(Connection* connection, InputBuffer* statementInput, Table* table) {
+    // rows go out before the pass's commit, so everything they could
+    // overtake or show is made durable first: this pass's statements from
+    // every connection, and this one's replies still waiting to be sent
+    OutputBuffer* output = connection->output;
+    dbCommit(table);
+    output->length -= connection->outputSent;
+    memmove(output->data, output->data + connection->outputSent, output->length);
+    connection->outputSent = 0;
+
+    output->fileDescriptor = connection->fileDescriptor;
+    outputFlush(output);
+    if (!output->failed) {
+        runStatement(statementInput, table, output);
     }
+    output->fileDescriptor = -1;
 }
 
-void indent(uint32_t level) {
-    for (uint32_t i = 0; i < level; i++) {
-        printf("  ");
+bool connectionFlush(Connection* connection) {
+    OutputBuffer* output = connection->output;
+    while (connection->outputSent < output->length) {
+        ssize_t bytesWritten = send(connection->fileDescriptor, output->data + connection->outputSent,
+            output->length - connection->outputSent, MSG_NOSIGNAL);
+        if (bytesWritten == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        connection->outputSent += bytesWritten;
     }
+    output->length = 0;
+    connection->outputSent = 0;
+    return true;
 }
-    
-void printTree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
-    void* node = getPage(pager, page_num);
-    uint32_t num_keys, child;
 
-    switch (getNodeType(node)) {
-        case (NODE_LEAF):
-            num_keys = *leafNodeNumCells(node);
-            indent(indentation_level);
-            printf("- leaf (size %d)\n", num_keys);
-            for (uint32_t i = 0; i < num_keys; i++) {
-            indent(indentation_level + 1);
-            printf("- %d\n", *leafNodeKey(node, i));
-            }
-            break;
-        case (NODE_INTERNAL):
-            num_keys = *internalNodeNumKeys(node);
-            indent(indentation_level);
-            printf("- internal (size %d)\n", num_keys);
-            for (uint32_t i = 0; i < num_keys; i++) {
-            child = *internalNodeChild(node, i);
-            printTree(pager, child, indentation_level + 1);
+void connectionUpdate(int epollFd, Connection* connection) {
+    bool unsent = connection->outputSent < connection->output->length;
+    if (connection->closing && !unsent) {
+        connectionClose(epollFd, connection);
+        return;
+    }
 
-            indent(indentation_level + 1);
-            printf("- key %d\n", *internalNodeKey(node, i));
-            }
-            child = *internalNodeRightChild(node);
-            printTree(pager, child, indentation_level + 1);
-            break;
+    // statements held back while output was backed up are picked up by
+    // the next writable event, which comes at once if the socket has room
+    bool backlog = memchr(connection->input->buffer, '\n', connection->input->inputLen) != NULL;
+    uint32_t events = 0;
+    if (!connection->closing && connection->input->inputLen < SERVER_MAX_PENDING) {
+        events |= EPOLLIN;
+    }
+    if (unsent || backlog) {
+        events |= EPOLLOUT;
+    }
+    if (events == connection->events) {
+        return;
+    }
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = connection;
+    if (epoll_ctl(epollFd, EPOLL_CTL_MOD, connection->fileDescriptor, &event) == -1) {
+        perror("Error watching connection\n");
+        connectionClose(epollFd, connection);
+        return;
     }
+    connection->events = events;
+}
+
+void connectionClose(int epollFd, Connection* connection) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->fileDescriptor, NULL);
+    close(connection->fileDescriptor);
+    closeInputBuffer(connection->input);
+    closeOutputBuffer(connection->output);
+    free(connection);
 }
 
+// benchmarks include this file directly and supply their own main
+#ifndef DB_NO_MAIN
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
+    DbOptions options;
+    defaultDbOptions(&options);
+
+    static struct option longOptions[] = {
+        {"frames", required_argument, NULL, 'F'},
+        {"mmap", no_argument, NULL, 'm'},
+        {"no-wal", no_argument, NULL, 'W'},
+        {"dirty-limit", required_argument, NULL, 'D'},
+        {"compress", no_argument, NULL, 'c'},
+        {"direct", no_argument, NULL, 'd'},
+        {"listen", required_argument, NULL, 'l'},
+        {"script", required_argument, NULL, 'f'},
+        {NULL, 0, NULL, 0}
+    };
+    const char* listenAddress = NULL;
+    const char* scriptFilename = NULL;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case ('F'):
+                options.numFrames = strtoul(optarg, NULL, 10);
+                if (options.numFrames < PAGER_MIN_FRAMES) {
+                    printf("Buffer pool needs at least %d frames.\n", PAGER_MIN_FRAMES);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case ('m'):
+                options.useMmap = true;
+                break;
+            case ('W'):
+                options.useWal = false;
+                break;
+            case ('D'):
+                options.dirtyLimit = strtoul(optarg, NULL, 10);
+                break;
+            case ('c'):
+                options.useCompression = true;
+                break;
+            case ('d'):
+                options.useDirectIo = true;
+                break;
+            case ('l'):
+                listenAddress = optarg;
+                break;
+            case ('f'):
+                scriptFilename = optarg;
+                break;
+            default:
+                printf("Usage: %s [--frames N] [--mmap] [--no-wal] [--dirty-limit N] [--compress] [--direct] [--listen address] [-f script] <filename>\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc) {
         printf("Must state a database filename.\n");
         exit(EXIT_FAILURE);
     }
 
-    char* filename = argv[1];
-    Table* table = dbOpen(filename);
+    char* filename = argv[optind];
+    Table* table = dbOpen(filename, &options);
+
+    if (listenAddress != NULL) {
+        serverRun(table, listenAddress);
+        dbClose(table);
+        return 0;
+    }
+
+    // scripts and piped input run without prompts or per-line round trips
+    if (scriptFilename != NULL || !isatty(STDIN_FILENO)) {
+        int fd = STDIN_FILENO;
+        if (scriptFilename != NULL) {
+            fd = open(scriptFilename, O_RDONLY);
+            if (fd == -1) {
+                printf("Error opening script %s\n", scriptFilename);
+                exit(EXIT_FAILURE);
+            }
+        }
+        batchRun(table, fd);
+        dbClose(table);
+        return 0;
+    }
 
     // infinite read-execute-print loop (REPL)
     InputBuffer* inputBuffer = newInputBuffer();
+    OutputBuffer* output = newOutputBuffer();
+    output->fileDescriptor = STDOUT_FILENO;
     while (true) {
         printPrompt();
         readInput(inputBuffer);
 
         // handle meta commands
         if (inputBuffer->buffer[0] == '.') {
-            switch (execMetaCommand(inputBuffer, table)) {
+            switch (execMetaCommand(inputBuffer, table, output)) {
                 case (META_COMMAND_SUCCESS):
+                    dbCommit(table);
+                    outputFlush(output);
                     continue;
                 case (META_COMMAND_UNRECOGNIZED):
                     printf("Unrecognized command %s\n", inputBuffer->buffer);
@@ -619,35 +6251,10 @@ int main(int argc, char* argv[]) {
             }
         }
 
-        // prepare and execute the statement
-        Statement statement;
-        switch (prepareStatement(inputBuffer, &statement)) {
-            case (PREPARE_SUCCESS):
-                break;
-            case (PREPARE_NEGATIVE_ID):
-                printf("ID must be positive.\n");
-                continue;
-            case (PREPARE_STRING_TOO_LONG):
-                printf("String is too long.\n");
-                continue;
-            case (PREPARE_SYNTAX_ERROR):
-                printf("Syntax error. Couldn't parse statement\n");
-                continue;
-            case (PREPARE_UNRECOGNIZED):
-                printf("Unrecognized keyword at start of '%s'\n", inputBuffer->buffer);
-                continue;
-        }
-
-        switch (executeStatement(&statement, table)) {
-            case (EXECUTE_SUCCESS):
-                printf("Executed.\n");
-                break;
-            case (EXECUTE_DUPLICATE_KEY):
-                printf("Error: Duplicate key.\n");
-                break;
-            case (EXECUTE_TABLE_FULL):
-                printf("Error: Table full.\n");
-                break;
-        }
+        // acknowledge only once the statement is durable
+        runStatement(inputBuffer, table, output);
+        dbCommit(table);
+        outputFlush(output);
     }
-}
\ No newline at end of file
+}
+#endif // DB_NO_MAIN
@@ -1,6 +1,9 @@
 #ifndef DB_H_
 #define DB_H_
 
+// O_DIRECT is a Linux extension
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -9,6 +12,23 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 typedef struct {
     char* buffer;
@@ -16,6 +36,59 @@ typedef struct {
     size_t inputLen;
 } InputBuffer;
 
+// how rows are written out by select, or read in by .load
+typedef enum {
+    ROW_FORMAT_TEXT,
+    ROW_FORMAT_CSV,
+    ROW_FORMAT_BINARY
+} RowFormat;
+
+// replies being assembled, so they go out in one write instead of one per line
+#define OUTPUT_FLUSH_SIZE (1 << 20)
+// how long a select streaming to a server client waits for it to read
+#define OUTPUT_STALL_MS 10000
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+    // what select writes rows as, chosen with .mode
+    RowFormat format;
+    // where rows are written once OUTPUT_FLUSH_SIZE is buffered, so a large
+    // select streams out; -1 holds everything for the caller to send
+    int fileDescriptor;
+    // set for a server client's socket, which is non-blocking and may hang
+    // up. a flush then waits for the client to read, and one that stops for
+    // OUTPUT_STALL_MS or is gone sets failed instead of ending the process
+    bool client;
+    bool failed;
+} OutputBuffer;
+
+// scratch memory for one statement: bump allocated from a chain of blocks
+// and given back all at once, so the statement path does no malloc/free.
+// blocks are kept across resets and only grow, never shrink
+#define ARENA_BLOCK_SIZE (256 * 1024)
+#define ARENA_ALIGNMENT 16
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t capacity;
+    size_t used;
+    _Alignas(ARENA_ALIGNMENT) uint8_t data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* first;
+    ArenaBlock* current;
+} Arena;
+
+// a point to roll an arena back to, for scratch that dies before the
+// statement does
+typedef struct {
+    ArenaBlock* block;
+    size_t used;
+} ArenaMark;
+
 typedef enum {
     META_COMMAND_SUCCESS,
     META_COMMAND_UNRECOGNIZED
@@ -33,14 +106,37 @@ typedef enum {
     EXECUTE_SUCCESS,
     EXECUTE_SYTAX_ERROR,
     EXECUTE_TABLE_FULL,
-    EXECUTE_DUPLICATE_KEY
+    EXECUTE_DUPLICATE_KEY,
+    EXECUTE_INDEX_EXISTS,
+    EXECUTE_KEY_NOT_FOUND
 } ExecuteResult;
 
 typedef enum {
     STATEMENT_INSERT,
-    STATEMENT_SELECT
+    STATEMENT_SELECT,
+    STATEMENT_CREATE_INDEX,
+    STATEMENT_DELETE,
+    STATEMENT_UPDATE
 } StatementType;
 
+#define STATEMENT_TYPE_COUNT (STATEMENT_UPDATE + 1)
+
+// columns a secondary index can be built on
+typedef enum {
+    INDEX_USERNAME,
+    INDEX_EMAIL,
+    INDEX_COUNT
+} IndexColumn;
+
+// what a select can compute instead of returning rows
+typedef enum {
+    AGGREGATE_COUNT,
+    AGGREGATE_MIN_ID,
+    AGGREGATE_MAX_ID
+} AggregateKind;
+
+#define MAX_AGGREGATES 8
+
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
 typedef struct {
@@ -52,9 +148,34 @@ typedef struct {
 typedef struct {
     StatementType type;
     Row rowToInsert;
+    // inclusive id range a select is limited to; empty when minId > maxId
+    uint32_t minId;
+    uint32_t maxId;
+    // select where <column> = value, and the column create index is on.
+    // with prefix, "where <column> like value%" instead
+    bool byColumn;
+    IndexColumn column;
+    char value[COLUMN_EMAIL_SIZE + 1];
+    bool prefix;
+    // "select count(*), min(id), max(id)", in the order asked for. none
+    // for a select of rows
+    uint32_t numAggregates;
+    AggregateKind aggregates[MAX_AGGREGATES];
 } Statement;
 
-// sizes and offsets for row storage
+// what a scan keeps: an id range, and maybe a column equal to or starting
+// with value. leaves are filtered a batch at a time into selection vectors
+typedef struct {
+    uint32_t minId;
+    uint32_t maxId;
+    bool byColumn;
+    IndexColumn column;
+    bool prefix;
+    const uint8_t* value;
+    uint32_t length;
+} ScanFilter;
+
+// sizes and offsets for fixed-width rows, as stored by format 1 and 2 files
 #define sizeOfAttribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
 const uint32_t ID_SIZE = sizeOfAttribute(Row, id);
 const uint32_t USERNAME_SIZE = sizeOfAttribute(Row, username);
@@ -64,35 +185,437 @@ const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
 const uint32_t EMAIL_OFFSET  = USERNAME_OFFSET + USERNAME_SIZE;
 const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 
+// variable-length rows: id, one length byte per string, then the strings
+// unpadded and unterminated. the same record the binary .load format uses
+const uint32_t ROW_LENGTHS_SIZE = 2;
+const uint32_t ROW_HEADER_SIZE = ID_SIZE + ROW_LENGTHS_SIZE;
+const uint32_t ROW_MAX_SIZE = ROW_HEADER_SIZE + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE;
+
 // table storage parameters
 const uint32_t PAGE_SIZE = 4096;
-#define TABLE_MAX_PAGES 100
-const uint32_t ROWS_PER_PAGE = PAGE_SIZE / ROW_SIZE;
-const uint32_t TABLE_MAX_ROWS = ROWS_PER_PAGE * TABLE_MAX_PAGES;
+
+// buffer pool parameters
+#define PAGER_DEFAULT_FRAMES 1024
+#define PAGER_MIN_FRAMES 16
+#define FRAME_NONE UINT32_MAX
+// locks over the page table's hash buckets, each covering every
+// PAGER_BUCKET_LOCKS-th bucket
+#define PAGER_BUCKET_LOCKS 256
+// pages written per pwritev, and per background flusher pass
+#define PAGER_MAX_IOVECS 256
+#define FLUSH_BATCH_PAGES 64
+// the frame arena asks for pages this large, explicitly if the system has
+// some reserved and transparently otherwise, so a big pool needs few TLB
+// entries
+#define ARENA_HUGE_PAGE_SIZE (2ULL << 20)
+
+// mmap pager parameters. address space for the whole reservation is
+// claimed up front so the mapping never moves and page pointers stay valid
+#define MMAP_RESERVE_SIZE (1ULL << 40)
+#define MMAP_GROW_SIZE (64ULL << 20)
+
+// write-ahead log parameters. the log lives next to the database as
+// "<filename>-wal" and holds full page images; a frame whose dbPages is
+// nonzero ends a committed statement and records the table size in pages
+#define WAL_MAGIC "RDBWAL01"
+#define WAL_MAGIC_SIZE 8
+#define WAL_HEADER_SIZE 32
+#define WAL_FRAME_HEADER_SIZE 24
+#define WAL_FRAME_SIZE (WAL_FRAME_HEADER_SIZE + PAGE_SIZE)
+#define WAL_CHECKPOINT_FRAMES 1000
+
+// compressed file parameters. a compressed file starts with a header
+// block, then holds each page as an extent of whole granules anywhere
+// after it; a page-location map written at checkpoints and close says
+// where. two map regions alternate so the header only ever points at a
+// complete one. an extent as long as a page holds the page uncompressed.
+#define COMPRESSED_MAGIC "RDBPACK1"
+#define COMPRESSED_MAGIC_SIZE 8
+#define COMPRESSED_HEADER_SIZE PAGE_SIZE
+#define EXTENT_GRANULE 256
+#define COMPRESS_HASH_BITS 12
+#define COMPRESS_MIN_MATCH 4
+// worst case codec output: every byte a literal, plus run length bytes
+#define PAGE_COMPRESS_BOUND (PAGE_SIZE + PAGE_SIZE / 255 + 16)
+
+typedef struct {
+    char magic[COMPRESSED_MAGIC_SIZE];
+    uint32_t numPages;
+    uint32_t activeMap;
+    uint64_t mapOffset[2];
+    uint32_t mapCapacity[2];
+} CompressedHeader;
+
+// where one page lives in a compressed file; length 0 means never written
+typedef struct {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t capacity;
+} PageLocation;
+
+// free extents of one capacity, as file offsets. extents come in one size
+// class per granule multiple up to a page
+#define EXTENT_CLASSES 16 // PAGE_SIZE / EXTENT_GRANULE
+
+typedef struct {
+    uint64_t* offsets;
+    uint32_t count;
+    uint32_t capacity;
+} ExtentList;
+
+typedef struct {
+    uint32_t pageNum;
+    uint32_t dbPages;
+    uint32_t salt;
+    uint32_t checksum[2];
+    uint32_t padding;
+} WalFrameHeader;
+
+// a logged page and its newest frame, for checkpointing in page order
+typedef struct {
+    uint32_t pageNum;
+    uint64_t offset;
+} WalIndexEntry;
+
+typedef struct {
+    int fileDescriptor;
+    char* filename;
+    uint32_t salt;
+    uint32_t checksum[2];
+    // bytes appended so far, and how many of them are known to be on disk
+    uint64_t length;
+    // commits are numbered by log sequence number, a byte position that
+    // keeps growing across resets: lsnBase is the LSN of offset 0 of the
+    // current log, durableLsn how far everything is known to be on disk
+    uint64_t lsnBase;
+    uint64_t durableLsn;
+    uint32_t numFrames;
+    // group commit: one committer syncs for everyone waiting behind it
+    bool syncInProgress;
+    pthread_mutex_t lock;
+    pthread_cond_t synced;
+    // newest frame offset for each page in the log (open addressing)
+    uint32_t* indexKeys;
+    uint64_t* indexOffsets;
+    uint32_t indexCapacity;
+    uint32_t indexCount;
+    // pages dirtied since the last commit
+    uint32_t* txnPages;
+    uint32_t numTxnPages;
+    uint32_t txnCapacity;
+    // frames of the commit being assembled, written with one call
+    char* buffer;
+    size_t bufferLength;
+    size_t bufferCapacity;
+    uint64_t commits;
+    uint64_t syncs;
+    uint64_t checkpoints;
+} Wal;
+
+// options chosen on the command line
+typedef struct {
+    uint32_t numFrames;
+    bool useMmap;
+    bool useWal;
+    // create new files in the compressed format
+    bool useCompression;
+    // open the file with O_DIRECT so the buffer pool is the only cache of
+    // it. needs the pool, so not with mmap or compression
+    bool useDirectIo;
+    // dirty pages allowed before the flusher (or a checkpoint) kicks in;
+    // 0 picks a quarter of the buffer pool
+    uint32_t dirtyLimit;
+} DbOptions;
+
+// a buffer pool slot holding one cached page. the latch guards the page's
+// contents and is only taken while the page is pinned. a cache hit pins
+// under its bucket's lock alone, so pinCount and referenced belong to
+// that lock; the other fields belong to the pager lock
+typedef struct {
+    uint32_t pageNum;
+    void* page;
+    uint32_t pinCount;
+    bool dirty;
+    bool referenced;
+    uint32_t hashNext;
+    pthread_rwlock_t latch;
+} Frame;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t dirtyEvictions;
+    // pages written to the database file, and frames appended to the log.
+    // writeCalls counts the system calls for both
+    uint64_t pagesWritten;
+    uint64_t walFrames;
+    uint64_t writeCalls;
+    // file and log I/O, as stored: compressed pages count their extents.
+    // the flusher writes without the pool lock, so these add atomically
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    // pages a scan asked the kernel to start reading before it got to
+    // them, counting only those not already in the pool or resident
+    uint64_t readAheadPages;
+} PagerStats;
+
+// counts of work done on the table's tree, for measuring it. a descent
+// is one root-to-leaf walk by a lookup, scan or insert
+typedef struct {
+    uint64_t leafSplits;
+    uint64_t internalSplits;
+    uint64_t descents;
+    uint64_t nodesVisited;
+    // inserts that went straight to the rightmost leaf without a descent
+    uint64_t appendHits;
+} TreeStats;
+
+// statement latencies in nanoseconds, bucketed HDR style: below
+// LATENCY_SUB_BUCKETS exactly, and each power of two above that cut into
+// LATENCY_SUB_BUCKETS equal buckets, so any value is known to within
+// about 6% at a fixed size. values from 2^LATENCY_MAX_BITS up share the
+// last bucket
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_BITS 40
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t count;
+    uint64_t totalNs;
+    uint64_t maxNs;
+} LatencyHistogram;
+
+// a page to write, for batching writes in page order
+typedef struct {
+    uint32_t pageNum;
+    void* page;
+} PageRef;
+
+// page 0 of a versioned file holds this header. files from before format 2
+// have their root leaf there instead. older formats are upgraded on open.
+#define DB_HEADER_MAGIC "RDBFILE\0"
+#define DB_HEADER_MAGIC_SIZE 8
+#define DB_FORMAT_VERSION 3
+#define DB_HEADER_PAGE 0
+
+typedef struct {
+    char magic[DB_HEADER_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t rootPageNum;
+    // root of each secondary index, 0 when there is none. files written
+    // before indexes existed have zeros here
+    uint32_t indexRootPageNums[INDEX_COUNT];
+    // pages freed by deletes, chained through the pages themselves
+    uint32_t freeListHead;
+    uint32_t freeListCount;
+    // pages in use, which the mmap backend's file can run past after a
+    // crash. 0 in files written before it was kept, meaning unknown
+    uint32_t numPages;
+} DbHeader;
 
 // structure that will access page cache and the file
 typedef struct {
     int fileDescriptor;
-    uint32_t fileLength;
+    uint64_t fileLength;
     uint32_t numPages;
-    void* pages[TABLE_MAX_PAGES];
+    uint32_t numFrames;
+    uint32_t numUsedFrames;
+    Frame* frames;
+    // every frame's page, contiguous, so a page pointer maps to its frame.
+    // mapped rather than allocated, rounded up to whole huge pages if it
+    // got explicit ones
+    void* frameArena;
+    size_t arenaLength;
+    // the file was opened with O_DIRECT
+    bool directIo;
+    uint32_t* buckets;
+    uint32_t numBuckets;
+    // a chain changes only under both the pager lock and its bucket lock,
+    // so it can be walked under either. cache hits take just the bucket
+    // lock; evicting a frame takes it too, so a hit can't pin a victim
+    pthread_mutex_t bucketLocks[PAGER_BUCKET_LOCKS];
+    uint32_t clockHand;
+    PagerStats stats;
+    // mmap backend: pages are addressed in place, frames are unused
+    void* map;
+    uint64_t mapLength;
+    uint32_t dirtyLow;
+    uint32_t dirtyHigh;
+    // write-ahead log, or NULL when running without one
+    Wal* wal;
+    // compressed files: where each page's extent is, NULL otherwise.
+    // fileLength is then where the next extent will be appended
+    PageLocation* locations;
+    uint32_t locationCapacity;
+    CompressedHeader compressedHeader;
+    // extents free for reuse, and ones the map on disk still points at
+    // that become free once the next map is saved
+    ExtentList freeExtents[EXTENT_CLASSES];
+    ExtentList pendingExtents[EXTENT_CLASSES];
+    // dirty page accounting, and the background flusher that keeps the
+    // count under dirtyLimit. lock guards frame state against the flusher.
+    uint32_t numDirty;
+    uint32_t dirtyLimit;
+    pthread_mutex_t lock;
+    pthread_cond_t flushNeeded;
+    pthread_t flusher;
+    bool flusherRunning;
+    bool stopFlusher;
+    // free page list, mirrored in the file header. splits pop from it
+    // concurrently, so it has its own lock
+    uint32_t freeListHead;
+    uint32_t freeListCount;
+    pthread_mutex_t freeListLock;
+    // the snapshot version each page was allocated in, so writers can tell
+    // pages an open snapshot may see from ones made since. pages outside
+    // the map predate this open and count as version 0. stamped under
+    // freeListLock
+    uint64_t* pageVersions;
+    uint64_t versionCapacity;
+    uint64_t writeVersion;
 } Pager;
 
+// a reader's view of the tree as it was when the snapshot began. while
+// any snapshot is open, writers copy a page it may see instead of
+// changing it, so a snapshot reader needs no latches
+typedef struct {
+    uint32_t rootPageNum;
+    uint64_t version;
+} Snapshot;
+
+// selects spanning fewer ids than this read the live tree under latches.
+// a snapshot takes the table lock exclusively to open and close, and
+// writers copy pages while it is open, which only pays for long scans
+#define SNAPSHOT_MIN_RANGE 4096
+
+// a snapshot scan asks for this many leaves past the one it is on, all
+// children of the same parent, and asks again once half of them are read
+#define READ_AHEAD_LEAVES 32
+
+// a page a writer replaced while an open snapshot could still see it. it
+// is freed once every snapshot older than version has ended
+typedef struct {
+    uint32_t pageNum;
+    uint64_t version;
+} RetiredPage;
+
 typedef struct {
     Pager* pager;
     uint32_t rootPageNum;
+    // held shared by every statement and exclusively by commits and
+    // checkpoints, which need the pool quiet. in mmap mode there are no
+    // page latches, so inserts hold it exclusively too
+    pthread_rwlock_t lock;
+    // secondary index roots, 0 for none. an index is latched as a whole:
+    // inserts hold its lock exclusively, lookups shared
+    uint32_t indexRoots[INDEX_COUNT];
+    pthread_rwlock_t indexLocks[INDEX_COUNT];
+    // what the table was opened with, so .vacuum can reopen it
+    char* filename;
+    DbOptions options;
+    // counted atomically, as inserts split concurrently
+    TreeStats stats;
+    // how long each kind of statement took, for .stats
+    LatencyHistogram latencies[STATEMENT_TYPE_COUNT];
+    // the rightmost leaf's page number in the high half and its largest key
+    // in the low half, 0 for none. only a hint: inserts check it against
+    // the page before trusting it. read and written atomically
+    uint64_t appendHint;
+    // open snapshots' versions, oldest first, and pages waiting for them to
+    // end. both change only under the exclusive lock
+    uint64_t* snapshots;
+    uint32_t numSnapshots;
+    uint32_t snapshotCapacity;
+    RetiredPage* retired;
+    uint32_t numRetired;
+    uint32_t retiredCapacity;
 } Table;
 
+// rows an aggregate counted, and the smallest and largest id among them
+typedef struct {
+    uint64_t count;
+    uint32_t minId;
+    uint32_t maxId;
+} AggregateResult;
+
+// one subtree of a parallel scan, and the ids in it that are wanted
+typedef struct {
+    uint32_t pageNum;
+    uint32_t minId;
+    uint32_t maxId;
+} AggregateRange;
+
+// shared by an aggregate's workers. each claims the next range by
+// bumping nextRange, and leaves what it found in its own result
+typedef struct {
+    Table* table;
+    ScanFilter filter;
+    uint64_t version;
+    AggregateRange* ranges;
+    uint32_t numRanges;
+    uint32_t nextRange;
+} AggregateScan;
+
+typedef struct {
+    AggregateScan* scan;
+    AggregateResult result;
+} AggregateWorker;
+
+// how many ranges each thread should get, so that uneven subtrees even
+// out, and the most threads one aggregate starts
+#define AGGREGATE_RANGES_PER_THREAD 4
+#define AGGREGATE_MAX_THREADS 64
+
+// deep enough for any tree addressable with 32-bit page numbers
+#define BTREE_MAX_DEPTH 16
+
 typedef struct {
     Table* table;
     uint32_t pageNum;
     uint32_t cellNum;
     bool endOfTable;
+    // internal nodes visited on the way down (root first) and the
+    // child index taken in each, used to propagate splits upward
+    uint32_t depth;
+    uint32_t path[BTREE_MAX_DEPTH];
+    uint32_t pathIndex[BTREE_MAX_DEPTH];
+    // the leaf the cursor is on, pinned and latched (exclusively for
+    // writers), and the ancestors from path[firstLatched] down that a
+    // pessimistic writer still holds because a split may reach them
+    void* leaf;
+    bool exclusive;
+    uint32_t firstLatched;
+    void* pathPages[BTREE_MAX_DEPTH];
+    // set for a cursor reading a snapshot. it latches nothing, keeps only
+    // the leaf pinned, and moves between leaves through path, as writers
+    // still relink leaves in place
+    Snapshot* snapshot;
+    // the parent whose children up to readAheadEnd (exclusive) have
+    // already been read ahead, and for a live cursor, which keeps no path
+    // past its descent, the child index it is counted to be on
+    uint32_t readAheadParent;
+    uint32_t readAheadEnd;
+    uint32_t readAheadIndex;
 } Cursor;
 
+// how a descent latches the pages it passes. readers crab down with shared
+// latches. writers first try latching only the leaf exclusively; if the row
+// won't fit they descend again holding every ancestor a split could touch
+typedef enum {
+    LATCH_READ,
+    LATCH_WRITE_LEAF,
+    LATCH_WRITE_PATH
+} LatchMode;
+
 typedef enum {
     NODE_INTERNAL,
-    NODE_LEAF
+    NODE_LEAF,
+    NODE_INDEX_INTERNAL,
+    NODE_INDEX_LEAF,
+    NODE_FREE
 } NodeType;
 
 // Node Header Layout
@@ -109,18 +632,38 @@ const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_CONTENT_START_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_CONTENT_START_OFFSET = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_FRAGMENTED_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_FRAGMENTED_OFFSET = LEAF_NODE_CONTENT_START_OFFSET + LEAF_NODE_CONTENT_START_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE + LEAF_NODE_CONTENT_START_SIZE + LEAF_NODE_FRAGMENTED_SIZE;
 
-// Leaf Node Body Layout
+// Leaf Node Body Layout: a dense sorted key array right after the header,
+// then a parallel array of value offsets (slots), then free space. values
+// are packed from the end of the page down to the content start; bytes
+// freed below it are counted as fragmented until the page is compacted.
 const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
+const uint32_t LEAF_NODE_SLOT_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_CELL_OVERHEAD = LEAF_NODE_KEY_SIZE + LEAF_NODE_SLOT_SIZE;
 const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+
+// keys left after binary search are compared a vector at a time
+#define LEAF_NODE_SEARCH_WINDOW 16
+
+// the most cells a leaf can hold, each at least a key, a slot and an
+// empty row's header: PAGE_SIZE / 12
+#define LEAF_NODE_MAX_CELLS 342
+
+// column values up to this long are compared byte by byte in the filter
+// loop rather than with memcmp
+#define LEAF_SELECT_INLINE_COMPARE 16
+
+// leaf layouts of older formats, read only when upgrading a file.
+// format 1 interleaves keys with fixed-width rows; format 2 has the
+// key and slot arrays but fixed-width values and no fragmented count
+const uint32_t LEAF_NODE_V1_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_V1_CELL_SIZE = LEAF_NODE_KEY_SIZE + ROW_SIZE;
+const uint32_t LEAF_NODE_V2_HEADER_SIZE = LEAF_NODE_V1_HEADER_SIZE + LEAF_NODE_CONTENT_START_SIZE;
 
 // Internal Node Header Layout
 const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
@@ -134,33 +677,286 @@ const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + INTERNAL_NO
 const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
+const uint32_t INTERNAL_NODE_SPACE_FOR_CELLS = PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_MAX_KEYS = INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE;
+
+// a node below these after a delete takes cells from a sibling, or is
+// merged into it when both fit in one page
+const uint32_t LEAF_NODE_MIN_USED = LEAF_NODE_SPACE_FOR_CELLS / 4;
+const uint32_t INTERNAL_NODE_MIN_KEYS = INTERNAL_NODE_MAX_KEYS / 4;
+
+// a free page keeps the common header, typed NODE_FREE, then the next
+// free page number (0 ends the list)
+const uint32_t FREE_PAGE_NEXT_OFFSET = COMMON_NODE_HEADER_SIZE;
+
+// Index Node Layout. secondary indexes are B+trees of (column value, id)
+// entries ordered by value bytes, then id. both node types share a header
+// and keep slots after it pointing at cells packed down from the page end.
+// a leaf stores the prefix every entry in it shares once, after the
+// header, and each cell as { u8 suffixLength, suffix, u32 id }. an
+// internal cell is { u32 child, u8 length, value, u32 id }, the largest
+// entry under that child; the right child's bound isn't stored.
+const uint32_t INDEX_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t INDEX_NODE_CONTENT_START_OFFSET = INDEX_NODE_NUM_CELLS_OFFSET + sizeof(uint16_t);
+// next leaf in a leaf, right child in an internal node
+const uint32_t INDEX_NODE_LINK_OFFSET = INDEX_NODE_CONTENT_START_OFFSET + sizeof(uint16_t);
+const uint32_t INDEX_NODE_PREFIX_LENGTH_OFFSET = INDEX_NODE_LINK_OFFSET + sizeof(uint32_t);
+const uint32_t INDEX_NODE_HEADER_SIZE = INDEX_NODE_PREFIX_LENGTH_OFFSET + 2;
+const uint32_t INDEX_NODE_SLOT_SIZE = sizeof(uint16_t);
+const uint32_t INDEX_LEAF_CELL_OVERHEAD = 1 + ID_SIZE;
+const uint32_t INDEX_INTERNAL_CELL_OVERHEAD = sizeof(uint32_t) + 1 + ID_SIZE;
+
+// an index entry unpacked from a page: the column value, the row's id and,
+// in internal nodes, the child it bounds
+typedef struct {
+    const uint8_t* key;
+    uint32_t length;
+    uint32_t id;
+    uint32_t childPageNum;
+} IndexEntry;
 
 // constructor for an input buffer
 InputBuffer* newInputBuffer();
 
+// constructor for an output buffer, and appending to one
+OutputBuffer* newOutputBuffer();
+void outputReserve(OutputBuffer* output, size_t length);
+void outputAppend(OutputBuffer* output, const char* data, size_t length);
+void outputPrintf(OutputBuffer* output, const char* format, ...);
+void closeOutputBuffer(OutputBuffer* output);
+
+// write everything buffered to the output's descriptor; a failed client
+// output just drops it
+void outputFlush(OutputBuffer* output);
+
+// allocate from an arena; the memory lives until the arena is reset or
+// released past it
+void* arenaAlloc(Arena* arena, size_t size);
+ArenaMark arenaMark(Arena* arena);
+void arenaRelease(Arena* arena, ArenaMark mark);
+void arenaReset(Arena* arena);
+
+// this thread's arena for the statement it is running, reset once the
+// statement finishes
+Arena* statementArena();
+
+// fill in defaults for every option
+void defaultDbOptions(DbOptions* options);
+
 // opening database file, initializing pager and table
-Table* dbOpen(const char* filename);
+Table* dbOpen(const char* filename, DbOptions* options);
 
 // flush cache to disk, close database file, frees memory for Pager and Table
 void dbClose(Table* table);
 
-// opens database file, tracks its size, and initializes page caches to NULL
-Pager* pagerOpen(const char* filename);
+// the pager half of dbClose, leaving the table to be reopened
+void dbClosePager(Table* table);
+
+// load the root pages and free list from a current format header
+void dbReadHeader(Table* table);
+
+// make the current statement's changes durable
+void dbCommit(Table* table);
+
+// convert a file written in an older format. a format 1 file has its root
+// moved off page 0 first. every leaf is rewritten in the current layout,
+// separators are recomputed, and the header is written last
+void dbUpgrade(Table* table, uint32_t version);
+uint32_t upgradeSubtree(Pager* pager, uint32_t pageNum, uint32_t version);
+void upgradeLeaf(void* node, uint32_t version);
+
+// opens database file, tracks its size, and allocates an empty buffer pool
+Pager* pagerOpen(const char* filename, DbOptions* options);
 
 // flushes page cache to disk
 void pagerFlush(Pager* pager, uint32_t pageNum);
 
-// handles cache miss
+// returns a pinned page, loading it into a frame on a cache miss
 void* getPage(Pager* pager, uint32_t pageNum);
 
-// allocate new pages
+// release a pin taken by getPage so the frame can be evicted again
+void unpinPage(Pager* pager, uint32_t pageNum);
+
+// record that a pinned page was modified and must be written before eviction
+void markPageDirty(Pager* pager, uint32_t pageNum);
+
+// compressed files: set up or load the location map, read a page through
+// it, write pages to extents, and persist the map at a consistent point
+void pagerOpenCompressed(Pager* pager, bool create);
+void pagerReadCompressed(Pager* pager, uint32_t pageNum, void* page);
+uint32_t pagerWriteCompressed(Pager* pager, PageRef* refs, uint32_t count);
+void pagerSaveLocations(Pager* pager);
+void pagerReserveLocations(Pager* pager, uint32_t count);
+
+// compressed file space: extents are carved from free lists before the
+// file is extended; on open, gaps between live extents are the free lists
+uint64_t pagerAllocateExtent(Pager* pager, uint32_t capacity);
+void pagerFreeExtent(Pager* pager, uint64_t offset, uint64_t size, bool pending);
+void pagerFindFreeExtents(Pager* pager);
+void extentListPush(ExtentList* list, uint64_t offset);
+int comparePageLocations(const void* a, const void* b);
+
+// page codec: LZ77 with hashed 4-byte matches and LZ4-style sequences.
+// compress returns the output length; decompress fails on corrupt input
+uint32_t pageCompress(const uint8_t* source, uint8_t* destination);
+bool pageDecompress(const uint8_t* source, uint32_t length, uint8_t* destination);
+uint32_t compressEmitSequence(uint8_t* destination, uint32_t out, const uint8_t* literals,
+    uint32_t numLiterals, uint32_t offset, uint32_t matchLength);
+uint32_t compressEmitLength(uint8_t* destination, uint32_t out, uint32_t length);
+
+// mmap backend: map the file, extend it, and persist dirty ranges
+void pagerMapFile(Pager* pager);
+void pagerGrowMap(Pager* pager, uint32_t minPages);
+void pagerTrimMap(Pager* pager, uint32_t numPages);
+void pagerSyncMap(Pager* pager);
+
+// write-ahead log: open and replay, append page images, commit with a
+// shared fdatasync, and checkpoint logged pages into the database file
+void walOpen(Pager* pager, const char* filename);
+void walClose(Pager* pager);
+void walRecover(Pager* pager);
+void walReset(Pager* pager);
+void walChecksum(uint32_t* checksum, const void* data, uint32_t length);
+uint64_t walIndexLookup(Wal* wal, uint32_t pageNum);
+void walIndexInsert(Wal* wal, uint32_t pageNum, uint64_t offset);
+void walBufferFrame(Wal* wal, uint32_t pageNum, uint32_t dbPages, void* page);
+void walWriteBuffer(Pager* pager);
+void walAppendPage(Pager* pager, uint32_t pageNum, void* page);
+void walTrackPage(Pager* pager, uint32_t pageNum);
+uint64_t walCommit(Pager* pager);
+void walWaitDurable(Pager* pager, uint64_t lsn);
+void walCheckpoint(Pager* pager);
+int compareWalIndexEntries(const void* a, const void* b);
+
+// write pages sorted by page number, one pwritev per run of adjacent pages.
+// returns the number of write calls made
+uint32_t pagerWritePages(Pager* pager, PageRef* refs, uint32_t count);
+int comparePageRefs(const void* a, const void* b);
+
+// background flusher thread
+void* pagerFlusherMain(void* arg);
+void pagerStopFlusher(Pager* pager);
+
+// clear a frame's dirty bit, keeping the dirty count in step
+void frameMarkClean(Pager* pager, Frame* frame);
+
+// map the frame arena, backed by huge pages where the system allows
+void pagerMapArena(Pager* pager);
+
+// buffer pool internals: page table lookup and CLOCK victim selection
+uint32_t pagerLookupFrame(Pager* pager, uint32_t pageNum);
+pthread_mutex_t* pagerBucketLock(Pager* pager, uint32_t pageNum);
+uint32_t pagerAllocateFrame(Pager* pager);
+void pagerHashInsert(Pager* pager, uint32_t frameIndex);
+void pagerHashRemove(Pager* pager, uint32_t frameIndex);
+
+// start the kernel reading pages that aren't cached, so a scan finds them
+// in memory when it gets there. adjacent pages go in one request. takes
+// the pager lock; the caller holds the table lock so the log stays put
+void pagerReadAhead(Pager* pager, uint32_t* pageNums, uint32_t count);
+
+// mmap backend: advise the stretches of a run that aren't resident,
+// returning how many pages that was
+uint32_t pagerAdviseMapped(Pager* pager, uint64_t offset, uint64_t length);
+
+// allocate new pages, reusing freed ones first
 uint32_t getUnusedPageNum(Pager* pager);
 
-// create new cursors at start of table
-Cursor* tableStart(Table* table);
+// record that a page was allocated in the current write version. the
+// caller holds freeListLock
+void pagerStampPage(Pager* pager, uint32_t pageNum);
+
+// put a page no longer in the tree on the free list
+void freePage(Pager* pager, uint32_t pageNum);
+
+// write the free list head and count into the file header
+void pagerSaveFreeList(Pager* pager);
+
+// write the number of pages in use into the file header
+void pagerSavePageCount(Pager* pager);
+
+// cursors are owned by the caller, usually on its stack; these fill one in
+// place and never allocate
+
+// position a cursor at start of table
+void tableStart(Table* table, Cursor* cursor);
+
+// position a cursor at the first row whose id is >= key
+void tableSeek(Table* table, uint32_t key, Cursor* cursor);
 
 // search tree for a key
-Cursor* tableFind(Table* table, uint32_t key);
+void tableFind(Table* table, uint32_t key, Cursor* cursor);
+
+// descend to the leaf for a key, latching as mode says. valueSize is the
+// size of the row a writer means to insert
+void tableDescend(Table* table, uint32_t key, LatchMode mode, uint32_t valueSize, Cursor* cursor);
+
+// position a cursor at the end of the rightmost leaf, latched for writing,
+// if key sorts after everything in the table and the row fits there
+// without a split. false leaves the cursor untouched
+bool tableTryAppend(Table* table, uint32_t key, uint32_t valueSize, Cursor* cursor);
+
+// remember or forget the rightmost leaf for tableTryAppend
+void tableSetAppendHint(Table* table, uint32_t pageNum, uint32_t maxKey);
+
+// whether a node can take an insert of valueSize without splitting
+bool nodeIsSafe(void* node, uint32_t valueSize);
+
+// release the cursor's latches and page pins
+void closeCursor(Cursor* cursor);
+
+// open and close a snapshot of the table. the caller holds no table lock;
+// both take it exclusively for a moment. ending the last snapshot that
+// could see a retired page frees it
+void tableBeginSnapshot(Table* table, Snapshot* snapshot);
+void tableEndSnapshot(Table* table, Snapshot* snapshot);
+
+// snapshot cursors take the table lock shared once per leaf they move to,
+// for the whole descent and read-ahead, since commits and checkpoints
+// rewrite the pool and log index under the exclusive lock alone. rows
+// within a leaf are streamed without it
+
+// position a cursor at the first row whose id is >= key as of the snapshot
+void snapshotSeek(Table* table, Snapshot* snapshot, uint32_t key, Cursor* cursor);
+
+// move a snapshot cursor onto the next leaf, or to the end of the table
+void snapshotNextLeaf(Cursor* cursor);
+
+// read ahead the leaves after the snapshot cursor's, topping up the
+// window as the cursor moves through it. the caller holds the table lock
+void snapshotReadAhead(Cursor* cursor);
+
+// pin or unpin a single page for a snapshot reader, holding the table
+// lock only while doing so: a checkpoint walks the pool without the pager lock
+void* snapshotGetPage(Table* table, uint32_t pageNum);
+void snapshotUnpinPage(Table* table, uint32_t pageNum);
+
+// copy-on-write for writers while snapshots are open, all under the
+// exclusive table lock. a page is visible if an open snapshot may see it;
+// visible pages are copied before changing and retired rather than freed
+bool tablePageVisible(Table* table, uint32_t pageNum);
+uint32_t tableCopyPage(Table* table, uint32_t pageNum);
+void tableRetirePage(Table* table, uint32_t pageNum);
+
+// free a page leaving the tree, or retire it if a snapshot may see it
+void tableReleasePage(Table* table, uint32_t pageNum);
+
+// make the root, or child index of the internal node at the end of path,
+// writable and return its page. a copied child replaces the old one in
+// its parent, and a copied leaf in its left neighbour's next link, found
+// through the path. path[0..depth) must be writable already
+uint32_t tableWritableRoot(Table* table);
+uint32_t tableWritableChild(Table* table, uint32_t* path, uint32_t* pathIndex, uint32_t depth, uint32_t index);
+
+// make every page on the way to key's leaf writable, filling in the path
+// taken, and return the leaf's page
+uint32_t tableMakePathWritable(Table* table, uint32_t key, uint32_t* path, uint32_t* pathIndex, uint32_t* depth);
+
+// latch or unlatch a pinned page
+void latchPage(Pager* pager, void* page, bool exclusive);
+void unlatchPage(Pager* pager, void* page);
+// latch a pinned page if that doesn't mean waiting, returning whether it did
+bool tryLatchPage(Pager* pager, void* page, bool exclusive);
 
 // prints a prompt to the user
 void printPrompt();
@@ -171,8 +967,33 @@ void readInput(InputBuffer* inputBuffer);
 // free allocated memory for an inputBuffer
 void closeInputBuffer(InputBuffer* inputBuffer);
 
+// terminate the next line of input at *start in place, point line at it and
+// move *start past it. false if no complete line is left; once atEnd, a
+// last line without a newline counts too
+bool takeLine(InputBuffer* input, size_t* start, bool atEnd, InputBuffer* line);
+
 // executes a meta command (meta commands start with a '.' character)
-MetaCommandResult execMetaCommand(InputBuffer* inputBuffer, Table* table);
+MetaCommandResult execMetaCommand(InputBuffer* inputBuffer, Table* table, OutputBuffer* output);
+
+// handles ".mode text|csv|binary"
+void executeMode(InputBuffer* inputBuffer, OutputBuffer* output);
+
+// .stats [json|reset]: pager, tree and latency counters since open or the
+// last reset, as text or JSON
+void executeStats(InputBuffer* inputBuffer, Table* table, OutputBuffer* output);
+
+// zero every counter and histogram of the table and its pager
+void tableResetStats(Table* table);
+
+// levels from the root to the leaves, 1 for a lone root leaf
+uint32_t tableDepth(Table* table);
+
+// add a latency to a histogram, and read back the value at a percentile
+// (0-100) as the highest value its bucket holds
+uint32_t latencyBucket(uint64_t nanoseconds);
+uint64_t latencyBucketHigh(uint32_t bucket);
+void latencyRecord(LatencyHistogram* histogram, uint64_t nanoseconds);
+uint64_t latencyPercentile(LatencyHistogram* histogram, double percentile);
 
 // prepares the statement by identifying keywords and setting statement->type
 PrepareResult prepareStatement(InputBuffer* InputBuffer, Statement* statement);
@@ -180,35 +1001,141 @@ PrepareResult prepareStatement(InputBuffer* InputBuffer, Statement* statement);
 // check length of each string in statement to avoid buffer overflow
 PrepareResult prepareInsert(InputBuffer* inputBuffer, Statement* statement);
 
+// parse "select [aggregate, ...] [where id =|<|<=|>|>= K |
+// where id between A and B | where username|email = value |
+// where username|email like prefix%]", where an aggregate is count(*),
+// min(id) or max(id)
+PrepareResult prepareSelect(InputBuffer* inputBuffer, Statement* statement);
+
+// parse the where clause at the end of a select or delete, if any
+PrepareResult prepareWhere(char* text, Statement* statement);
+
+// parse "delete where id ..." with the same id conditions as select
+PrepareResult prepareDelete(InputBuffer* inputBuffer, Statement* statement);
+
 // identifies statement type and executes statement
-ExecuteResult executeStatement(Statement* statement, Table* table);
+ExecuteResult executeStatement(Statement* statement, Table* table, OutputBuffer* output);
 
 // Execute specific commands
 ExecuteResult executeInsert(Statement* statement, Table* table);
-ExecuteResult executeSelect(Statement* statement, Table* table);
+ExecuteResult executeSelect(Statement* statement, Table* table, OutputBuffer* output);
+ExecuteResult executeDelete(Statement* statement, Table* table);
+// "update id username email" replaces the row with that id
+ExecuteResult executeUpdate(Statement* statement, Table* table);
+
+// add a row and its index entries. the caller holds the table lock
+ExecuteResult tableInsert(Table* table, Row* row);
 
-// convert to compact representation of row
-void serializeRow(Row* source, void* destination);
+// remove the row with this id and its index entries, rebalancing the
+// tree; false if there is none. the caller holds the table lock exclusively
+bool tableDelete(Table* table, uint32_t key);
+
+// fix up the node at depth on path after a delete shrank it, merging or
+// borrowing and carrying on up while parents shrink too
+void tableRebalance(Table* table, uint32_t* path, uint32_t* pathIndex, uint32_t depth, uint32_t pageNum);
+bool nodeUnderflows(void* node);
+
+// balance two adjacent children of parent, or merge the right one into the
+// left when they fit in one page. true if they were merged
+bool leafNodeRebalance(Table* table, void* parent, uint32_t leftIndex);
+bool internalNodeRebalance(Table* table, void* parent, uint32_t leftIndex);
+
+// drop key leftIndex and child leftIndex + 1 from an internal node, after
+// that child was merged into its left sibling
+void internalNodeRemove(void* node, uint32_t leftIndex);
+
+// write an internal node's children and their bounds; the last child is
+// the right child and its bound is not stored
+void internalNodeWrite(void* node, uint32_t* children, uint32_t* keys, uint32_t numChildren);
+
+// handles ".vacuum": rebuild the table and its indexes densely into a new
+// file, then swap it in for the old one
+void executeVacuum(Table* table);
+
+// prepare and execute one statement, appending rows and the outcome to
+// output. the caller commits before anyone sees the reply
+void runStatement(InputBuffer* inputBuffer, Table* table, OutputBuffer* output);
+
+// convert to compact representation of row, returning its length
+uint32_t serializeRow(Row* source, void* destination);
+uint32_t serializedRowSize(Row* row);
 
 // convert from compact representation of row
 void deserializeRow(void* source, Row* destination);
 
+// length of the compact row stored at source
+uint32_t rowValueSize(void* source);
+
+// convert from the fixed-width rows of format 1 and 2 files
+void deserializeFixedRow(void* source, Row* destination);
+
 // returns a pointer to the position described by the cursor
 void* cursorValue(Cursor* cursor);
 
 // advance cursor to the next row
 void cursorAdvance(Cursor* cursor);
 
-// prints a row's data to standard output
-void printRow(Row* row);
+// move cursor to the first row of the next leaf, for scans that take a
+// leaf at a time
+void cursorNextLeaf(Cursor* cursor);
+
+// read ahead the leaves after a live read cursor's, like a snapshot
+// cursor does. call it on each leaf a scan reaches
+void cursorReadAhead(Cursor* cursor);
+
+// the filter a select's where clause describes
+void scanFilterInit(ScanFilter* filter, Statement* statement);
+
+// fill selection with the cells from cellNum on that pass filter, in
+// order, and return how many. the id range is a run of the key array;
+// column tests then narrow it in passes, cheapest first
+uint32_t leafNodeSelect(void* node, uint32_t cellNum, ScanFilter* filter, uint16_t* selection);
+
+// formats a stored row into output, straight from its bytes in the leaf
+void printRow(OutputBuffer* output, void* value);
+void printCsvField(OutputBuffer* output, const char* field, uint32_t length);
+
+// what comes before and after a select's rows in each format: a csv header
+// line, or a binary row file's magic and end marker
+void beginRows(OutputBuffer* output);
+void endRows(OutputBuffer* output);
+
+// writes value in decimal, returning the number of characters. at most
+// FORMAT_UINT_MAX_SIZE, as in "4294967295"
+#define FORMAT_UINT_MAX_SIZE 10
+uint32_t formatUint(char* destination, uint32_t value);
+
+// the fixed characters of a text row: "(", ", ", ", " and ")\n"
+#define ROW_TEXT_PUNCTUATION_SIZE 7
 
 // access keys, values, and metadata
 uint32_t* leafNodeNumCells(void* node);
-void* leafNodeCell(void* node, uint32_t cellNum);
+uint16_t* leafNodeContentStart(void* node);
+uint16_t* leafNodeFragmentedBytes(void* node);
+uint32_t* leafNodeKeys(void* node);
+uint16_t* leafNodeSlots(void* node);
 uint32_t* leafNodeKey(void* node, uint32_t cellNum);
 void* leafNodeValue(void* node, uint32_t cellNum);
 uint32_t* leafNodeNextLeaf(void* node);
 
+// open a gap at cellNum for key, reserve valueSize bytes for its value and
+// return where the value goes. compacts the page if the free bytes are not
+// contiguous; caller checks leafNodeFreeSpace first
+void* leafNodeAllocateCell(void* node, uint32_t cellNum, uint32_t key, uint32_t valueSize);
+
+// drop a cell, leaving its value bytes to be reclaimed by compaction
+void leafNodeRemoveCell(void* node, uint32_t cellNum);
+
+// repack values against the end of the page, removing fragmentation
+void leafNodeCompact(void* node);
+
+// bytes a cell uses including its key and slot, and bytes still free
+uint32_t leafNodeCellSize(void* node, uint32_t cellNum);
+uint32_t leafNodeFreeSpace(void* node);
+
+// index of the first key >= key
+uint32_t leafNodeLowerBound(void* node, uint32_t key);
+
 // initializing nodes
 void initializeLeafNode(void* node);
 void initializeInternalNode(void* node);
@@ -216,19 +1143,25 @@ void initializeInternalNode(void* node);
 // insert key/value pair into a leaf node
 void leafNodeInsert(Cursor* cursor, uint32_t key, Row* value);
 
-// binary search for a node
-Cursor* leafNodeFind(Table* table, uint32_t pageNum, uint32_t key);
-Cursor* internalNodeFind(Table* table, uint32_t pageNum, uint32_t key);
+// binary search for the child of an internal node that covers key
+uint32_t internalNodeFindChild(void* node, uint32_t key);
 
 // get and set node type
 NodeType getNodeType(void* node);
 void setNodeType(void* node, NodeType type);
 
-// split full leaf node in half, allocate a new leaf node, and update or create new parent
+// split full leaf node in half, allocate a new leaf node, and update or create new parent.
+// a row past the end of the table leaves the old node full instead
 void leafNodeSplitAndInsert(Cursor* cursor, uint32_t key, Row* value);
 
+// add a new right sibling to the child the cursor descended through at
+// the given level, splitting the internal node and recursing if it is full.
+// appending says the split came from adding past the end of the table
+void internalNodeInsert(Cursor* cursor, uint32_t level, uint32_t leftMaxKey, uint32_t rightChildPageNum,
+    bool appending);
+
 // create new root node
-void createNewRoot(Table* table, uint32_t rightChildPageNum);
+void createNewRoot(Table* table, uint32_t rightChildPageNum, uint32_t leftChildMaxKey);
 
 // reading and writing to an internal node
 uint32_t* internalNodeNumKeys(void* node);
@@ -242,8 +1175,217 @@ uint32_t getNodeMaxKey(void* node);
 bool isNodeRoot(void* node);
 void setNodeRoot(void* node, bool is_root);
 
+// order of two index entries: by value bytes, a prefix first, then by id
+int compareIndexEntries(const uint8_t* a, uint32_t aLength, uint32_t aId,
+    const uint8_t* b, uint32_t bLength, uint32_t bId);
+
+// the value of a column, in a stored row or in a Row
+void rowColumn(void* value, IndexColumn column, const uint8_t** bytes, uint32_t* length);
+void rowColumnOf(Row* row, IndexColumn column, const uint8_t** bytes, uint32_t* length);
+
+// access index node fields
+uint16_t* indexNodeNumCells(void* node);
+uint16_t* indexNodeContentStart(void* node);
+uint32_t* indexNodeLink(void* node);
+uint8_t* indexLeafPrefixLength(void* node);
+uint8_t* indexLeafPrefix(void* node);
+uint16_t* indexNodeSlots(void* node);
+uint8_t* indexNodeCell(void* node, uint32_t cellNum);
+uint32_t indexNodeFreeSpace(void* node);
+void initializeIndexNode(void* node, NodeType type);
+
+// unpack cell cellNum of a leaf; the value is copied to key, which must
+// hold 255 bytes, and the entry points at it
+void indexLeafEntry(void* node, uint32_t cellNum, uint8_t* key, IndexEntry* entry);
+void indexInternalEntry(void* node, uint32_t cellNum, IndexEntry* entry);
+
+// length of the prefix two entries share
+uint32_t indexCommonPrefix(IndexEntry* a, IndexEntry* b);
+
+// unpack every entry of a node, copying values into keys. an internal
+// node's right child comes last, with an empty bound
+uint32_t indexNodeDecode(void* node, IndexEntry* entries, uint8_t* keys);
+
+// first cell whose entry is >= (key, id)
+uint32_t indexLeafLowerBound(void* node, const uint8_t* key, uint32_t length, uint32_t id);
+
+// index of the child of an internal index node that covers (key, id),
+// numCells for the right child, and the page it names
+uint32_t indexInternalFindChild(void* node, const uint8_t* key, uint32_t length, uint32_t id);
+uint32_t indexNodeChild(void* node, uint32_t index);
+
+// rewrite a node from scratch with these entries, sharing the leaf's
+// prefix; false if they don't fit, leaving the node untouched
+bool indexNodeBuild(void* node, NodeType type, IndexEntry* entries, uint32_t count, uint32_t rightChild);
+
+// choose where to split entries so both halves fit
+uint32_t indexChooseSplit(NodeType type, IndexEntry* entries, uint32_t count);
+
+// walk from the root to the leaf for (key, id), recording the path. the
+// leaf comes back pinned
+void* indexDescend(Table* table, IndexColumn column, const uint8_t* key, uint32_t length, uint32_t id,
+    uint32_t* pageNum, uint32_t* path, uint32_t* pathIndex, uint32_t* depth);
+
+// add (key, id) to an index, splitting as needed. the caller holds the
+// index lock exclusively
+void indexInsert(Table* table, IndexColumn column, const uint8_t* key, uint32_t length, uint32_t id);
+void indexInsertSplit(Table* table, IndexColumn column, uint32_t* path, uint32_t* pathIndex, uint32_t level,
+    IndexEntry* leftMax, uint32_t rightChildPageNum);
+void indexCreateNewRoot(Table* table, IndexColumn column, uint32_t rightChildPageNum, IndexEntry* leftMax);
+
+// add every row in the table to an index
+void indexPopulate(Table* table, IndexColumn column);
+
+// give a table a new, filled index; the caller keeps writers out
+void indexCreate(Table* table, IndexColumn column);
+
+// remove (key, id) from an index if it is there. leaves are not merged,
+// an empty one just stays on the chain until the next .vacuum
+void indexDelete(Table* table, IndexColumn column, const uint8_t* key, uint32_t length, uint32_t id);
+
+// handles "create index on username|email"
+PrepareResult prepareCreateIndex(InputBuffer* inputBuffer, Statement* statement);
+ExecuteResult executeCreateIndex(Statement* statement, Table* table);
+
+// select where username|email = value, through the index if there is
+// one. prefix matches always scan, so they come out in id order too
+ExecuteResult executeSelectByColumn(Statement* statement, Table* table, OutputBuffer* output);
+
+// select count(*), min(id), max(id). the id range is cut into subtrees
+// of a snapshot at the separators of the highest level with enough
+// children, and a thread per core takes subtrees until none are left
+ExecuteResult executeAggregate(Statement* statement, Table* table, OutputBuffer* output);
+
+// split [minId, maxId] of the snapshot into at least target subtrees, or
+// as many as its lowest internal level has. returns how many, with their
+// roots and bounds in *ranges, which the caller frees
+uint32_t aggregateRanges(Table* table, Snapshot* snapshot, uint32_t minId, uint32_t maxId, uint32_t target,
+                         AggregateRange** ranges);
+
+// the worker threads' loop: claim a range, scan it, repeat
+void* aggregateWorkerMain(void* argument);
+void aggregateScanRange(AggregateScan* scan, AggregateRange* range, AggregateResult* result);
+
 // visualize btree
 void printTree(Pager* pager, uint32_t page_num, uint32_t indentation_level);
 void indent(uint32_t level);
 
+// bulk load input is either CSV lines "id,username,email" or a binary row
+// file: ROW_FILE_MAGIC followed by records laid out as
+// { uint32 id, uint8 usernameLen, uint8 emailLen, username, email }
+// and optionally ended early by a record whose usernameLen is
+// ROW_FILE_END_LENGTH, as binary select output is
+#define ROW_FILE_MAGIC "RDBROWS1"
+#define ROW_FILE_MAGIC_SIZE 8
+#define ROW_FILE_END_LENGTH 0xFF
+#define LOAD_DEFAULT_FILL_PERCENT 90
+#define LOAD_SORT_RUN_ROWS 131072
+#define LOAD_IO_BUFFER_SIZE (1 << 20)
+
+typedef struct {
+    FILE* file;
+    RowFormat format;
+    char* line;
+    size_t lineLen;
+    uint64_t lineNum;
+} RowSource;
+
+// builds a tree bottom-up from rows arriving in strictly increasing key order
+typedef struct {
+    Table* table;
+    // bytes of cell space to fill in each leaf
+    uint32_t leafCapacity;
+    uint32_t internalCapacity;
+    uint32_t leafPageNum;
+    void* leaf;
+    uint32_t lastKey;
+    uint64_t rowsLoaded;
+    uint64_t duplicates;
+    // finished leaves, as page numbers and their max keys
+    uint32_t* children;
+    uint32_t* keys;
+    uint32_t numChildren;
+    uint32_t childCapacity;
+} BulkLoader;
+
+// open a row file, detecting its format from the leading magic
+bool rowSourceOpen(RowSource* source, const char* filename);
+void rowSourceAttach(RowSource* source, FILE* file);
+void rowSourceClose(RowSource* source);
+
+// read the next row; returns 1 on a row, 0 at end of input, -1 on bad input
+int rowSourceNext(RowSource* source, Row* row);
+
+// append one row to a binary row file
+void writeRowRecord(FILE* file, Row* row);
+
+// bottom-up tree construction into an empty table
+void bulkLoaderInit(BulkLoader* loader, Table* table, uint32_t fillPercent);
+void bulkLoaderAdd(BulkLoader* loader, Row* row);
+void bulkLoaderFinish(BulkLoader* loader);
+void* bulkLoaderNewPage(BulkLoader* loader, uint32_t* pageNum);
+
+// split unsorted input into sorted runs on temporary files, then merge them
+bool sortRowsExternally(RowSource* source, BulkLoader* loader);
+
+// handles ".load <file> [fill percent]"
+void executeLoad(Table* table, const char* filename, uint32_t fillPercent);
+
+// batch mode, for scripts and piped input: no prompts, input read in large
+// blocks, and output gathered into one buffer. each block read shares one
+// commit, and the total statement count and time go to stderr at the end
+#define BATCH_READ_SIZE (1 << 20)
+
+void batchRun(Table* table, int fileDescriptor);
+
+// commit, then write out the replies gathered so far
+void batchFlush(Table* table, OutputBuffer* output);
+
+// server mode. clients send the same statements as the REPL, one per line,
+// and may send many without waiting; replies come back in order, without
+// prompts. every statement read in one pass over ready connections shares
+// one commit, and each connection's replies go out in one write after it.
+// a select is the exception: it commits what came before it and streams
+// its rows, so one large result doesn't have to fit in memory
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_SIZE 65536
+// a line this long without a newline is not a statement; drop the client
+#define SERVER_MAX_LINE (1 << 20)
+// stop reading from a client that has this much unsent output
+#define SERVER_MAX_PENDING (4 << 20)
+
+typedef struct {
+    int fileDescriptor;
+    // bytes received and not yet executed; inputLen is how many
+    InputBuffer* input;
+    OutputBuffer* output;
+    size_t outputSent;
+    // events currently registered with epoll
+    uint32_t events;
+    // the client sent .exit or hung up; close once the replies are out
+    bool closing;
+} Connection;
+
+// listen on "host:port", ":port", or a Unix socket path, and serve until
+// SIGINT or SIGTERM
+void serverRun(Table* table, const char* address);
+int serverListen(const char* address);
+void serverAccept(int epollFd, int listenFd);
+
+// read what the client has sent; false once it has hung up
+bool connectionRead(Connection* connection);
+
+// execute complete lines until the input runs out or output backs up
+void connectionProcess(Connection* connection, Table* table);
+
+// run a select that streams its rows to the client as it goes
+void connectionSelect(Connection* connection, InputBuffer* statementInput, Table* table);
+
+// write pending replies; false if the client is gone
+bool connectionFlush(Connection* connection);
+
+// pick epoll events from the connection's state, or close it when done
+void connectionUpdate(int epollFd, Connection* connection);
+void connectionClose(int epollFd, Connection* connection);
+
 #endif // DB_H_
\ No newline at end of file
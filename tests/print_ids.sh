@@ -0,0 +1,71 @@
+#!/bin/sh
+# text rows with the widest ids: ten digits, and ids from 2^31 up, which
+# print unsigned and load back from a csv export. the long select reaches the end of the output buffer
+# just where a ten-digit row needs one byte more than it had reserved.
+# built with AddressSanitizer so writing past the buffer fails the check.
+# usage: tests/print_ids.sh (run by make check)
+set -e
+
+CC=${CC:-cc}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+$CC -O1 -g -fsanitize=address -o "$dir/db" db.c -lpthread
+
+# 22 short rows take 233 bytes; 55175 ten-digit rows of 19 bytes bring
+# the next one to 18 bytes before the 1 MB batch buffer ends
+{
+    i=1
+    while [ $i -le 22 ]; do
+        echo "insert $i a b"
+        i=$((i + 1))
+    done
+    i=1000000000
+    while [ $i -lt 1000055200 ]; do
+        echo "insert $i a b"
+        i=$((i + 1))
+    done
+    echo "select"
+} > "$dir/script.txt"
+"$dir/db" "$dir/wide.db" < "$dir/script.txt" 2> "$dir/err.txt" > "$dir/out.txt" || {
+    cat "$dir/err.txt"
+    exit 1
+}
+rows=$(grep -c '^(' "$dir/out.txt")
+if [ "$rows" -ne 55222 ]; then
+    echo "wide ids: expected 55222 rows, got $rows"
+    exit 1
+fi
+grep -qx '(1000055175, a, b)' "$dir/out.txt" || {
+    echo "wide ids: row 1000055175 is missing or garbled"
+    exit 1
+}
+
+printf '3000000000,big,n@x.com\n4294967295,max,m@x.com\n2147483648,half,q@x.com\n' > "$dir/big.csv"
+printf '.load %s\nselect\n.mode csv\nselect\n' "$dir/big.csv" | "$dir/db" "$dir/big.db" 2> "$dir/err.txt" > "$dir/out.txt" || {
+    cat "$dir/err.txt"
+    exit 1
+}
+printf '(2147483648, half, q@x.com)\n(3000000000, big, n@x.com)\n(4294967295, max, m@x.com)\n' > "$dir/expected.txt"
+grep '^(' "$dir/out.txt" | diff "$dir/expected.txt" - || {
+    echo "big ids: text rows differ"
+    exit 1
+}
+
+# the csv export loads back into a fresh table
+sed -n '/^id,username,email$/,/^Ran /p' "$dir/out.txt" | grep -v '^Ran ' > "$dir/export.csv"
+printf '.load %s\n.mode csv\nselect\n' "$dir/export.csv" | "$dir/db" "$dir/reload.db" 2> "$dir/err.txt" > "$dir/reload.txt" || {
+    cat "$dir/err.txt"
+    exit 1
+}
+grep -q '^Loaded 3 rows' "$dir/reload.txt" || {
+    echo "big ids: csv export did not load back"
+    cat "$dir/reload.txt"
+    exit 1
+}
+sed -n '/^id,username,email$/,/^Ran /p' "$dir/reload.txt" | grep -v '^Ran ' | diff "$dir/export.csv" - || {
+    echo "big ids: reloaded rows differ"
+    exit 1
+}
+
+echo "print_ids: ok"